@@ -0,0 +1,310 @@
+#include <blazevg.hh>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace bvg;
+
+namespace {
+
+enum class ShapeType {
+    Convex,
+    Concave,
+    Spiky,
+    SelfTouching
+};
+
+const ShapeType shapeTypes[] = {
+    ShapeType::Convex,
+    ShapeType::Concave,
+    ShapeType::Spiky,
+    ShapeType::SelfTouching
+};
+
+const char* shapeName(ShapeType type) {
+    switch(type) {
+        case ShapeType::Convex:
+            return "convex";
+        case ShapeType::Concave:
+            return "concave";
+        case ShapeType::Spiky:
+            return "spiky";
+        case ShapeType::SelfTouching:
+            return "self-touching";
+    }
+    return "";
+}
+
+// Closed outline of the shape around the origin, without repeating
+// the first point. Shapes of the same type and size are always equal
+std::vector<glm::vec2> createShape(ShapeType type, size_t numPoints) {
+    std::mt19937 random((unsigned int)numPoints * 4 + (unsigned int)type);
+    std::uniform_real_distribution<float> spike(0.1f, 1.0f);
+    std::vector<glm::vec2> points;
+    points.reserve(numPoints);
+    const float radius = 500.0f;
+    const float pi2 = (float)M_PI * 2.0f;
+
+    if(type == ShapeType::SelfTouching) {
+        // Two lobes that touch at the origin
+        size_t half = numPoints / 2;
+        for(size_t i = 0; i < numPoints; i++) {
+            bool isLeft = i < half;
+            size_t lobePoints = isLeft ? half : numPoints - half;
+            float t = (float)(isLeft ? i : i - half) / (float)lobePoints;
+            float angle = t * pi2;
+            float x = radius * (1.0f - cosf(angle));
+            float y = radius * sinf(angle);
+            points.push_back(isLeft ? glm::vec2(-x, y) : glm::vec2(x, -y));
+        }
+        return points;
+    }
+
+    for(size_t i = 0; i < numPoints; i++) {
+        float angle = -(float)i / (float)numPoints * pi2;
+        float r = radius;
+        if(type == ShapeType::Concave)
+            r *= i % 2 == 0 ? 1.0f : 0.6f;
+        else if(type == ShapeType::Spiky)
+            r *= spike(random);
+        points.push_back(glm::vec2(cosf(angle), sinf(angle)) * r);
+    }
+    return points;
+}
+
+struct Options {
+    std::string filter;
+    size_t maxPoints = 1000000;
+    // Triangulation is quadratic, so it gets a lower limit
+    size_t maxTriangulatePoints = 10000;
+    double minTime = 0.05;
+};
+
+struct Case {
+    std::string name;
+    std::string shape;
+    size_t numPoints;
+};
+
+// Results are summed into it, so that the work isn't optimized away
+volatile size_t sink = 0;
+
+bool isFirstResult = true;
+
+// Leaves the object open for the fields of the run
+void writeResult(const Case& benchCase, size_t iterations, double seconds) {
+    double nanoseconds = seconds * 1e9 / (double)iterations;
+    double pointsPerSecond = (double)benchCase.numPoints * (double)iterations / seconds;
+    if(!isFirstResult)
+        std::cout << ",";
+    isFirstResult = false;
+    std::cout << "\n    {\"name\": \"" << benchCase.name << "\", " <<
+        "\"shape\": \"" << benchCase.shape << "\", " <<
+        "\"points\": " << benchCase.numPoints << ", " <<
+        "\"iterations\": " << iterations << ", " <<
+        "\"nanosecondsPerIteration\": " << nanoseconds << ", " <<
+        "\"pointsPerSecond\": " << pointsPerSecond;
+}
+
+// Runs the function in batches that double in size until
+// the minimum time is reached
+void run(const Options& options, const Case& benchCase, const std::function<size_t()>& function) {
+    if(!options.filter.empty() && benchCase.name.find(options.filter) == std::string::npos)
+        return;
+    std::cerr << benchCase.name << " " << benchCase.shape << " " <<
+        benchCase.numPoints << std::endl;
+
+    sink = sink + function();
+
+    size_t iterations = 0;
+    size_t batch = 1;
+    double seconds = 0.0;
+#ifdef BLAZEVG_COUNT_ALLOCATIONS
+    AllocationStats start = threadAllocations();
+#endif
+    while(seconds < options.minTime) {
+        auto batchStart = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < batch; i++)
+            sink = sink + function();
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - batchStart;
+        seconds += duration.count();
+        iterations += batch;
+        batch *= 2;
+    }
+#ifdef BLAZEVG_COUNT_ALLOCATIONS
+    AllocationStats allocations = threadAllocations() - start;
+#endif
+    writeResult(benchCase, iterations, seconds);
+#ifdef BLAZEVG_COUNT_ALLOCATIONS
+    std::cout << ", \"allocationsPerIteration\": " <<
+        (double)allocations.heapAllocations / (double)iterations;
+#endif
+    std::cout << "}";
+}
+
+void benchShape(const Options& options, ShapeType type, size_t numPoints) {
+    std::vector<glm::vec2> points = createShape(type, numPoints);
+    std::string shape = shapeName(type);
+    const float lineWidth = 4.0f;
+
+    run(options, { "strokePolyline", shape, numPoints }, [&]() {
+        return factory::strokePolyline(points, lineWidth).indices.size();
+    });
+
+    // Joins and caps at every point of the polyline
+    std::vector<std::vector<glm::vec2>> segments;
+    segments.reserve(numPoints);
+    for(size_t i = 0; i < numPoints; i++)
+        segments.push_back({ points[i], points[(i + 1) % numPoints] });
+
+    run(options, { "bevelJoin", shape, numPoints }, [&]() {
+        size_t size = 0;
+        for(size_t i = 0; i < numPoints; i++)
+            size += factory::bevelJoin(segments[i], segments[(i + 1) % numPoints],
+                                       lineWidth).indices.size();
+        return size;
+    });
+    run(options, { "roundJoin", shape, numPoints }, [&]() {
+        size_t size = 0;
+        for(size_t i = 0; i < numPoints; i++)
+            size += factory::roundJoin(segments[i], segments[(i + 1) % numPoints],
+                                       lineWidth).indices.size();
+        return size;
+    });
+    run(options, { "miterJoin", shape, numPoints }, [&]() {
+        size_t size = 0;
+        for(size_t i = 0; i < numPoints; i++)
+            size += factory::miterJoin(segments[i], segments[(i + 1) % numPoints],
+                                       lineWidth).indices.size();
+        return size;
+    });
+    run(options, { "roundedCap", shape, numPoints }, [&]() {
+        size_t size = 0;
+        for(size_t i = 0; i < numPoints; i++)
+            size += factory::roundedCap(segments[i][0], segments[i][0] - segments[i][1],
+                                        lineWidth).indices.size();
+        return size;
+    });
+    run(options, { "squareCap", shape, numPoints }, [&]() {
+        size_t size = 0;
+        for(size_t i = 0; i < numPoints; i++)
+            size += factory::squareCap(segments[i][0], segments[i][0] - segments[i][1],
+                                       lineWidth).indices.size();
+        return size;
+    });
+
+    run(options, { "dashedPolyline", shape, numPoints }, [&]() {
+        return factory::dashedPolyline(points, 10.0f, 5.0f).size();
+    });
+    std::vector<float> dash = { 10.0f, 5.0f, 2.0f, 5.0f };
+    run(options, { "dashedPolylineNew", shape, numPoints }, [&]() {
+        return factory::dashedPolylineNew(points, dash, 0.0f).size();
+    });
+    // Every segment dashed on its own with the offset carried over, as the
+    // context does. Segments get shorter than the pattern as the size grows
+    run(options, { "dashedSegments", shape, numPoints }, [&]() {
+        size_t size = 0;
+        float offset = 0.0f;
+        for(size_t i = 0; i < numPoints; i++) {
+            size += factory::dashedPolyline(segments[i], 10.0f, 5.0f, offset).size();
+            offset -= factory::lengthOfPolyline(segments[i]);
+        }
+        return size;
+    });
+
+    run(options, { "measurePolyline", shape, numPoints }, [&]() {
+        return factory::measurePolyline(points).size();
+    });
+    ArenaVector<float> lengths = factory::measurePolyline(points);
+    float length = factory::lengthOfPolyline(points);
+    run(options, { "tAtLength", shape, numPoints }, [&]() {
+        // Lookups spread over the whole polyline
+        const int numLookups = 16;
+        float t = 0.0f;
+        for(int i = 0; i < numLookups; i++)
+            t += factory::tAtLength(length * (float)i / (float)numLookups, lengths);
+        return (size_t)t;
+    });
+
+    Context context(1000.0f, 1000.0f);
+    context.beginPath();
+    context.moveTo(points[0].x, points[0].y);
+    for(size_t i = 1; i < numPoints; i++)
+        context.lineTo(points[i].x, points[i].y);
+    context.closePath();
+
+    if(numPoints <= options.maxTriangulatePoints) {
+        Arena arena;
+        run(options, { "earcut::triangulate", shape, numPoints }, [&]() {
+            // Rewound every iteration, as the context does after every draw
+            ArenaScope scope(&arena);
+            return earcut::triangulate(points, &arena).size();
+        });
+        run(options, { "isPointInsideFill", shape, numPoints }, [&]() {
+            return (size_t)context.isPointInsideFill(1.0f, 1.0f);
+        });
+    }
+    run(options, { "isPointInsideConvexFill", shape, numPoints }, [&]() {
+        return (size_t)context.isPointInsideConvexFill(1.0f, 1.0f);
+    });
+    run(options, { "isPointInsideStroke", shape, numPoints }, [&]() {
+        return (size_t)context.isPointInsideStroke(1.0f, 1.0f);
+    });
+}
+
+// Curve flatteners, where the size is the number of output points
+// and the shape names the curve
+void benchCurves(const Options& options, size_t numPoints) {
+    int segments = (int)numPoints;
+    glm::vec2 p0(0.0f, 0.0f), p1(100.0f, 400.0f), p2(400.0f, -300.0f), p3(500.0f, 100.0f);
+
+    run(options, { "quadraticBezier", "arch", numPoints }, [&]() {
+        return factory::quadraticBezier(p0, p1, p3, segments).size();
+    });
+    run(options, { "cubicBezier", "s-curve", numPoints }, [&]() {
+        return factory::cubicBezier(p0, p1, p2, p3, segments).size();
+    });
+    run(options, { "createArc", "circle", numPoints }, [&]() {
+        return factory::createArc(0.0f, (float)M_PI * 2.0f, 500.0f, segments,
+                                  glm::vec2(0.0f)).size();
+    });
+}
+
+void printUsage() {
+    std::cerr << "Usage: blazevg_bench [--filter name] [--max-points n] " <<
+        "[--max-triangulate-points n] [--min-time seconds]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for(int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if(hasValue && strcmp(argv[i], "--filter") == 0) {
+            options.filter = argv[++i];
+        } else if(hasValue && strcmp(argv[i], "--max-points") == 0) {
+            options.maxPoints = std::stoul(argv[++i]);
+        } else if(hasValue && strcmp(argv[i], "--max-triangulate-points") == 0) {
+            options.maxTriangulatePoints = std::stoul(argv[++i]);
+        } else if(hasValue && strcmp(argv[i], "--min-time") == 0) {
+            options.minTime = std::stod(argv[++i]);
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    std::cout << "{\"benchmarks\": [";
+    for(size_t numPoints = 10; numPoints <= options.maxPoints; numPoints *= 10) {
+        for(ShapeType type : shapeTypes)
+            benchShape(options, type, numPoints);
+        benchCurves(options, numPoints);
+    }
+    std::cout << "\n]}" << std::endl;
+    return 0;
+}
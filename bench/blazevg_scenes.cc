@@ -0,0 +1,539 @@
+#include <blazevg.hh>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace bvg;
+
+namespace {
+
+// Font that only keeps the advances, enough to lay out text
+class NullFont : public Font {
+public:
+    std::unordered_map<int, Character> characters;
+
+protected:
+    void loadCharacter(Character& character) override {
+        characters[character.unicode] = character;
+    }
+};
+
+// Backend that tessellates paths and lays out text like a real one,
+// but only counts what it would upload. Frame times are the CPU
+// cost of blazevg alone
+class NullContext : public Context {
+public:
+    NullContext(float width, float height):
+        Context(width, height)
+    {
+    }
+
+    // Meshes are only counted, so the arena is rewound after every draw
+    void convexFill() override {
+        this->assertDrawingIsBegan();
+        ArenaScope scope(&mArena);
+        factory::ShapeMesh mesh = this->internalConvexFill();
+        this->submit(mesh);
+    }
+
+    void fill() override {
+        this->assertDrawingIsBegan();
+        ArenaScope scope(&mArena);
+        factory::ShapeMesh mesh = this->internalFill();
+        this->submit(mesh);
+    }
+
+    void stroke() override {
+        this->assertDrawingIsBegan();
+        ArenaScope scope(&mArena);
+        factory::ShapeMesh mesh = this->internalStroke();
+        this->submit(mesh);
+    }
+
+    void print(std::wstring str, float x, float y) override {
+        this->assertDrawingIsBegan();
+        NullFont* font = static_cast<NullFont*>(this->font);
+        if(font == nullptr || !font->isLoaded)
+            return;
+        float scale = this->fontSize / (float)font->size;
+        glm::vec2 pos = glm::vec2(x, y);
+        for(size_t i = 0; i < str.size(); i++) {
+            int symbol = str[i];
+            if(symbol == '\n') {
+                pos.y += (float)font->lineHeight * scale;
+                pos.x = x;
+                continue;
+            }
+            auto it = font->characters.find(symbol);
+            if(it == font->characters.end())
+                continue;
+            if(symbol != ' ') {
+                mFrameStats.text.vertices += 4;
+                mFrameStats.text.triangles += 2;
+                mFrameStats.drawCalls++;
+            }
+            pos.x += (float)it->second.advance * scale;
+        }
+    }
+
+    float measureTextWidth(std::wstring str) override {
+        NullFont* font = static_cast<NullFont*>(this->font);
+        if(font == nullptr || !font->isLoaded)
+            return 0.0f;
+        float width = 0.0f;
+        for(size_t i = 0; i < str.size() && str[i] != '\n'; i++) {
+            auto it = font->characters.find(str[i]);
+            if(it != font->characters.end())
+                width += (float)it->second.advance;
+        }
+        return width * this->fontSize / (float)font->size;
+    }
+
+    float measureTextHeight() override {
+        if(this->font == nullptr)
+            return 0.0f;
+        return (float)this->font->lineHeight * this->fontSize / (float)this->font->size;
+    }
+
+protected:
+    Font* createFont() override {
+        return new NullFont();
+    }
+
+    void fillMesh(factory::ShapeMesh& mesh, Style&) override {
+        this->submit(mesh);
+    }
+
+private:
+    void submit(factory::ShapeMesh& mesh) {
+        mFrameStats.drawCalls++;
+        mFrameStats.bytesUploaded += mesh.vertices.size() * sizeof(glm::vec2) +
+                                     mesh.indices.size() * sizeof(factory::TriangeIndices);
+    }
+};
+
+// Monospaced printable ASCII in the format of msdf-atlas-gen
+std::string createFontJson() {
+    std::ostringstream json;
+    json << "{\"atlas\": {\"distanceRange\": 4, \"size\": 32, \"width\": 512, \"height\": 512}, " <<
+        "\"metrics\": {\"lineHeight\": 1.2, \"descender\": -0.25}, \"glyphs\": [";
+    for(int unicode = 32; unicode < 127; unicode++) {
+        int column = (unicode - 32) % 16;
+        int row = (unicode - 32) / 16;
+        if(unicode != 32)
+            json << ", ";
+        json << "{\"unicode\": " << unicode << ", \"advance\": 0.6, " <<
+            "\"planeBounds\": {\"left\": 0.05, \"bottom\": -0.2, \"right\": 0.55, \"top\": 0.8}, " <<
+            "\"atlasBounds\": {\"left\": " << column * 32 << ", \"bottom\": " << row * 32 <<
+            ", \"right\": " << column * 32 + 32 << ", \"top\": " << row * 32 + 32 << "}}";
+    }
+    json << "]}";
+    return json.str();
+}
+
+std::wstring randomWord(std::mt19937& random) {
+    std::uniform_int_distribution<int> length(2, 10);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::wstring word;
+    int numLetters = length(random);
+    for(int i = 0; i < numLetters; i++)
+        word.push_back((wchar_t)letter(random));
+    return word;
+}
+
+Color randomColor(std::mt19937& random) {
+    std::uniform_real_distribution<float> channel(0.0f, 1.0f);
+    return Color(channel(random), channel(random), channel(random));
+}
+
+class Scene {
+public:
+    virtual const char* name() = 0;
+    virtual void draw(NullContext& context) = 0;
+    virtual ~Scene() {}
+};
+
+// Cards of rounded rectangles with a title and a value
+class DashboardScene : public Scene {
+public:
+    DashboardScene(std::mt19937& random) {
+        const int numCards = 5000;
+        const int numColumns = 100;
+        for(int i = 0; i < numCards; i++) {
+            Card card;
+            card.x = (float)(i % numColumns) * 60.0f;
+            card.y = (float)(i / numColumns) * 40.0f;
+            card.color = randomColor(random);
+            card.title = randomWord(random);
+            card.value = std::to_wstring(random() % 100000);
+            cards.push_back(card);
+        }
+    }
+
+    const char* name() override {
+        return "dashboard";
+    }
+
+    void draw(NullContext& context) override {
+        context.fontSize = 10.0f;
+        for(Card& card : cards) {
+            context.beginPath();
+            context.rect(card.x, card.y, 56.0f, 36.0f, 6.0f);
+            context.fillStyle = SolidColor(card.color);
+            context.fill();
+            context.fillStyle = SolidColor(colors::Black);
+            context.print(card.title, card.x + 4.0f, card.y + 4.0f);
+            context.print(card.value, card.x + 4.0f, card.y + 20.0f);
+        }
+    }
+
+private:
+    struct Card {
+        float x, y;
+        Color color;
+        std::wstring title, value;
+    };
+    std::vector<Card> cards;
+};
+
+// Random walk of 200k points with a dashed threshold line
+class LineChartScene : public Scene {
+public:
+    LineChartScene(std::mt19937& random) {
+        const int numPoints = 200000;
+        std::normal_distribution<float> step(0.0f, 2.0f);
+        float y = 500.0f;
+        for(int i = 0; i < numPoints; i++) {
+            y += step(random);
+            points.push_back(glm::vec2((float)i * 0.01f, y));
+        }
+    }
+
+    const char* name() override {
+        return "line-chart";
+    }
+
+    void draw(NullContext& context) override {
+        context.lineWidth = 1.0f;
+        context.lineJoin = LineJoin::Bevel;
+        context.strokeStyle = SolidColor(colors::Black);
+        context.lineDash = LineDash(6.0f, 3.0f);
+        context.beginPath();
+        context.moveTo(points[0].x, points[0].y);
+        for(size_t i = 1; i < points.size(); i++)
+            context.lineTo(points[i].x, points[i].y);
+        context.stroke();
+
+        context.lineDash = LineDash(2.0f, 4.0f);
+        context.beginPath();
+        context.moveTo(0.0f, 500.0f);
+        context.lineTo(points.back().x, 500.0f);
+        context.stroke();
+        context.lineDash = LineDash();
+    }
+
+private:
+    std::vector<glm::vec2> points;
+};
+
+// Regions with wiggly borders of 20k vertices and a lake inside each
+class MapScene : public Scene {
+public:
+    MapScene(std::mt19937& random) {
+        const int numRegions = 2;
+        const int numOuterPoints = 18000;
+        const int numHolePoints = 2000;
+        std::uniform_real_distribution<float> wiggle(0.95f, 1.05f);
+        const float pi2 = (float)M_PI * 2.0f;
+        for(int i = 0; i < numRegions; i++) {
+            Region region;
+            glm::vec2 center((float)i * 1200.0f + 600.0f, 600.0f);
+            region.color = randomColor(random);
+            for(int j = 0; j < numOuterPoints; j++) {
+                float angle = (float)j / (float)numOuterPoints * pi2;
+                float radius = 500.0f * wiggle(random);
+                region.outline.push_back(center + glm::vec2(cosf(angle), sinf(angle)) * radius);
+            }
+            // The hole goes the other way, starting at the angle where
+            // the outline ends, so that the bridge between them cancels
+            for(int j = 0; j <= numHolePoints; j++) {
+                float angle = -(float)j / (float)numHolePoints * pi2;
+                float radius = 150.0f * wiggle(random);
+                region.hole.push_back(center + glm::vec2(cosf(angle), sinf(angle)) * radius);
+            }
+            regions.push_back(region);
+        }
+    }
+
+    const char* name() override {
+        return "map";
+    }
+
+    void draw(NullContext& context) override {
+        context.lineWidth = 1.0f;
+        context.lineJoin = LineJoin::Miter;
+        context.strokeStyle = SolidColor(colors::Black);
+        for(Region& region : regions) {
+            context.beginPath();
+            context.moveTo(region.outline[0].x, region.outline[0].y);
+            for(size_t i = 1; i < region.outline.size(); i++)
+                context.lineTo(region.outline[i].x, region.outline[i].y);
+            context.lineTo(region.outline[0].x, region.outline[0].y);
+            for(glm::vec2& point : region.hole)
+                context.lineTo(point.x, point.y);
+            context.closePath();
+            context.fillStyle = SolidColor(region.color);
+            context.fill();
+            context.stroke();
+        }
+    }
+
+private:
+    struct Region {
+        std::vector<glm::vec2> outline, hole;
+        Color color;
+    };
+    std::vector<Region> regions;
+};
+
+// Nodes joined by curved edges with round joins
+class NodeGraphScene : public Scene {
+public:
+    NodeGraphScene(std::mt19937& random) {
+        const int numNodes = 500;
+        const int numEdges = 1000;
+        std::uniform_real_distribution<float> position(0.0f, 4000.0f);
+        for(int i = 0; i < numNodes; i++) {
+            Node node;
+            node.position = glm::vec2(position(random), position(random));
+            node.label = randomWord(random);
+            nodes.push_back(node);
+        }
+        std::uniform_int_distribution<int> index(0, numNodes - 1);
+        for(int i = 0; i < numEdges; i++)
+            edges.push_back(std::make_pair(index(random), index(random)));
+    }
+
+    const char* name() override {
+        return "node-graph";
+    }
+
+    void draw(NullContext& context) override {
+        context.lineWidth = 3.0f;
+        context.lineJoin = LineJoin::Round;
+        context.lineCap = LineCap::Round;
+        context.strokeStyle = SolidColor(Color(0.3f, 0.3f, 0.3f));
+        for(auto& edge : edges) {
+            glm::vec2 a = nodes[edge.first].position + glm::vec2(80.0f, 20.0f);
+            glm::vec2 b = nodes[edge.second].position + glm::vec2(0.0f, 20.0f);
+            float bend = std::abs(b.x - a.x) * 0.5f + 40.0f;
+            context.beginPath();
+            context.moveTo(a.x, a.y);
+            context.cubicTo(a.x + bend, a.y, b.x - bend, b.y, b.x, b.y);
+            context.stroke();
+        }
+        context.lineCap = LineCap::Butt;
+        context.fontSize = 12.0f;
+        for(Node& node : nodes) {
+            context.beginPath();
+            context.rect(node.position.x, node.position.y, 80.0f, 40.0f, 8.0f);
+            context.fillStyle = SolidColor(colors::White);
+            context.fill();
+            context.stroke();
+            context.fillStyle = SolidColor(colors::Black);
+            context.print(node.label, node.position.x + 8.0f, node.position.y + 12.0f);
+        }
+    }
+
+private:
+    struct Node {
+        glm::vec2 position;
+        std::wstring label;
+    };
+    std::vector<Node> nodes;
+    std::vector<std::pair<int, int>> edges;
+};
+
+// Page of small text printed line by line
+class TextPageScene : public Scene {
+public:
+    TextPageScene(std::mt19937& random) {
+        const int numLines = 200;
+        const size_t lineLength = 120;
+        for(int i = 0; i < numLines; i++) {
+            std::wstring line;
+            while(line.size() < lineLength) {
+                line += randomWord(random);
+                line.push_back(L' ');
+            }
+            lines.push_back(line);
+        }
+    }
+
+    const char* name() override {
+        return "text-page";
+    }
+
+    void draw(NullContext& context) override {
+        context.fontSize = 8.0f;
+        context.fillStyle = SolidColor(colors::Black);
+        float lineHeight = context.measureTextHeight();
+        for(size_t i = 0; i < lines.size(); i++)
+            context.print(lines[i], 10.0f, 10.0f + (float)i * lineHeight);
+    }
+
+private:
+    std::vector<std::wstring> lines;
+};
+
+struct Options {
+    std::string filter;
+    unsigned int seed = 1;
+    int maxFrames = 60;
+    double minTime = 1.0;
+};
+
+// Averages of the frame stats over the measured frames
+struct SceneResult {
+    int frames = 0;
+    double seconds = 0.0;
+    FrameStats sum;
+};
+
+void addStats(FrameStats& sum, const FrameStats& stats) {
+    sum.paths += stats.paths;
+    sum.flattenedPoints += stats.flattenedPoints;
+    const GeometryStats* from[] = { &stats.fill, &stats.stroke, &stats.join, &stats.cap,
+                                    &stats.text };
+    GeometryStats* to[] = { &sum.fill, &sum.stroke, &sum.join, &sum.cap, &sum.text };
+    for(int i = 0; i < 5; i++) {
+        to[i]->vertices += from[i]->vertices;
+        to[i]->triangles += from[i]->triangles;
+    }
+    sum.flatteningTime += stats.flatteningTime;
+    sum.triangulationTime += stats.triangulationTime;
+    sum.strokingTime += stats.strokingTime;
+    sum.dashingTime += stats.dashingTime;
+    sum.drawCalls += stats.drawCalls;
+    sum.bytesUploaded += stats.bytesUploaded;
+    sum.allocations.heapAllocations += stats.allocations.heapAllocations;
+    sum.allocations.heapBytes += stats.allocations.heapBytes;
+}
+
+SceneResult runScene(const Options& options, Scene& scene, NullContext& context) {
+    SceneResult result;
+    while(result.frames < options.maxFrames && (result.frames == 0 ||
+                                                 result.seconds < options.minTime)) {
+        auto start = std::chrono::steady_clock::now();
+        context.beginDrawing();
+        scene.draw(context);
+        context.endDrawing();
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        result.seconds += duration.count();
+        result.frames++;
+        addStats(result.sum, context.frameStats());
+    }
+    return result;
+}
+
+void writeResult(Scene& scene, SceneResult& result, bool isFirst) {
+    double frames = (double)result.frames;
+    const FrameStats& sum = result.sum;
+    double frameTime = result.seconds * 1000.0 / frames;
+    size_t vertices = sum.fill.vertices + sum.stroke.vertices + sum.join.vertices +
+                      sum.cap.vertices + sum.text.vertices;
+    size_t triangles = sum.fill.triangles + sum.stroke.triangles + sum.join.triangles +
+                       sum.cap.triangles + sum.text.triangles;
+    if(!isFirst)
+        std::cout << ",";
+    std::cout << "\n    {\"scene\": \"" << scene.name() << "\", " <<
+        "\"frames\": " << result.frames << ", " <<
+        "\"framesPerSecond\": " << frames / result.seconds << ", " <<
+        "\"millisecondsPerFrame\": " << frameTime << ",\n     ";
+#ifdef BLAZEVG_FRAME_TIMINGS
+    // Dashing is a part of stroking
+    double other = frameTime - (sum.flatteningTime + sum.triangulationTime +
+                                sum.strokingTime) / frames;
+    std::cout << "\"phases\": {\"flattening\": " << sum.flatteningTime / frames << ", " <<
+        "\"triangulation\": " << sum.triangulationTime / frames << ", " <<
+        "\"stroking\": " << sum.strokingTime / frames << ", " <<
+        "\"dashing\": " << sum.dashingTime / frames << ", " <<
+        "\"other\": " << other << "},\n     ";
+#endif
+    std::cout << "\"paths\": " << sum.paths / result.frames << ", " <<
+        "\"flattenedPoints\": " << sum.flattenedPoints / result.frames << ", " <<
+        "\"vertices\": " << vertices / result.frames << ", " <<
+        "\"triangles\": " << triangles / result.frames << ", " <<
+        "\"drawCalls\": " << sum.drawCalls / result.frames << ", " <<
+        "\"bytesUploaded\": " << sum.bytesUploaded / result.frames;
+#ifdef BLAZEVG_COUNT_ALLOCATIONS
+    std::cout << ", \"heapAllocations\": " << sum.allocations.heapAllocations / result.frames;
+#endif
+    std::cout << "}";
+}
+
+void printUsage() {
+    std::cerr << "Usage: blazevg_scenes [--filter name] [--seed n] [--max-frames n] " <<
+        "[--min-time seconds]" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for(int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if(hasValue && strcmp(argv[i], "--filter") == 0) {
+            options.filter = argv[++i];
+        } else if(hasValue && strcmp(argv[i], "--seed") == 0) {
+            options.seed = (unsigned int)std::stoul(argv[++i]);
+        } else if(hasValue && strcmp(argv[i], "--max-frames") == 0) {
+            options.maxFrames = std::max(1, std::stoi(argv[++i]));
+        } else if(hasValue && strcmp(argv[i], "--min-time") == 0) {
+            options.minTime = std::stod(argv[++i]);
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    NullContext context(1920.0f, 1080.0f);
+    std::string fontJson = createFontJson();
+    std::vector<unsigned char> atlas(512 * 512 * 4, 0);
+    context.loadFontFromMemory(fontJson, "mono", atlas.data(), 512, 512, 4);
+    context.font = context.fonts["mono"];
+
+    // Every scene gets its own generator, so that
+    // filtering doesn't change the others
+    std::vector<std::unique_ptr<Scene>> scenes;
+    std::mt19937 random(options.seed);
+    scenes.emplace_back(new DashboardScene(random));
+    random.seed(options.seed + 1);
+    scenes.emplace_back(new LineChartScene(random));
+    random.seed(options.seed + 2);
+    scenes.emplace_back(new MapScene(random));
+    random.seed(options.seed + 3);
+    scenes.emplace_back(new NodeGraphScene(random));
+    random.seed(options.seed + 4);
+    scenes.emplace_back(new TextPageScene(random));
+
+    std::cout << "{\"seed\": " << options.seed << ", \"scenes\": [";
+    bool isFirst = true;
+    for(std::unique_ptr<Scene>& scene : scenes) {
+        if(!options.filter.empty() && std::string(scene->name()).find(options.filter) ==
+           std::string::npos)
+            continue;
+        std::cerr << scene->name() << std::endl;
+        SceneResult result = runScene(options, *scene, context);
+        writeResult(*scene, result, isFirst);
+        isFirst = false;
+    }
+    std::cout << "\n]}" << std::endl;
+    return 0;
+}
@@ -2,6 +2,10 @@
 #include <blazevg.hh>
 
 #include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <unordered_set>
 
 #ifdef __APPLE__
 #define PLATFORM_MACOS 1
@@ -21,6 +25,20 @@ namespace bvg {
 
 namespace shader {
 
+// Put before every pixel shader of the context. Blending modes that
+// ignore the source alpha get it folded into the color instead
+static const char* PSPrelude = R"(
+float4 foldAlpha(float4 color)
+{
+#if defined(FOLD_ALPHA_OVER_BLACK)
+    color.rgb *= color.a;
+#elif defined(FOLD_ALPHA_OVER_WHITE)
+    color.rgb = color.rgb * color.a + (1.0 - color.a);
+#endif
+    return color;
+}
+)";
+
 namespace solidcol {
 
 struct PSConstants {
@@ -35,7 +53,8 @@ cbuffer Constants
 
 struct PSInput
 {
-    float4 Pos   : SV_POSITION;
+    float4 Pos      : SV_POSITION;
+    float  Coverage : COVERAGE;
 };
 struct PSOutput
 {
@@ -48,6 +67,8 @@ void main(in  PSInput  PSIn,
     // float2 UV = PSIn.Pos / g_Resolution;
 
     PSOut.Color = g_Color;
+    PSOut.Color.a *= PSIn.Coverage;
+    PSOut.Color = foldAlpha(PSOut.Color);
 }
 )";
 
@@ -65,11 +86,14 @@ struct GradientConstants {
     
     Color startColor;
     Color endColor;
-    glm::vec2 startPos;
-    glm::vec2 endPos;
-    glm::vec2 resolution;
-    float radiusOrAngle;
-    Type type;
+    // Rows of the affine transform from pixel position to gradient space.
+    // Linear gradient uses only the first row, which gives t directly
+    glm::vec4 transformX = glm::vec4(0.0f);
+    glm::vec4 transformY = glm::vec4(0.0f);
+    // Scale and bias of t and V coordinate of the color ramp
+    glm::vec4 ramp = glm::vec4(0.0f);
+    // Not read by the shaders, selects the pipeline state
+    Type type = Type::Linear;
 };
 
 namespace grad {
@@ -78,109 +102,109 @@ struct PSConstants {
     GradientConstants gradient;
 };
 
-static const char* PSSource = R"(
+static const char* LinearPSSource = R"(
 cbuffer Constants
 {
     float4 g_StartColor;
     float4 g_EndColor;
-    float2 g_StartPos;
-    float2 g_EndPos;
-    float2 g_Resolution;
-    float g_RadiusOrAngle;
-    int g_Type;
+    float4 g_TransformX;
+    float4 g_TransformY;
+    float4 g_Ramp;
 };
 
-Texture2D    g_Background;
-SamplerState g_Background_sampler;
+Texture2D    g_RampTexture;
+SamplerState g_RampTexture_sampler;
 
 struct PSInput
 {
-    float4 Pos   : SV_POSITION;
+    float4 Pos      : SV_POSITION;
+    float  Coverage : COVERAGE;
 };
 struct PSOutput
 {
     float4 Color : SV_TARGET;
 };
 
-float4 linearGradient(PSInput PSIn) {
-    float2 gradientStartPos = g_StartPos;
-    float2 gradientEndPos = g_EndPos;
-    
-    float4 colorStart = g_StartColor;
-    float4 colorEnd = g_EndColor;
-    
-    // This is the angle of the gradient in radians
-    float alpha = atan2(
-        gradientEndPos.y - gradientStartPos.y,
-        gradientEndPos.x - gradientStartPos.x
-    );
-    
-    float gradientStartPosRotatedX = gradientStartPos.x * cos(-alpha) -
-        gradientStartPos.y * sin(-alpha);
-    float gradientEndPosRotatedX = gradientEndPos.x * cos(-alpha) -
-        gradientEndPos.y * sin(-alpha);
-    float gradientLength = gradientEndPosRotatedX - gradientStartPosRotatedX;
-    
-    float2 UV = PSIn.Pos / g_Resolution;
-
-    float LocRotatedX = UV.x * cos(-alpha) - UV.y * sin(-alpha);
-    
-    float t = smoothstep(
-        gradientStartPosRotatedX,
-        gradientStartPosRotatedX + gradientLength,
-        LocRotatedX
-    );
-
-    return lerp(
-        colorStart,
-        colorEnd,
-        t
-    );
+void main(in  PSInput  PSIn,
+          out PSOutput PSOut)
+{
+    float t = dot(g_TransformX.xyz, float3(PSIn.Pos.xy, 1.0));
+    PSOut.Color = g_RampTexture.SampleLevel(g_RampTexture_sampler,
+                                            float2(saturate(t) * g_Ramp.x + g_Ramp.y, g_Ramp.z), 0.0);
+    PSOut.Color.a *= PSIn.Coverage;
+    PSOut.Color = foldAlpha(PSOut.Color);
 }
+)";
 
-float4 radialGradient(PSInput PSIn) {
-    float dist = length(PSIn.Pos - g_StartPos * g_Resolution);
-    float t = dist / g_RadiusOrAngle;
-    t = clamp(t, 0.0, 1.0);
-    return lerp(
-        g_StartColor,
-        g_EndColor,
-        t
-    );
-}
+static const char* RadialPSSource = R"(
+cbuffer Constants
+{
+    float4 g_StartColor;
+    float4 g_EndColor;
+    float4 g_TransformX;
+    float4 g_TransformY;
+    float4 g_Ramp;
+};
+
+Texture2D    g_RampTexture;
+SamplerState g_RampTexture_sampler;
+
+struct PSInput
+{
+    float4 Pos      : SV_POSITION;
+    float  Coverage : COVERAGE;
+};
+struct PSOutput
+{
+    float4 Color : SV_TARGET;
+};
 
-float2 rotate(float2 v, float angle) {
-    return float2(
-            v.x * cos(angle) - v.y * sin(angle),
-            v.x * sin(angle) + v.y * cos(angle)
-    );
+void main(in  PSInput  PSIn,
+          out PSOutput PSOut)
+{
+    float3 pos = float3(PSIn.Pos.xy, 1.0);
+    float2 relative = float2(dot(g_TransformX.xyz, pos), dot(g_TransformY.xyz, pos));
+    float t = saturate(length(relative));
+    PSOut.Color = g_RampTexture.SampleLevel(g_RampTexture_sampler,
+                                            float2(t * g_Ramp.x + g_Ramp.y, g_Ramp.z), 0.0);
+    PSOut.Color.a *= PSIn.Coverage;
+    PSOut.Color = foldAlpha(PSOut.Color);
 }
+)";
 
-float4 conicGradient(PSInput PSIn) {
-    float pi = 3.14;
+static const char* ConicPSSource = R"(
+cbuffer Constants
+{
+    float4 g_StartColor;
+    float4 g_EndColor;
+    float4 g_TransformX;
+    float4 g_TransformY;
+    float4 g_Ramp;
+};
 
-    float2 UV = PSIn.Pos / g_Resolution;
-    float2 relative = rotate(UV - g_StartPos, -g_RadiusOrAngle);
+Texture2D    g_RampTexture;
+SamplerState g_RampTexture_sampler;
 
-    float angle = atan2(relative.x, relative.y);
-    float t = (angle + pi) / 2.0 / pi;
-    
-    return lerp(
-        g_StartColor,
-        g_EndColor,
-        t
-    );
-}
+struct PSInput
+{
+    float4 Pos      : SV_POSITION;
+    float  Coverage : COVERAGE;
+};
+struct PSOutput
+{
+    float4 Color : SV_TARGET;
+};
 
 void main(in  PSInput  PSIn,
           out PSOutput PSOut)
 {
-    if(g_Type == 0)
-        PSOut.Color = linearGradient(PSIn);
-    else if(g_Type == 1)
-        PSOut.Color = radialGradient(PSIn);
-    else if(g_Type == 2)
-        PSOut.Color = conicGradient(PSIn);
+    float3 pos = float3(PSIn.Pos.xy, 1.0);
+    float2 relative = float2(dot(g_TransformX.xyz, pos), dot(g_TransformY.xyz, pos));
+    float t = atan2(relative.x, relative.y) / 6.28318530718 + 0.5;
+    PSOut.Color = g_RampTexture.SampleLevel(g_RampTexture_sampler,
+                                            float2(t * g_Ramp.x + g_Ramp.y, g_Ramp.z), 0.0);
+    PSOut.Color.a *= PSIn.Coverage;
+    PSOut.Color = foldAlpha(PSOut.Color);
 }
 )";
 
@@ -192,6 +216,7 @@ static const char* GlyphVSSource = R"(
 cbuffer Constants
 {
     float4x4 g_ModelViewProj;
+    float g_Depth;
 };
 
 struct VSInput
@@ -210,6 +235,7 @@ void main(in  VSInput VSIn,
           out PSInput PSIn)
 {
     PSIn.Pos = mul(float4(VSIn.Pos, 0.0, 1.0), g_ModelViewProj);
+    PSIn.Pos.z = g_Depth * PSIn.Pos.w;
     PSIn.UV = VSIn.TexCoord;
 }
 )";
@@ -230,14 +256,17 @@ cbuffer Constants
     bool g_IsLinearGradient;
     float4 g_StartColor;
     float4 g_EndColor;
-    float2 g_StartPos;
-    float2 g_EndPos;
-    float2 g_Resolution;
+    float4 g_TransformX;
+    float4 g_TransformY;
+    float4 g_Ramp;
 };
 
 Texture2D    g_Texture;
 SamplerState g_Texture_sampler;
 
+Texture2D    g_RampTexture;
+SamplerState g_RampTexture_sampler;
+
 struct PSInput
 {
     float4 Pos   : SV_POSITION;
@@ -249,39 +278,9 @@ struct PSOutput
 };
 
 float4 linearGradient(PSInput PSIn) {
-    float2 gradientStartPos = g_StartPos;
-    float2 gradientEndPos = g_EndPos;
-    
-    float4 colorStart = g_StartColor;
-    float4 colorEnd = g_EndColor;
-    
-    // This is the angle of the gradient in radians
-    float alpha = atan2(
-        gradientEndPos.y - gradientStartPos.y,
-        gradientEndPos.x - gradientStartPos.x
-    );
-    
-    float gradientStartPosRotatedX = gradientStartPos.x * cos(-alpha) -
-        gradientStartPos.y * sin(-alpha);
-    float gradientEndPosRotatedX = gradientEndPos.x * cos(-alpha) -
-        gradientEndPos.y * sin(-alpha);
-    float gradientLength = gradientEndPosRotatedX - gradientStartPosRotatedX;
-    
-    float2 UV = PSIn.Pos / g_Resolution;
-
-    float LocRotatedX = UV.x * cos(-alpha) - UV.y * sin(-alpha);
-    
-    float t = smoothstep(
-        gradientStartPosRotatedX,
-        gradientStartPosRotatedX + gradientLength,
-        LocRotatedX
-    );
-
-    return lerp(
-        colorStart,
-        colorEnd,
-        t
-    );
+    float t = saturate(dot(g_TransformX.xyz, float3(PSIn.Pos.xy, 1.0)));
+    return g_RampTexture.SampleLevel(g_RampTexture_sampler,
+                                     float2(t * g_Ramp.x + g_Ramp.y, g_Ramp.z), 0.0);
 }
 
 float median(float r, float g, float b) {
@@ -308,6 +307,7 @@ void main(in  PSInput  PSIn,
         PSOut.Color = g_Color;
     }
     PSOut.Color.a *= Opacity;
+    PSOut.Color = foldAlpha(PSOut.Color);
 }
 )";
 
@@ -315,75 +315,827 @@ void main(in  PSInput  PSIn,
 
 struct VSConstants {
     glm::mat4 MVP;
+    float depth = 1.0f;
+    float _padding[3];
 };
 
 static const char* VSSource = R"(
 cbuffer Constants
 {
     float4x4 g_ModelViewProj;
+    float g_Depth;
+};
+
+struct VSInput
+{
+    // Position and coverage
+    float3 Pos   : ATTRIB0;
+};
+
+struct PSInput
+{
+    float4 Pos      : SV_POSITION;
+    float  Coverage : COVERAGE;
+};
+
+void main(in  VSInput VSIn,
+          out PSInput PSIn)
+{
+    PSIn.Pos = mul(float4(VSIn.Pos.xy, 0.0, 1.0), g_ModelViewProj);
+    PSIn.Pos.z = g_Depth * PSIn.Pos.w;
+    PSIn.Coverage = VSIn.Pos.z;
+}
+)";
+
+namespace instanced {
+
+// Affine transform rows and color of one instance
+struct InstanceData {
+    glm::vec4 row0;
+    glm::vec4 row1;
+    Color color;
+};
+
+static const char* VSSource = R"(
+cbuffer Constants
+{
+    float4x4 g_ModelViewProj;
+    float g_Depth;
+};
+
+struct VSInput
+{
+    float3 Pos   : ATTRIB0;
+    float4 Row0  : ATTRIB1;
+    float4 Row1  : ATTRIB2;
+    float4 Color : ATTRIB3;
+};
+
+struct PSInput
+{
+    float4 Pos   : SV_POSITION;
+    float4 Color : COLOR;
+};
+
+void main(in  VSInput VSIn,
+          out PSInput PSIn)
+{
+    float3 pos = float3(VSIn.Pos.xy, 1.0);
+    float2 instancePos = float2(dot(VSIn.Row0.xyz, pos), dot(VSIn.Row1.xyz, pos));
+    PSIn.Pos = mul(float4(instancePos, 0.0, 1.0), g_ModelViewProj);
+    PSIn.Pos.z = g_Depth * PSIn.Pos.w;
+    PSIn.Color = VSIn.Color;
+    PSIn.Color.a *= VSIn.Pos.z;
+}
+)";
+
+static const char* PSSource = R"(
+struct PSInput
+{
+    float4 Pos   : SV_POSITION;
+    float4 Color : COLOR;
+};
+struct PSOutput
+{
+    float4 Color : SV_TARGET;
+};
+
+void main(in  PSInput  PSIn,
+          out PSOutput PSOut)
+{
+    PSOut.Color = foldAlpha(PSIn.Color);
+}
+)";
+
+} // namespace instanced
+
+namespace stroke {
+
+struct VSConstants {
+    glm::mat4 MVP;
+    float depth = 1.0f;
+    float radius = 1.0f;
+    float isMiterJoin = 0.0f;
+    float _padding;
+};
+
+// Points, type and arc length of a factory::StrokePart
+struct InstanceData {
+    glm::vec4 points;
+    glm::vec4 extra;
+};
+
+static const int maxDashes = 8;
+
+// Dash pattern evaluated at the arc length of every pixel. Dashes are
+// widened at both ends by the extension, which makes room for caps
+struct DashPSConstants {
+    Color color;
+    float dash[maxDashes] = {};
+    float count = 0.0f;
+    float period = 1.0f;
+    float phase = 0.0f;
+    float extension = 0.0f;
+};
+
+static const char* VSSource = R"(
+cbuffer Constants
+{
+    float4x4 g_ModelViewProj;
+    float g_Depth;
+    float g_Radius;
+    float g_IsMiterJoin;
+};
+
+struct VSInput
+{
+    // Vertex of the template part drawn for the type
+    float3 Pos    : ATTRIB0;
+    float4 Points : ATTRIB1;
+    float4 Extra  : ATTRIB2;
+};
+
+struct PSInput
+{
+    float4 Pos      : SV_POSITION;
+    float  Coverage : COVERAGE;
+    float  Length   : LENGTH;
+};
+
+float2 normalOf(float2 direction)
+{
+    return float2(direction.y, -direction.x);
+}
+
+void main(in  VSInput VSIn,
+          out PSInput PSIn)
+{
+    float2 a = VSIn.Points.xy;
+    float2 b = VSIn.Points.zw;
+    float2 c = VSIn.Extra.xy;
+    float type = VSIn.Extra.z;
+    PSIn.Coverage = 1.0;
+    PSIn.Length = VSIn.Extra.w;
+    
+    float2 pos;
+    if(type == 0.0) {
+        float2 direction = normalize(b - a);
+        pos = lerp(a, b, VSIn.Pos.x) + normalOf(direction) * VSIn.Pos.y * g_Radius;
+        PSIn.Length += distance(a, b) * VSIn.Pos.x;
+    }
+    else if(type == 1.0) {
+        float2 d0 = normalize(b - a);
+        float2 d1 = normalize(c - b);
+        // The join fills the gap on the outer side of the turn
+        float side = d0.x * d1.y - d0.y * d1.x > 0.0 ? 1.0 : -1.0;
+        float2 n0 = normalOf(d0) * side * g_Radius;
+        float2 n1 = normalOf(d1) * side * g_Radius;
+        float2 tip = b + (n0 + n1) * 0.5;
+        // Turns sharper than 135 degrees are bevelled
+        if(g_IsMiterJoin > 0.0 && dot(d0, d1) > -0.7071) {
+            float2 middle = normalize(n0 + n1);
+            tip = b + middle * g_Radius / max(dot(middle, normalize(n0)), 1e-4);
+        }
+        int index = (int)VSIn.Pos.x;
+        pos = index == 0 ? b : index == 1 ? b + n0 : index == 2 ? tip : b + n1;
+    }
+    else if(type == 2.0) {
+        pos = a + VSIn.Pos.xy * g_Radius;
+    }
+    else {
+        float2 direction = normalize(a - b);
+        pos = a + direction * VSIn.Pos.x * g_Radius * 2.0 +
+              normalOf(direction) * VSIn.Pos.y * g_Radius;
+    }
+    PSIn.Pos = mul(float4(pos, 0.0, 1.0), g_ModelViewProj);
+    PSIn.Pos.z = g_Depth * PSIn.Pos.w;
+}
+)";
+
+static const char* DashPSSource = R"(
+cbuffer Constants
+{
+    float4 g_Color;
+    float4 g_Dash[2];
+    float g_DashCount;
+    float g_DashPeriod;
+    float g_DashPhase;
+    float g_DashExtension;
+};
+
+struct PSInput
+{
+    float4 Pos      : SV_POSITION;
+    float  Coverage : COVERAGE;
+    float  Length   : LENGTH;
+};
+struct PSOutput
+{
+    float4 Color : SV_TARGET;
+};
+
+// Distance to the nearest dash of one period, negative inside of it
+float dashDistance(float position)
+{
+    float dash[8] = {
+        g_Dash[0].x, g_Dash[0].y, g_Dash[0].z, g_Dash[0].w,
+        g_Dash[1].x, g_Dash[1].y, g_Dash[1].z, g_Dash[1].w
+    };
+    float distance = 1e20;
+    float start = 0.0;
+    for(int i = 0; i + 1 < 8; i += 2) {
+        if(float(i) >= g_DashCount)
+            break;
+        float from = start - g_DashExtension;
+        float to = start + dash[i] + g_DashExtension;
+        distance = min(distance, max(from - position, position - to));
+        start += dash[i] + dash[i + 1];
+    }
+    return distance;
+}
+
+void main(in  PSInput  PSIn,
+          out PSOutput PSOut)
+{
+    float position = PSIn.Length + g_DashPhase;
+    position -= floor(position / g_DashPeriod) * g_DashPeriod;
+    // Dashes widened by the extension may come from the neighbor periods
+    float d = min(dashDistance(position),
+                  min(dashDistance(position - g_DashPeriod),
+                      dashDistance(position + g_DashPeriod)));
+    float coverage = saturate(0.5 - d / max(fwidth(PSIn.Length), 1e-6));
+    if(coverage <= 0.0)
+        discard;
+    PSOut.Color = g_Color;
+    PSOut.Color.a *= coverage * PSIn.Coverage;
+    PSOut.Color = foldAlpha(PSOut.Color);
+}
+)";
+
+} // namespace stroke
+
+namespace curve {
+
+static const char* VSSource = R"(
+cbuffer Constants
+{
+    float4x4 g_ModelViewProj;
+    float g_Depth;
 };
 
 struct VSInput
 {
     float2 Pos   : ATTRIB0;
+    // Coordinates on the curve and the side of it to keep
+    float3 Curve : ATTRIB1;
 };
 
 struct PSInput
 {
     float4 Pos   : SV_POSITION;
+    float3 Curve : CURVE;
 };
 
 void main(in  VSInput VSIn,
           out PSInput PSIn)
 {
     PSIn.Pos = mul(float4(VSIn.Pos, 0.0, 1.0), g_ModelViewProj);
+    PSIn.Pos.z = g_Depth * PSIn.Pos.w;
+    PSIn.Curve = VSIn.Curve;
+}
+)";
+
+static const char* PSSource = R"(
+cbuffer Constants
+{
+    float4 g_Color;
+};
+
+struct PSInput
+{
+    float4 Pos   : SV_POSITION;
+    float3 Curve : CURVE;
+};
+struct PSOutput
+{
+    float4 Color : SV_TARGET;
+};
+
+void main(in  PSInput  PSIn,
+          out PSOutput PSOut)
+{
+    // Signed distance to the curve u * u - v = 0 in pixels,
+    // from the implicit function and its gradient
+    float2 uv = PSIn.Curve.xy;
+    float f = (uv.x * uv.x - uv.y) * PSIn.Curve.z;
+    float2 gradient = float2(ddx(f), ddy(f));
+    float d = f / max(length(gradient), 1e-6);
+    float coverage = saturate(0.5 - d);
+    if(coverage <= 0.0)
+        discard;
+    PSOut.Color = g_Color;
+    PSOut.Color.a *= coverage;
+    PSOut.Color = foldAlpha(PSOut.Color);
+}
+)";
+
+} // namespace curve
+
+namespace analytic {
+
+struct VSConstants {
+    glm::mat4 MVP;
+    float depth = 1.0f;
+    float _padding[3];
+    // Origin and size of the unit quad in the space of the path
+    glm::vec4 bounds = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+};
+
+// Rounded rectangle or ellipse, evaluated as a signed distance
+// in the space of the path. Zero stroke width fills the shape
+struct PSConstants {
+    Color color;
+    // Top left, top right, bottom right and bottom left
+    glm::vec4 radii = glm::vec4(0.0f);
+    glm::vec2 center = glm::vec2(0.0f);
+    glm::vec2 halfSize = glm::vec2(0.0f);
+    float strokeWidth = 0.0f;
+    float isEllipse = 0.0f;
+    // Corners of a sharp rectangle stay sharp when stroked
+    float isSharp = 0.0f;
+    float _padding;
+};
+
+static const char* VSSource = R"(
+cbuffer Constants
+{
+    float4x4 g_ModelViewProj;
+    float g_Depth;
+    float4 g_Bounds;
+};
+
+struct VSInput
+{
+    float3 Pos   : ATTRIB0;
+};
+
+struct PSInput
+{
+    float4 Pos   : SV_POSITION;
+    float2 Local : TEX_COORD;
+};
+
+void main(in  VSInput VSIn,
+          out PSInput PSIn)
+{
+    float2 Local = g_Bounds.xy + VSIn.Pos.xy * g_Bounds.zw;
+    PSIn.Pos = mul(float4(Local, 0.0, 1.0), g_ModelViewProj);
+    PSIn.Pos.z = g_Depth * PSIn.Pos.w;
+    PSIn.Local = Local;
 }
 )";
 
+static const char* PSSource = R"(
+cbuffer Constants
+{
+    float4 g_Color;
+    float4 g_Radii;
+    float2 g_Center;
+    float2 g_HalfSize;
+    float g_StrokeWidth;
+    float g_IsEllipse;
+    float g_IsSharp;
+};
+
+struct PSInput
+{
+    float4 Pos   : SV_POSITION;
+    float2 Local : TEX_COORD;
+};
+struct PSOutput
+{
+    float4 Color : SV_TARGET;
+};
+
+float roundedRect(float2 p)
+{
+    float2 side = p.x > 0.0 ? g_Radii.yz : g_Radii.xw;
+    float radius = p.y > 0.0 ? side.y : side.x;
+    float2 q = abs(p) - g_HalfSize + radius;
+    if(g_IsSharp > 0.0)
+        return max(q.x, q.y);
+    return min(max(q.x, q.y), 0.0) + length(max(q, 0.0)) - radius;
+}
+
+float ellipse(float2 p)
+{
+    float k1 = length(p / g_HalfSize);
+    float k2 = length(p / (g_HalfSize * g_HalfSize));
+    return k1 * (k1 - 1.0) / max(k2, 1e-6);
+}
+
+void main(in  PSInput  PSIn,
+          out PSOutput PSOut)
+{
+    float2 p = PSIn.Local - g_Center;
+    float d = g_IsEllipse > 0.0 ? ellipse(p) : roundedRect(p);
+    if(g_StrokeWidth > 0.0)
+        d = abs(d) - g_StrokeWidth * 0.5;
+    float coverage = saturate(0.5 - d / max(fwidth(d), 1e-6));
+    if(coverage <= 0.0)
+        discard;
+    PSOut.Color = foldAlpha(float4(g_Color.rgb, g_Color.a * coverage));
+}
+)";
+
+} // namespace analytic
+
 } // namespace shader
 
 class DiligentContext;
 
 namespace render {
+
+struct DrawCommand;
+
+// Parts of the stroke template. Stroke parts are sorted by the template
+// part they use, which is drawn with one instanced draw for all of them
+enum class StrokeTemplatePart {
+    // Segments and square caps
+    Quad,
+    Join,
+    Disc
+};
+static const int numStrokeTemplateParts = 3;
+static const int strokeDiscSegments = 32;
+// Ranges of the template parts in the index buffer of the template
+static const Diligent::Uint32 strokeTemplateFirstIndices[] = { 0, 6, 12 };
+static const Diligent::Uint32 strokeTemplateNumIndices[] = { 6, 6, strokeDiscSegments * 3 };
+
+// How a draw changes the stencil clip stack. Pushing increments
+// the stencil where it equals the current clip level, popping
+// decrements it back
+enum class ClipMask {
+    None,
+    Push,
+    Pop
+};
     
 class Shape {
 public:
     Shape(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
           factory::ShapeMesh& mesh);
+    Shape(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+          factory::CurveMesh& mesh);
+    Shape();
     
+    // Queues the shape, or draws it right away into a clipping mask
     void draw(DiligentContext& context, Style& style);
     
+    void submit(DiligentContext& context, Style& style, glm::mat4& MVP, float depth,
+                BlendingMode blendingMode, ClipMask clipMask = ClipMask::None);
+    
+    // Queues one draw of the shape for every instance at the offset
+    // in the instance buffer of the context
+    void drawInstanced(DiligentContext& context,
+                       Diligent::Uint64 instanceOffset,
+                       Diligent::Uint32 numInstances,
+                       bool isOpaque);
+    
+    void submitInstanced(DiligentContext& context, glm::mat4& MVP, float depth,
+                         BlendingMode blendingMode, bool isOpaque,
+                         Diligent::Uint64 instanceOffset, Diligent::Uint32 numInstances);
+    
+    // Queues the unit quad stretched over the bounds of a signed
+    // distance shape, given as the origin and the size
+    void drawAnalytic(DiligentContext& context, glm::vec4 bounds,
+                      shader::analytic::PSConstants& constants);
+    
+    void submitAnalytic(DiligentContext& context, glm::mat4& MVP, float depth,
+                        BlendingMode blendingMode, glm::vec4 bounds,
+                        shader::analytic::PSConstants& constants);
+    
+    // Queues the stroke template for the stroke parts at the offset in the
+    // instance buffer, sorted by template part with the given counts.
+    // Dash constants are used if they have any dashes
+    void drawStroke(DiligentContext& context, Style& style,
+                    Diligent::Uint64 partOffset,
+                    const Diligent::Uint32* partCounts,
+                    shader::stroke::DashPSConstants& dash);
+    
+    void submitStroke(DiligentContext& context, DrawCommand& command);
+    
+    // Queues a fill whose curves are evaluated by the pixel shader
+    void drawCurve(DiligentContext& context, Style& style);
+    
+    void submitCurve(DiligentContext& context, DrawCommand& command);
+    
+    // Has a fringe with partial coverage, so it can't be drawn as opaque
+    bool isFeathered = false;
+    
 private:
     Diligent::RefCntAutoPtr<Diligent::IBuffer> vertexBuffer;
     Diligent::RefCntAutoPtr<Diligent::IBuffer> indexBuffer;
     int numIndices = 0;
+    
+    void createBuffers(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+                       const void* vertices, size_t verticesSize,
+                       Span<factory::TriangeIndices> indices);
+};
+
+struct DrawCommand {
+    Shape shape;
+    // Solid colors are kept here. Gradients are interned by the context,
+    // which keeps their indices until the next frame
+    Style::Type styleType = Style::Type::SolidColor;
+    Color color;
+    uint32_t style = 0;
+    glm::mat4 MVP;
+    float depth = 1.0f;
+    BlendingMode blendingMode = BlendingMode::Normal;
+    bool isOpaque = false;
+    Diligent::Uint64 instanceOffset = 0;
+    Diligent::Uint32 numInstances = 0;
+    // Stroke parts of every template part, in this order in the instance buffer
+    Diligent::Uint32 strokeParts[numStrokeTemplateParts] = {};
+    bool isAnalytic = false;
+    glm::vec4 analyticBounds;
+    shader::analytic::PSConstants analytic;
+    bool isStroke = false;
+    float lineWidth = 0.0f;
+    LineJoin lineJoin = LineJoin::Miter;
+    bool isDashed = false;
+    shader::stroke::DashPSConstants dash;
+    bool isCurve = false;
+};
+
+struct PipelineStateKey {
+    enum class Type {
+        SolidColor,
+        LinearGradient,
+        RadialGradient,
+        ConicGradient,
+        Glyph,
+        Instanced,
+        Analytic,
+        Stroke,
+        DashedStroke,
+        Curve
+    };
+    
+    Type type = Type::SolidColor;
+    Diligent::TEXTURE_FORMAT colorBufferFormat = Diligent::TEX_FORMAT_UNKNOWN;
+    Diligent::TEXTURE_FORMAT depthBufferFormat = Diligent::TEX_FORMAT_UNKNOWN;
+    int numSamples = 1;
+    ClipMask clipMask = ClipMask::None;
+    // Opaque draws write depth, translucent ones only test it
+    bool isOpaque = false;
+    BlendingMode blendingMode = BlendingMode::Normal;
+    
+    bool operator==(const PipelineStateKey& other) const;
+    
+    struct Hash {
+        size_t operator()(const PipelineStateKey& key) const;
+    };
 };
 
 struct PipelineStateConfiguration {
     std::string name = "Pipeline state object";
     Diligent::RefCntAutoPtr<Diligent::IShader> vertexShader;
     Diligent::RefCntAutoPtr<Diligent::IShader> pixelShader;
-    Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
-    Diligent::RefCntAutoPtr<Diligent::IBuffer> PSConstants;
     Diligent::TEXTURE_FORMAT colorBufferFormat;
     Diligent::TEXTURE_FORMAT depthBufferFormat;
     int numSamples = 1;
-    bool isClippingMask = false;
+    ClipMask clipMask = ClipMask::None;
+    bool isGlyph = false;
+    bool isGradient = false;
+    bool isInstanced = false;
+    bool isStroke = false;
+    bool isCurve = false;
+    bool isOpaque = false;
+    BlendingMode blendingMode = BlendingMode::Normal;
+    Diligent::IPipelineStateCache* cache = nullptr;
 };
 
+Diligent::RefCntAutoPtr<Diligent::IPipelineState>
+createPipelineState(PipelineStateConfiguration& conf,
+                    Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
+
+// Pipeline state object together with the context's own resource
+// binding. The object itself may be shared with other contexts
 struct PipelineState {
-    PipelineState(PipelineStateConfiguration conf,
-                  Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
+    PipelineState(Diligent::RefCntAutoPtr<Diligent::IPipelineState> PSO,
+                  Diligent::IBuffer* VSConstants,
+                  Diligent::IBuffer* PSConstants);
     PipelineState();
     
     Diligent::RefCntAutoPtr<Diligent::IPipelineState> PSO;
     Diligent::RefCntAutoPtr<Diligent::IShaderResourceBinding> SRB;
 };
 
+StrokeTemplatePart strokeTemplatePart(factory::StrokePart::Type type);
+factory::ShapeMesh strokeTemplate();
+
+class CharacterQuad {
+public:
+    CharacterQuad(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+                  Font::Character& c, int size);
+    CharacterQuad();
+    
+    int advance = 0, height = 0;
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> vertexBuffer;
+};
+
+// Durations of groups of draws on the GPU. Queries of a frame are read
+// when its slot is reused a few frames later, so reading never stalls
+class GPUTimers {
+public:
+    enum class Category {
+        Solid = 0,
+        Gradient,
+        Text,
+        Clip
+    };
+    static const int numCategories = 4;
+    static const int numFrames = 4;
+    
+    GPUTimers(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
+    GPUTimers();
+    
+    // False if the device doesn't support duration queries
+    bool isSupported();
+    
+    // Reads the oldest frame and starts measuring a new one
+    void nextFrame();
+    // Ends the group of draws of another category, if any,
+    // and starts a group of the category
+    void begin(Diligent::IDeviceContext* deviceContext, Category category);
+    void end(Diligent::IDeviceContext* deviceContext);
+    
+    // Milliseconds of every category in the last frame that was read
+    float durations[numCategories] = {};
+    
+private:
+    struct Group {
+        Diligent::RefCntAutoPtr<Diligent::IQuery> query;
+        Category category = Category::Solid;
+    };
+    struct Frame {
+        std::vector<Group> groups;
+        size_t numUsed = 0;
+    };
+    
+    Diligent::RefCntAutoPtr<Diligent::IRenderDevice> mRenderDevice;
+    Frame mFrames[numFrames];
+    int mFrame = 0;
+    bool mIsSupported = false;
+    bool mIsMeasuring = false;
+    Category mCategory = Category::Solid;
+};
+
+// Color ramps of gradients baked into the rows of one texture. Equal
+// ramps share a row, and the least recently used row is reused when
+// the texture is full
+class GradientRamps {
+public:
+    static const int width = 256;
+    static const int height = 256;
+    
+    GradientRamps(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
+    GradientRamps();
+    
+    Diligent::RefCntAutoPtr<Diligent::ITexture> texture;
+    Diligent::RefCntAutoPtr<Diligent::ITextureView> textureSRV;
+    
+    // Returns the ramp coordinates for the shader constants,
+    // uploading the ramp first if it isn't in the texture
+    glm::vec4 find(Diligent::IDeviceContext* deviceContext, const Style& style);
+    
+    void nextFrame();
+    
+private:
+    struct Row {
+        size_t key = 0;
+        uint64_t lastUsedFrame = 0;
+        std::vector<ColorStop> stops;
+    };
+    
+    std::vector<Row> mRows;
+    std::unordered_map<size_t, int> mRowIndices;
+    uint64_t mFrame = 0;
+};
+
+struct GlyphAtlas {
+    // Identity of the font. Keys of different atlases may be
+    // equal, so lookups compare all of it
+    std::string json;
+    int width = 0, height = 0;
+    Diligent::TEXTURE_FORMAT format = Diligent::TEX_FORMAT_UNKNOWN;
+    // Key of the font data, which hashes the pixels too
+    size_t contentKey = 0;
+    
+    size_t key() const;
+    bool isSameFont(const GlyphAtlas& other) const;
+    
+    Diligent::RefCntAutoPtr<Diligent::ITexture> texture;
+    Diligent::RefCntAutoPtr<Diligent::ITextureView> textureSRV;
+    std::unordered_map<int, CharacterQuad> chars;
+};
+
+// Shaders, pipeline state objects and font atlases which don't depend
+// on a context. Contexts created with the same resources share them
+// instead of compiling and uploading their own copies
+class DeviceResources {
+public:
+    DeviceResources(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
+    ~DeviceResources();
+    
+    // Returns the resources of the render device. They live as long
+    // as any context uses them
+    static std::shared_ptr<DeviceResources>
+    shared(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
+    
+    Diligent::RefCntAutoPtr<Diligent::IRenderDevice> getRenderDevice();
+    
+    // Stores compiled shaders and pipeline states in the directory and
+    // reuses them on later runs. Must be called before anything is compiled
+    void enableDiskCache(const std::string& directory);
+    
+    // Writes the pipeline state cache to disk. It's also done on destruction
+    void saveDiskCache();
+    
+    // Shaders are identified by their source pointer
+    Diligent::RefCntAutoPtr<Diligent::IShader> shader(Diligent::SHADER_TYPE type,
+                                                      const char* name,
+                                                      const char* source);
+    
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> pipelineState(const PipelineStateKey& key);
+    
+    // Returns nullptr if the pipeline state isn't compiled yet
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> findPipelineState(const PipelineStateKey& key);
+    void compilePipelineStateAsync(const PipelineStateKey& key);
+    
+    // Returns the atlas of the same font, or nullptr
+    std::shared_ptr<GlyphAtlas> findGlyphAtlas(const GlyphAtlas& identity);
+    void addGlyphAtlas(std::shared_ptr<GlyphAtlas> atlas);
+    
+private:
+    Diligent::RefCntAutoPtr<Diligent::IRenderDevice> mRenderDevice;
+    std::mutex mMutex;
+    std::unordered_map<const char*, Diligent::RefCntAutoPtr<Diligent::IShader>> mShaders;
+    std::unordered_set<std::string> mShaderVariants;
+    std::unordered_map<PipelineStateKey,
+                       Diligent::RefCntAutoPtr<Diligent::IPipelineState>,
+                       PipelineStateKey::Hash> mPipelineStates;
+    std::unordered_multimap<size_t, std::weak_ptr<GlyphAtlas>> mGlyphAtlases;
+    std::unordered_set<PipelineStateKey, PipelineStateKey::Hash> mCompilingPipelineStates;
+    std::string mCacheDirectory;
+    Diligent::RefCntAutoPtr<Diligent::IPipelineStateCache> mPipelineStateCache;
+    
+    Diligent::RefCntAutoPtr<Diligent::IShader> loadCachedShader(const std::string& path,
+                                                                uint64_t key,
+                                                                uint64_t sourceLength,
+                                                                Diligent::ShaderCreateInfo ShaderCI);
+    void storeCachedShader(const std::string& path, uint64_t key, uint64_t sourceLength,
+                           Diligent::IShader* shader);
+    Diligent::RefCntAutoPtr<Diligent::IShader> findOrCreateShader(Diligent::SHADER_TYPE type,
+                                                                  const char* name,
+                                                                  const char* source);
+    // Pixel shaders of the context with the alpha folded for the blending mode
+    Diligent::RefCntAutoPtr<Diligent::IShader> findOrCreatePixelShader(const char* name,
+                                                                       const char* source,
+                                                                       BlendingMode blendingMode);
+    PipelineStateConfiguration configure(const PipelineStateKey& key);
+    
+    // Declared last so that the tasks are joined before
+    // the rest of the members are destroyed
+    std::vector<std::future<void>> mCompileTasks;
+};
+
+static const int numBlendingModes = (int)BlendingMode::Lighter + 1;
+
+// Variants of one pipeline state for every blending mode. All of them are
+// compatible with the same resource binding, so changing the blending
+// mode between draws only swaps the pipeline state
+class BlendingPipelineStates {
+public:
+    void reset(const PipelineStateKey& key);
+    
+    // A variant which is not compiled yet is compiled in background,
+    // and the normal blending variant is returned until it's ready
+    Diligent::IPipelineState* get(DeviceResources& resources, BlendingMode blendingMode);
+    
+    void warmUp(DeviceResources& resources);
+    
+private:
+    PipelineStateKey mKey;
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> mVariants[numBlendingModes];
+};
+
 class SolidColorPipelineStates {
 public:
     
-    SolidColorPipelineStates(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+    SolidColorPipelineStates(DeviceResources& resources,
                             Diligent::TEXTURE_FORMAT colorBufferFormat,
                             Diligent::TEXTURE_FORMAT depthBufferFormat,
                             int numSamples = 1);
@@ -393,26 +1145,114 @@ public:
     
     PipelineState normalPSO;
     PipelineState clipPSO;
+    // Uses the resource binding of the clip one
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> unclipPSO;
+    BlendingPipelineStates blendingPSOs;
+    // Writes depth, uses the resource binding of the normal one
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> opaquePSO;
+    
+    void recreate(DeviceResources& resources,
+                  Diligent::TEXTURE_FORMAT colorBufferFormat,
+                  Diligent::TEXTURE_FORMAT depthBufferFormat,
+                  int numSamples = 1);
+    
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> PSConstants;
+    int numSamples = 1;
+};
+
+class InstancedPipelineStates {
+public:
+    InstancedPipelineStates(DeviceResources& resources,
+                            Diligent::TEXTURE_FORMAT colorBufferFormat,
+                            Diligent::TEXTURE_FORMAT depthBufferFormat,
+                            int numSamples = 1);
+    InstancedPipelineStates();
+    
+    PipelineState normalPSO;
+    BlendingPipelineStates blendingPSOs;
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> opaquePSO;
+    
+    void recreate(DeviceResources& resources,
+                  Diligent::TEXTURE_FORMAT colorBufferFormat,
+                  Diligent::TEXTURE_FORMAT depthBufferFormat,
+                  int numSamples = 1);
     
-    void recreate(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
+    int numSamples = 1;
+};
+
+class StrokePipelineStates {
+public:
+    StrokePipelineStates(DeviceResources& resources,
+                         Diligent::TEXTURE_FORMAT colorBufferFormat,
+                         Diligent::TEXTURE_FORMAT depthBufferFormat,
+                         int numSamples = 1);
+    StrokePipelineStates();
+    
+    PipelineState normalPSO;
+    BlendingPipelineStates blendingPSOs;
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> opaquePSO;
+    PipelineState dashedPSO;
+    BlendingPipelineStates dashedBlendingPSOs;
+    
+    void recreate(DeviceResources& resources,
                   Diligent::TEXTURE_FORMAT colorBufferFormat,
                   Diligent::TEXTURE_FORMAT depthBufferFormat,
-                  BlendingMode blendingMode,
                   int numSamples = 1);
     
     Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
     Diligent::RefCntAutoPtr<Diligent::IBuffer> PSConstants;
-    Diligent::RefCntAutoPtr<Diligent::IShader> PS;
-    Diligent::RefCntAutoPtr<Diligent::IShader> VS;
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> dashPSConstants;
     int numSamples = 1;
+};
+
+class CurvePipelineStates {
+public:
+    CurvePipelineStates(DeviceResources& resources,
+                        Diligent::TEXTURE_FORMAT colorBufferFormat,
+                        Diligent::TEXTURE_FORMAT depthBufferFormat,
+                        int numSamples = 1);
+    CurvePipelineStates();
     
-private:
-    void createShaders(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
+    PipelineState normalPSO;
+    BlendingPipelineStates blendingPSOs;
+    
+    void recreate(DeviceResources& resources,
+                  Diligent::TEXTURE_FORMAT colorBufferFormat,
+                  Diligent::TEXTURE_FORMAT depthBufferFormat,
+                  int numSamples = 1);
+    
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> PSConstants;
+    int numSamples = 1;
+};
+
+class AnalyticPipelineStates {
+public:
+    AnalyticPipelineStates(DeviceResources& resources,
+                           Diligent::TEXTURE_FORMAT colorBufferFormat,
+                           Diligent::TEXTURE_FORMAT depthBufferFormat,
+                           int numSamples = 1);
+    AnalyticPipelineStates();
+    
+    PipelineState normalPSO;
+    BlendingPipelineStates blendingPSOs;
+    
+    void recreate(DeviceResources& resources,
+                  Diligent::TEXTURE_FORMAT colorBufferFormat,
+                  Diligent::TEXTURE_FORMAT depthBufferFormat,
+                  int numSamples = 1);
+    
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> PSConstants;
+    int numSamples = 1;
 };
 
 class GradientPipelineStates {
 public:
-    GradientPipelineStates(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+    GradientPipelineStates(DeviceResources& resources,
+                          Diligent::ITextureView* rampSRV,
                           Diligent::TEXTURE_FORMAT colorBufferFormat,
                           Diligent::TEXTURE_FORMAT depthBufferFormat,
                           int numSamples = 1);
@@ -420,22 +1260,20 @@ public:
     
     bool isInitialized = false;
     
-    void recreate(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+    // Indexed by shader::GradientConstants::Type
+    PipelineState normalPSOs[3];
+    BlendingPipelineStates blendingPSOs[3];
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> opaquePSOs[3];
+    
+    void recreate(DeviceResources& resources,
                   Diligent::TEXTURE_FORMAT colorBufferFormat,
                   Diligent::TEXTURE_FORMAT depthBufferFormat,
-                  BlendingMode blendingMode,
                   int numSamples = 1);
     
     Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
     Diligent::RefCntAutoPtr<Diligent::IBuffer> PSConstants;
-    Diligent::RefCntAutoPtr<Diligent::IShader> PS;
-    Diligent::RefCntAutoPtr<Diligent::IShader> VS;
+    Diligent::ITextureView* rampSRV = nullptr;
     int numSamples = 1;
-    Diligent::RefCntAutoPtr<Diligent::IPipelineState> PSO;
-    Diligent::RefCntAutoPtr<Diligent::IShaderResourceBinding> SRB;
-    
-private:
-    void createShaders(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice);
 };
 
 static Diligent::Uint32 GlyphQuadIndices[] =
@@ -450,57 +1288,40 @@ public:
     
     Diligent::RefCntAutoPtr<Diligent::IBuffer> VSConstants;
     Diligent::RefCntAutoPtr<Diligent::IBuffer> PSConstants;
-    Diligent::RefCntAutoPtr<Diligent::IShader> PS;
-    Diligent::RefCntAutoPtr<Diligent::IShader> VS;
     Diligent::RefCntAutoPtr<Diligent::IBuffer> quadIndexBuffer;
 };
 
-class CharacterQuad {
-public:
-    CharacterQuad(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
-                  Font::Character& c, int size);
-    CharacterQuad();
-    
-    int advance = 0, height = 0;
-    Diligent::RefCntAutoPtr<Diligent::IBuffer> vertexBuffer;
-};
-
 } // namespace render
 
 class DiligentFont : public Font {
 public:
-    DiligentFont(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+    DiligentFont(std::shared_ptr<render::DeviceResources> resources,
                  Diligent::TEXTURE_FORMAT colorBufferFormat,
                  Diligent::TEXTURE_FORMAT depthBufferFormat,
                  int numSamples,
-                 std::string& json,
-                 void* imageData,
-                 int width,
-                 int height,
-                 int numChannels,
                  DiligentContext& context);
     
-    std::unordered_map<int, render::CharacterQuad> chars;
+    // May be shared with fonts of other contexts
+    std::shared_ptr<render::GlyphAtlas> glyphs;
     
+    render::CharacterQuad* findCharacter(int unicode);
+    
+    void upload(Data& data);
     void loadCharacter(Character& character);
     
     Diligent::RefCntAutoPtr<Diligent::IPipelineState> PSO;
     Diligent::RefCntAutoPtr<Diligent::IShaderResourceBinding> SRB;
-    Diligent::RefCntAutoPtr<Diligent::ITextureView> textureSRV;
+    render::BlendingPipelineStates blendingPSOs;
     
     void recreatePipelineState(Diligent::TEXTURE_FORMAT colorBufferFormat,
                                Diligent::TEXTURE_FORMAT depthBufferFormat,
                                int numSamples);
     
 private:
-    void createTexture(Diligent::TEXTURE_FORMAT colorBufferFormat,
-                       void* imageData,
-                       int width,
-                       int height,
-                       int numChannels);
+    void createTexture(Data& data);
+    void createPipelineState();
     
-    Diligent::RefCntAutoPtr<Diligent::ITexture> mTexture;
-    Diligent::RefCntAutoPtr<Diligent::IRenderDevice> mRenderDevice;
+    std::shared_ptr<render::DeviceResources> mResources;
     DiligentContext& mContext;
     Diligent::TEXTURE_FORMAT mColorBufferFormat;
     Diligent::TEXTURE_FORMAT mDepthBufferFormat;
@@ -517,17 +1338,25 @@ public:
                     Diligent::RefCntAutoPtr<Diligent::IDeviceContext> deviceContext,
                     Diligent::TEXTURE_FORMAT colorBufferFormat,
                     Diligent::TEXTURE_FORMAT depthBufferFormat,
-                    int numSamples = 1);
+                    int numSamples = 1,
+                    std::shared_ptr<render::DeviceResources> resources = nullptr);
     
     DiligentContext();
     
+    // Clips are nested. Every clip drawn between beginClip() and endClip()
+    // is intersected with the current one until it's popped, also at the
+    // top level, so replacing a clip takes popClip() or clearClip() first.
+    // Up to 255 clips may be nested
     void beginClip();
     void endClip();
+    void popClip();
     void clearClip();
+    int clipDepth();
     
     void convexFill();
     void fill();
     void stroke();
+    void fillInstanced(const Instance* instances, size_t count);
     
     void print(std::wstring str, float x, float y);
     void printOnPath(std::wstring str, float x = 0, float y = 0);
@@ -535,20 +1364,32 @@ public:
     float measureTextWidth(std::wstring str);
     float measureTextHeight();
     
-    void loadFontFromMemory(std::string& json,
-                            std::string fontName,
-                            void* imageData,
-                            int width,
-                            int height,
-                            int numChannels);
-    
     void setupPipelineStates(Diligent::TEXTURE_FORMAT colorBufferFormat,
                              Diligent::TEXTURE_FORMAT depthBufferFormat,
                              int numSamples);
     
+    // Compiles pipeline states for all the blending modes up front,
+    // so that none of them is compiled in the middle of a frame
+    void warmUpPipelineStates();
+    
+    // Paint order is kept in the depth and clips in the stencil, which are
+    // never cleared here. Clear the depth to 1 and the stencil to 0 before
+    // every beginDrawing()
     void specifyTextureViews(Diligent::ITextureView* RTV,
                              Diligent::ITextureView* DSV);
     
+    // Clips that are left from the last frame are dropped
+    void beginDrawing();
+    void endDrawing();
+    
+    // Measures solid, gradient, text and clip draws on the GPU
+    // and reports them in the frame stats a few frames later
+    bool measureGPUTime = false;
+    
+    // Draws the queued shapes. Opaque ones are drawn first front-to-back,
+    // then translucent ones in paint order
+    void flushDraws();
+    
     void test();
     
 private:
@@ -557,20 +1398,90 @@ private:
     Diligent::TEXTURE_FORMAT mColorBufferFormat;
     Diligent::TEXTURE_FORMAT mDepthBufferFormat;
     
+    std::shared_ptr<render::DeviceResources> mResources;
+    render::GradientRamps mGradientRamps;
+    render::GPUTimers mGPUTimers;
     render::GradientPipelineStates mGradientPSO;
     render::SolidColorPipelineStates mSolidColorPSO;
+    render::InstancedPipelineStates mInstancedPSO;
+    render::AnalyticPipelineStates mAnalyticPSO;
+    render::StrokePipelineStates mStrokePSO;
+    render::CurvePipelineStates mCurvePSO;
     render::GlyphMSDFShaders mGlyphShaders;
     
+    // Unit square stretched by instances into bulk primitives
+    render::Shape mUnitQuad;
+    // Segment, join and round parts extruded by stroke instances
+    render::Shape mStrokeTemplate;
+    
     Diligent::ITextureView* mDSV = nullptr;
     
     bool mIsClipping = false;
+    // Number of clips in the stencil buffer
+    int mClipLevel = 0;
+    
+    struct Clip {
+        // Shapes of the clip, drawn again to pop it
+        std::vector<render::DrawCommand> shapes;
+        // Clip made of one axis-aligned rectangle doesn't
+        // touch the stencil and only narrows the scissor
+        bool isRect = false;
+        Diligent::Rect rect;
+        Diligent::Rect scissor;
+    };
+    std::vector<Clip> mClipStack;
+    Diligent::Rect mScissor;
+    
+    std::vector<render::DrawCommand> mDrawQueue;
     
     int mNumSamples = 1;
     
-    glm::mat4 bringToFrontMatrix(glm::mat4 MVP);
     glm::mat4 getMatrix3D();
+    float paintDepth();
+    
+    void submit(render::DrawCommand& command);
+    
+    void setCommandStyle(render::DrawCommand& command, const Style& style);
+    // Style of the command, valid until the next call
+    Style& commandStyle(render::DrawCommand& command);
+    Style mSolidCommandStyle;
+    
+    // Pipeline state bound last in this frame
+    Diligent::IPipelineState* mCurrentPSO = nullptr;
+    // Binds the pipeline state unless it's already bound
+    void setPipelineState(Diligent::IPipelineState* PSO);
+    void countConstantsUpload(size_t size);
+    
+    // Draws the path as one quad if it's an analytic shape.
+    // Returns false if the path needs to be tessellated
+    bool drawAnalytic(Style& style, float strokeWidth);
+    
+    bool isFeathering();
+    
+    // Uploads only the centerline and extrudes it in the vertex shader.
+    // Returns false if the dash pattern needs the dashes to be cut
+    bool drawStroke();
+    bool dashConstants(shader::stroke::DashPSConstants& constants);
+    // Instances of the queued draws. They are uploaded at once into
+    // the dynamic buffer, which only grows, when the draws are flushed
+    std::vector<unsigned char> mInstanceData;
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> mInstanceBuffer;
+    Diligent::Uint64 mInstanceBufferSize = 0;
+    // Returns the offset of the instances, which are written there
+    Diligent::Uint64 allocateInstances(size_t size);
+    void uploadInstances();
+    
+    void fillQuads(const Instance* quads, size_t count);
+    void fillMesh(factory::ShapeMesh& mesh, Style& style);
+    void drawInstances(render::Shape& shape, const Instance* instances, size_t count);
+    
+    Diligent::Rect fullScissor();
+    void applyScissor();
+    void checkClipRect();
     
     void initPipelineState();
+    
+    Font* createFont();
 };
 
 } // namespace bvg
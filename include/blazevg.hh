@@ -4,9 +4,162 @@
 #include <string>
 #include <cmath>
 #include <map>
+#include <unordered_map>
+#include <future>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
 
 namespace bvg {
 
+// Bump allocator for temporaries of one frame. Memory is never
+// freed one by one, only rewound to a marker or reset, and blocks
+// are kept for the next frame
+class Arena {
+public:
+    Arena(size_t blockSize = 64 * 1024);
+    ~Arena();
+    
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+    
+    struct Marker {
+        size_t block = 0;
+        size_t offset = 0;
+    };
+    Marker mark();
+    void rewind(Marker marker);
+    // Rewinds to the start. Blocks are merged into one, so that
+    // a frame that fitted once fits again without allocating
+    void reset();
+    
+    size_t capacity();
+    
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+    std::vector<Block> mBlocks;
+    size_t mBlockSize;
+    size_t mCurrentBlock = 0;
+    size_t mOffset = 0;
+};
+
+// Frees everything allocated from the arena during its lifetime
+class ArenaScope {
+public:
+    ArenaScope(Arena* arena);
+    ~ArenaScope();
+    
+private:
+    Arena* mArena;
+    Arena::Marker mMarker;
+};
+
+// Allocator of standard containers. Without an arena it uses the heap
+template<class T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    
+    ArenaAllocator(Arena* arena = nullptr): arena(arena) {}
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& other): arena(other.arena) {}
+    
+    T* allocate(size_t n) {
+        if(arena == nullptr)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    
+    void deallocate(T* p, size_t) {
+        if(arena == nullptr)
+            ::operator delete(p);
+    }
+    
+    Arena* arena;
+};
+
+template<class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena == b.arena;
+}
+
+template<class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena != b.arena;
+}
+
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Read-only view of contiguous elements, so that functions take
+// vectors of any allocator. It must not outlive the elements
+template<class T>
+class Span {
+public:
+    Span(): mData(nullptr), mSize(0) {}
+    Span(const T* data, size_t size): mData(data), mSize(size) {}
+    template<class A>
+    Span(const std::vector<T, A>& vector): mData(vector.data()), mSize(vector.size()) {}
+    
+    const T& operator[](size_t i) const { return mData[i]; }
+    const T& at(size_t i) const {
+        if(i >= mSize)
+            throw std::out_of_range("bvg::Span");
+        return mData[i];
+    }
+    const T& front() const { return mData[0]; }
+    const T& back() const { return mData[mSize - 1]; }
+    const T* begin() const { return mData; }
+    const T* end() const { return mData + mSize; }
+    const T* data() const { return mData; }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    
+private:
+    const T* mData;
+    size_t mSize;
+};
+
+// Open-addressed index of interned values by their hash. Clearing
+// keeps the capacity, so a frame that fitted once doesn't allocate
+class InternIndex {
+public:
+    static const uint32_t notFound = UINT32_MAX;
+    
+    void clear();
+    void insert(size_t hash, uint32_t index);
+    
+    // Returns the first index with the hash that isEqual accepts, or notFound
+    template<class IsEqual>
+    uint32_t find(size_t hash, IsEqual isEqual) const {
+        if(mSlots.empty())
+            return notFound;
+        size_t mask = mSlots.size() - 1;
+        for(size_t i = start(hash, mask); mSlots[i].index != notFound; i = (i + 1) & mask) {
+            if(mSlots[i].hash == hash && isEqual(mSlots[i].index))
+                return mSlots[i].index;
+        }
+        return notFound;
+    }
+    
+private:
+    struct Slot {
+        size_t hash = 0;
+        uint32_t index = notFound;
+    };
+    std::vector<Slot> mSlots;
+    size_t mSize = 0;
+    
+    static size_t start(size_t hash, size_t mask);
+    void grow();
+};
+
 enum class LineJoin {
     Bevel,
     Round,
@@ -34,6 +187,12 @@ static const Color White = Color(1.0f, 1.0f, 1.0f);
 
 } // namespace colors
 
+struct ColorStop {
+    ColorStop(float offset, Color color);
+    float offset;
+    Color color;
+};
+
 struct Style {
     Style();
     
@@ -73,12 +232,24 @@ struct Style {
         Radial radial;
         Conic conic;
     };
+    // Stops of a multi-stop gradient sorted by offset. Start and end
+    // colors of the gradient are the colors of the first and last stops
+    std::vector<ColorStop> stops;
+    
+    // Returns the stops, or the start and end colors if there are none
+    std::vector<ColorStop> colorStops() const;
+    
+    // True if every color of the style is fully opaque
+    bool isOpaque() const;
 };
 
 Style SolidColor(Color color);
 Style LinearGradient(float sx, float sy, float ex, float ey, Color start, Color end);
 Style RadialGradient(float x, float y, float radius, Color start, Color end);
 Style ConicGradient(float x, float y, float angle, Color start, Color end);
+Style LinearGradient(float sx, float sy, float ex, float ey, std::vector<ColorStop> stops);
+Style RadialGradient(float x, float y, float radius, std::vector<ColorStop> stops);
+Style ConicGradient(float x, float y, float angle, std::vector<ColorStop> stops);
 
 struct LineDash {
     LineDash();
@@ -87,6 +258,106 @@ struct LineDash {
     std::vector<float> dash;
 };
 
+// Transform and color of one copy of an instanced path
+struct Instance {
+    Instance(glm::mat3 matrix, Color color);
+    Instance();
+    glm::mat3 matrix = glm::mat3(1.0f);
+    Color color;
+};
+
+// Primitives of bulk chart drawing, each with its own color
+struct Segment {
+    Segment(glm::vec2 start, glm::vec2 end, float width, Color color);
+    Segment();
+    glm::vec2 start = glm::vec2(0.0f), end = glm::vec2(0.0f);
+    float width = 1.0f;
+    Color color;
+};
+
+struct Rect {
+    Rect(float x, float y, float width, float height, Color color);
+    Rect();
+    float x = 0.0f, y = 0.0f, width = 0.0f, height = 0.0f;
+    Color color;
+};
+
+// Square marker centered at the position
+struct Point {
+    Point(glm::vec2 position, float size, Color color);
+    Point();
+    glm::vec2 position = glm::vec2(0.0f);
+    float size = 1.0f;
+    Color color;
+};
+
+enum class AntiAliasing {
+    // Edges are smoothed only by a multisampled render target
+    Multisample,
+    // Tessellated edges get a fringe of about one pixel
+    // that fades out, so one sample per pixel is enough
+    Feather
+};
+
+// Allocations made by one thread. Heap allocations are counted
+// only when built with BLAZEVG_COUNT_ALLOCATIONS, which replaces
+// the global operator new and delete of the whole process, so
+// allocations of the host application are counted too
+struct AllocationStats {
+    size_t heapAllocations = 0;
+    size_t heapBytes = 0;
+    size_t bufferCreations = 0;
+    size_t bufferBytes = 0;
+    size_t pipelineStateCreations = 0;
+    
+    AllocationStats operator-(const AllocationStats& b) const;
+    bool exceeds(const AllocationStats& budget) const;
+};
+
+// Running totals of the calling thread
+AllocationStats& threadAllocations();
+
+namespace trace {
+
+// Zones are recorded into a ring buffer, so only the
+// latest events are kept
+static const size_t ringBufferSize = 64 * 1024;
+
+struct Event {
+    const char* name;
+    // Microseconds
+    uint64_t start;
+    uint64_t duration;
+    uint32_t thread;
+};
+
+// Records the time from its construction to its destruction.
+// The name must outlive the trace
+class Zone {
+public:
+    Zone(const char* name);
+    ~Zone();
+    
+private:
+    const char* mName;
+    uint64_t mStart;
+};
+
+// Writes the recorded events as Chrome trace event JSON
+void write(std::ostream& stream);
+bool writeToFile(const std::string& path);
+void clear();
+
+} // namespace trace
+
+#ifdef BLAZEVG_TRACING
+#define BVG_TRACE_CONCAT_INNER(a, b) a##b
+#define BVG_TRACE_CONCAT(a, b) BVG_TRACE_CONCAT_INNER(a, b)
+#define BVG_TRACE_ZONE(name) bvg::trace::Zone BVG_TRACE_CONCAT(bvgTraceZone, __LINE__)(name)
+#else
+#define BVG_TRACE_ZONE(name)
+#endif
+
 enum class BlendingMode : int {
     Normal = 0,
     Add = 1,
@@ -101,8 +372,14 @@ enum class BlendingMode : int {
 
 namespace factory {
 
+// Results of the factory are allocated from the arena if there is one,
+// and from the heap otherwise
+using Polyline = ArenaVector<glm::vec2>;
+using Polylines = ArenaVector<Polyline>;
+
 struct TwoPolylines {
-    std::vector<glm::vec2> first, second;
+    TwoPolylines(Arena* arena = nullptr);
+    Polyline first, second;
 };
 
 struct TriangeIndices {
@@ -110,34 +387,100 @@ struct TriangeIndices {
 };
 
 struct ShapeMesh {
-    std::vector<glm::vec2> vertices;
-    std::vector<TriangeIndices> indices;
+    ShapeMesh(Arena* arena = nullptr);
+    ArenaVector<glm::vec2> vertices;
+    ArenaVector<TriangeIndices> indices;
+    // Coverage of every vertex, or empty if the mesh is fully covered
+    ArenaVector<float> coverage;
     
-    void add(ShapeMesh& b);
+    void add(const ShapeMesh& b);
 };
 
-ShapeMesh strokePolyline(std::vector<glm::vec2>& points, const float diameter);
-ShapeMesh bevelJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const float diameter);
-ShapeMesh roundJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const float diameter);
-ShapeMesh miterJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const float diameter,
-                    float miterLimitAngle = M_PI_2 + M_PI_4);
-
-TwoPolylines dividePolyline(std::vector<glm::vec2>& points, float t);
-
-glm::vec2 getPointAtT(std::vector<glm::vec2>& points, float t);
-
-std::vector<std::vector<glm::vec2>> dashedPolyline(std::vector<glm::vec2>& points,
-                                                   float dashLength, float gapLength,
-                                                   float offset = 0.0f);
+// Part of a stroke extruded on the GPU. Segment goes from a to b, join
+// is at b between segments a-b and b-c, round part is a disc at a, and
+// square cap sticks out of a away from b. Length is the arc length of
+// the path at the start of a segment, or where the other parts are
+struct StrokePart {
+    enum class Type {
+        Segment = 0,
+        Join = 1,
+        Round = 2,
+        SquareCap = 3
+    };
+    Type type = Type::Segment;
+    glm::vec2 a = glm::vec2(0.0f), b = glm::vec2(0.0f), c = glm::vec2(0.0f);
+    float length = 0.0f;
+};
 
-ShapeMesh roundedCap(glm::vec2 position, glm::vec2 direction, const float diameter);
-ShapeMesh squareCap(glm::vec2 position, glm::vec2 direction, const float diameter);
+struct QuadraticCurve {
+    glm::vec2 start, control, end;
+};
 
-std::vector<float> measurePolyline(std::vector<glm::vec2>& points);
-float lengthOfPolyline(std::vector<glm::vec2>& points);
-float tAtLength(float length, std::vector<float>& lengths);
+// Splits the cubic curve into quadratic ones that are no
+// farther from it than the tolerance
+ArenaVector<QuadraticCurve> cubicToQuadratics(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2,
+                                              glm::vec2 p3, float tolerance,
+                                              Arena* arena = nullptr);
+
+// Fill whose curves are evaluated per pixel. Curve triangles carry the
+// (u, v) coordinates of the curve u * u - v = 0 and the side to keep,
+// which the inner polygon keeps everywhere
+struct CurveMesh {
+    CurveMesh(Arena* arena = nullptr);
+    ArenaVector<glm::vec2> vertices;
+    ArenaVector<glm::vec3> curveCoords;
+    ArenaVector<TriangeIndices> indices;
+};
 
-std::vector<TriangeIndices> createIndicesConvex(int numVertices);
+Polyline quadraticBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, int segments,
+                         Arena* arena = nullptr);
+Polyline cubicBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm::vec2 p3, int segments,
+                     Arena* arena = nullptr);
+Polyline createArc(float startAngle, float endAngle, float radius, int segments,
+                   glm::vec2 offset, Arena* arena = nullptr);
+
+ShapeMesh strokePolyline(Span<glm::vec2> points, const float diameter, Arena* arena = nullptr);
+// Strip of the given width centered on the polyline moved by the offset.
+// Coverage fades out towards the side the width points to. Positive values
+// are on the outer side of a closed polyline with positive area
+ShapeMesh featherPolyline(Span<glm::vec2> points, float offset, float width,
+                          bool isClosed = false, Arena* arena = nullptr);
+ShapeMesh bevelJoin(Span<glm::vec2> a, Span<glm::vec2> b, const float diameter,
+                    Arena* arena = nullptr);
+ShapeMesh roundJoin(Span<glm::vec2> a, Span<glm::vec2> b, const float diameter,
+                    Arena* arena = nullptr);
+ShapeMesh miterJoin(Span<glm::vec2> a, Span<glm::vec2> b, const float diameter,
+                    float miterLimitAngle = M_PI_2 + M_PI_4, Arena* arena = nullptr);
+
+TwoPolylines dividePolyline(Span<glm::vec2> points, float t, Arena* arena = nullptr);
+
+glm::vec2 getPointAtT(Span<glm::vec2> points, float t);
+
+Polylines dashedPolyline(Span<glm::vec2> points, float dashLength, float gapLength,
+                         float offset = 0.0f, Arena* arena = nullptr);
+// Dashes of a pattern of alternating dash and gap lengths
+Polylines dashedPolylineNew(Span<glm::vec2> points, Span<float> dash, float offset,
+                            Arena* arena = nullptr);
+
+ShapeMesh roundedCap(glm::vec2 position, glm::vec2 direction, const float diameter,
+                     Arena* arena = nullptr);
+ShapeMesh squareCap(glm::vec2 position, glm::vec2 direction, const float diameter,
+                    Arena* arena = nullptr);
+
+ArenaVector<float> measurePolyline(Span<glm::vec2> points, Arena* arena = nullptr);
+float lengthOfPolyline(Span<glm::vec2> points);
+float tAtLength(float length, Span<float> lengths);
+
+ArenaVector<TriangeIndices> createIndicesConvex(int numVertices, Arena* arena = nullptr);
+
+// Transforms of the unit square, from (0, 0) to (1, 1), onto the primitives
+glm::mat3 segmentQuad(const Segment& segment);
+glm::mat3 rectQuad(const Rect& rect);
+glm::mat3 pointQuad(const Point& point);
+
+ShapeMesh unitQuad(Arena* arena = nullptr);
+// Unit squares under every transform merged into one mesh
+ShapeMesh quads(const glm::mat3* transforms, size_t count, Arena* arena = nullptr);
 
 } // namespace factory
 
@@ -148,6 +491,41 @@ bool isPointInTriange(glm::vec2 a, glm::vec2 b, glm::vec2 c, glm::vec2 point);
 
 } // namespace math
 
+struct GeometryStats {
+    size_t vertices = 0;
+    size_t triangles = 0;
+    
+    void add(const factory::ShapeMesh& mesh);
+};
+
+// Work done for one frame. Times are in milliseconds and
+// only measured when built with BLAZEVG_FRAME_TIMINGS
+struct FrameStats {
+    size_t paths = 0;
+    size_t flattenedPoints = 0;
+    GeometryStats fill, stroke, join, cap, text;
+    
+    float flatteningTime = 0.0f;
+    float triangulationTime = 0.0f;
+    // Stroking time includes dashing
+    float strokingTime = 0.0f;
+    float dashingTime = 0.0f;
+    
+    // Counted by the backend
+    size_t drawCalls = 0;
+    size_t pipelineSwitches = 0;
+    size_t constantBufferMaps = 0;
+    size_t bytesUploaded = 0;
+    // Milliseconds on the GPU, measured a few frames earlier
+    // when the backend supports it
+    float gpuSolidTime = 0.0f;
+    float gpuGradientTime = 0.0f;
+    float gpuTextTime = 0.0f;
+    float gpuClipTime = 0.0f;
+    
+    AllocationStats allocations;
+};
+
 class Font {
 public:
     struct Atlas {
@@ -163,13 +541,44 @@ public:
         Bounds planeBounds, atlasBounds;
     };
     
+    // Everything the font needs before touching the GPU: metrics,
+    // glyphs and atlas pixels expanded to RGBA. It is safe to
+    // prepare it on any thread
+    struct Data {
+        Atlas atlas;
+        int size = 0, lineHeight = 0, baseline = 0;
+        int distanceRange = 0;
+        std::vector<Character> characters;
+        std::vector<unsigned char> pixels;
+        int width = 0, height = 0, numChannels = 0;
+        
+        // Identifies the contents, so backends can share the uploaded
+        // atlas between contexts. The key hashes the json, the size
+        // and the pixels, and the json is kept to tell collisions apart
+        std::string json;
+        size_t key = 0;
+    };
+    
+    static Data prepare(std::string& json,
+                        std::vector<unsigned char> pixels,
+                        int width,
+                        int height,
+                        int numChannels);
+    
     Atlas atlas;
-    int size, lineHeight, baseline;
-    int distanceRange;
+    int size = 0, lineHeight = 0, baseline = 0;
+    int distanceRange = 0;
+    
+    // False until the data is uploaded on the render thread
+    bool isLoaded = false;
+    
+    virtual void upload(Data& data);
+    
+    virtual ~Font();
     
 protected:
     virtual void loadCharacter(Character& character);
-    void parseJson(std::string& json);
+    static void parseJson(std::string& json, Data& data);
 };
 
 class Context {
@@ -185,6 +594,12 @@ public:
     glm::mat3 matrix = glm::mat3(1.0f);
     
     BlendingMode blendingMode = BlendingMode::Normal;
+    AntiAliasing antiAliasing = AntiAliasing::Multisample;
+    
+    // When enforced, endDrawing() exits if the frame
+    // allocated more than the budget
+    AllocationStats allocationBudget;
+    bool enforceAllocationBudget = false;
     
     LineJoin lineJoin = LineJoin::Miter;
     LineCap lineCap = LineCap::Butt;
@@ -201,12 +616,25 @@ public:
     float fontSize = 32.0f;
     
     void loadFont(std::string jsonPath, std::string imagePath, std::string fontName);
-    virtual void loadFontFromMemory(std::string& json,
-                                    std::string fontName,
-                                    void* imageData,
-                                    int width,
-                                    int height,
-                                    int numChannels);
+    void loadFontFromMemory(std::string& json,
+                            std::string fontName,
+                            void* imageData,
+                            int width,
+                            int height,
+                            int numChannels);
+    
+    // Parses the font on a worker thread and returns immediately.
+    // The returned font is already in the fonts map, but text is
+    // skipped until it's uploaded at one of the next beginDrawing()
+    Font* loadFontFromMemoryAsync(std::string json,
+                                  std::string fontName,
+                                  std::vector<unsigned char> imageData,
+                                  int width,
+                                  int height,
+                                  int numChannels);
+    
+    // Blocks until all the fonts loading in background are uploaded
+    void waitForFonts();
     
     void orthographic(float width, float height);
     
@@ -220,17 +648,44 @@ public:
     virtual void beginDrawing();
     virtual void endDrawing();
     
+    // Allocations of the drawing thread between the last beginDrawing()
+    // and endDrawing(). The counters belong to the thread, not the context,
+    // so frames of contexts interleaved on one thread count each other
+    AllocationStats frameAllocations();
+    // Statistics of the last finished frame
+    FrameStats frameStats();
+    
+    // Pushes the transform, styles, line and font settings. restore()
+    // brings them back and pops the clips made after the save
+    void save();
+    void restore();
+    
     void beginPath();
     void closePath();
     
+    // Every beginClip() pushes a clip that is intersected with the current
+    // ones, so replacing a clip takes popClip() or clearClip() first
     virtual void beginClip();
     virtual void endClip();
+    virtual void popClip();
     virtual void clearClip();
+    // Number of clips that are not popped yet
+    virtual int clipDepth();
     
     virtual void convexFill();
     virtual void fill();
     virtual void stroke();
     
+    // Fills the current path once for every instance with its color.
+    // The instance matrix is applied before the context matrix
+    virtual void fillInstanced(const Instance* instances, size_t count);
+    
+    // Bulk drawing for charts. The primitives ignore the current
+    // path and styles, and are drawn in the order they are given
+    void strokeSegments(const Segment* segments, size_t count);
+    void fillRects(const Rect* rects, size_t count);
+    void fillPoints(const Point* points, size_t count);
+    
     virtual void print(std::wstring str, float x, float y);
     virtual void printOnPath(std::wstring str, float x = 0, float y = 0);
     
@@ -243,6 +698,7 @@ public:
     void quadraticTo(float cpx, float cpy, float x, float y);
     
     void arc(float x, float y, float radius, float startAngle, float endAngle);
+    void ellipse(float x, float y, float radiusX, float radiusY);
     void rect(float x, float y, float width, float height, float radius);
     void rect(float x, float y, float width, float height);
     void rect(float x, float y, float width, float height,
@@ -256,28 +712,130 @@ public:
     virtual ~Context();
     
 protected:
-    std::vector<std::vector<glm::vec2>> mPolylines;
+    // Temporaries of tessellation, reset at beginDrawing()
+    Arena mArena;
+    // Polylines of the current path, reset at beginPath()
+    Arena mPathArena;
+    // Temporaries of one step of tessellation, freed by ArenaScope
+    Arena mScratchArena;
+    
+    factory::Polylines mPolylines;
     bool mIsPolylineClosed = false;
     glm::vec2 mCurrentPos;
     
+    // Rectangle, rounded rectangle or ellipse that is the whole
+    // path, so backends can draw it without tessellation
+    struct AnalyticShape {
+        enum class Type {
+            None,
+            RoundedRect,
+            Ellipse
+        };
+        Type type = Type::None;
+        glm::vec2 center = glm::vec2(0.0f);
+        glm::vec2 halfSize = glm::vec2(0.0f);
+        // Top left, top right, bottom right and bottom left
+        glm::vec4 radii = glm::vec4(0.0f);
+    };
+    AnalyticShape mAnalyticShape;
+    
+    // Quadratic curves that polylines of the path were flattened from
+    struct PathCurve {
+        size_t polyline;
+        factory::QuadraticCurve curve;
+    };
+    std::vector<PathCurve> mCurves;
+    // Distance in path units allowed between a cubic and its quadratics
+    static constexpr float curveTolerance = 0.1f;
+    
     int mShapeDrawCounter = 0;
     bool mDrawingBegan = false;
     
-    std::vector<glm::vec2> toOnePolyline(std::vector<std::vector<glm::vec2>> polylines);
+    AllocationStats mFrameStartAllocations;
+    AllocationStats mFrameAllocations;
+    // Stats of the frame being drawn, and of the last one
+    FrameStats mFrameStats;
+    FrameStats mLastFrameStats;
+    
+    // Styles and dash patterns are interned, so that saving
+    // the state only stores their indices
+    struct State {
+        glm::mat3 matrix;
+        BlendingMode blendingMode;
+        LineJoin lineJoin;
+        LineCap lineCap;
+        float lineWidth;
+        int blurRadius;
+        Font* font;
+        float fontSize;
+        uint32_t fillStyle;
+        uint32_t strokeStyle;
+        uint32_t lineDash;
+        int clipDepth;
+    };
+    std::vector<State> mStates;
+    // Interned values only live as long as the states of one frame.
+    // Slots past the count are kept to reuse the memory of their vectors
+    std::vector<Style> mInternedStyles;
+    uint32_t mNumInternedStyles = 0;
+    InternIndex mInternedStyleIndices;
+    std::vector<LineDash> mInternedDashes;
+    uint32_t mNumInternedDashes = 0;
+    InternIndex mInternedDashIndices;
+    
+    uint32_t internStyle(const Style& style);
+    uint32_t internLineDash(const LineDash& lineDash);
+    
+    struct PendingFont {
+        Font* font;
+        std::future<Font::Data> data;
+    };
+    std::vector<PendingFont> mPendingFonts;
+    
+    virtual Font* createFont();
+    void uploadPendingFonts(bool wait);
+    
+    factory::Polyline toOnePolyline(const factory::Polylines& polylines, Arena* arena);
+    
+    // Fills unit squares under the instance transforms. By default
+    // squares of equal colors in a row are merged into one mesh
+    virtual void fillQuads(const Instance* quads, size_t count);
+    virtual void fillMesh(factory::ShapeMesh& mesh, Style& style);
     
     factory::ShapeMesh internalFill();
     factory::ShapeMesh internalConvexFill();
+    // Triangulates only the control polygon and leaves the curves
+    // to the pixel shader
+    factory::CurveMesh internalCurveFill();
+    
+    // Width of one pixel in the space of the path
+    float pixelWidth();
+    virtual bool isFeathering();
+    void featherFill(factory::ShapeMesh& mesh);
+    
+    // True if the path transformed by the matrix is an axis-aligned
+    // rectangle. Backends use it to clip with a scissor rectangle
+    bool isPathAxisAlignedRect(glm::vec2& min, glm::vec2& max);
     factory::ShapeMesh internalStroke();
+    // Centerline of the stroke with its joins and caps, for backends
+    // that extrude it to the line width on the GPU. Without splitting,
+    // dashes are left to the backend
+    ArenaVector<factory::StrokePart> internalStrokeParts(bool splitDashes = true);
+    factory::Polylines dashPolylines();
+    // Lengths of dashes and gaps as the dashed polylines are cut, and the
+    // position in the pattern at the start of the path
+    ArenaVector<float> dashPattern(float& phase);
     
     void assertDrawingIsBegan();
     
-    std::vector<factory::TriangeIndices> debugTriangulate(std::vector<glm::vec2>& vertices,
-                                                          bool draw);
+    std::vector<factory::TriangeIndices> debugTriangulate(Span<glm::vec2> vertices, bool draw);
 };
 
 namespace earcut {
 
-std::vector<factory::TriangeIndices> triangulate(std::vector<glm::vec2>& vertices);
+// Triangles and temporaries are allocated from the arena if there is one
+ArenaVector<factory::TriangeIndices> triangulate(Span<glm::vec2> vertices,
+                                                 Arena* arena = nullptr);
 
 } // namespace earcut
 
@@ -1,4 +1,12 @@
 #include <backends/diligent.hh>
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <Graphics/GraphicsEngine/interface/APIInfo.h>
 #include <Graphics/GraphicsTools/interface/CommonlyUsedStates.h>
 #include <Graphics/GraphicsTools/interface/MapHelper.hpp>
 #include <glm/gtx/transform.hpp>
@@ -10,14 +18,18 @@ DiligentContext::DiligentContext(float width, float height,
                 Diligent::RefCntAutoPtr<Diligent::IDeviceContext> deviceContext,
                 Diligent::TEXTURE_FORMAT colorBufferFormat,
                 Diligent::TEXTURE_FORMAT depthBufferFormat,
-                int numSamples):
+                int numSamples,
+                std::shared_ptr<render::DeviceResources> resources):
     Context(width, height),
     mRenderDevice(renderDevice),
     mDeviceContext(deviceContext),
     mColorBufferFormat(colorBufferFormat),
     mDepthBufferFormat(depthBufferFormat),
+    mResources(resources),
     mNumSamples(numSamples)
 {
+    if(mResources == nullptr)
+        mResources = std::make_shared<render::DeviceResources>(renderDevice);
     initPipelineState();
 }
 
@@ -26,12 +38,41 @@ DiligentContext::DiligentContext()
 }
 
 void DiligentContext::initPipelineState() {
-    mSolidColorPSO = render::SolidColorPipelineStates(mRenderDevice,
+    mSolidColorPSO = render::SolidColorPipelineStates(*mResources,
                                                      mColorBufferFormat,
                                                      mDepthBufferFormat,
                                                      mNumSamples);
     
-    mGradientPSO = render::GradientPipelineStates(mRenderDevice,
+    mInstancedPSO = render::InstancedPipelineStates(*mResources,
+                                                   mColorBufferFormat,
+                                                   mDepthBufferFormat,
+                                                   mNumSamples);
+    
+    mAnalyticPSO = render::AnalyticPipelineStates(*mResources,
+                                                  mColorBufferFormat,
+                                                  mDepthBufferFormat,
+                                                  mNumSamples);
+    
+    mStrokePSO = render::StrokePipelineStates(*mResources,
+                                              mColorBufferFormat,
+                                              mDepthBufferFormat,
+                                              mNumSamples);
+    
+    mCurvePSO = render::CurvePipelineStates(*mResources,
+                                            mColorBufferFormat,
+                                            mDepthBufferFormat,
+                                            mNumSamples);
+    
+    factory::ShapeMesh unitQuad = factory::unitQuad();
+    mUnitQuad = render::Shape(mRenderDevice, unitQuad);
+    factory::ShapeMesh strokeTemplate = render::strokeTemplate();
+    mStrokeTemplate = render::Shape(mRenderDevice, strokeTemplate);
+    
+    mGradientRamps = render::GradientRamps(mRenderDevice);
+    mGPUTimers = render::GPUTimers(mRenderDevice);
+    
+    mGradientPSO = render::GradientPipelineStates(*mResources,
+                                                 mGradientRamps.textureSRV,
                                                  mColorBufferFormat,
                                                  mDepthBufferFormat,
                                                  mNumSamples);
@@ -42,59 +83,70 @@ void DiligentContext::initPipelineState() {
 namespace shader {
 
 GradientConstants::GradientConstants(Style& style, glm::mat4& MVP, Context& context) {
+    glm::vec2 resolution = glm::vec2(context.width, context.height) * context.contentScale;
+    auto toPixels = [&](float x, float y) {
+        glm::vec2 pos = glm::vec2(MVP * glm::vec4(x, y, 0.0f, 1.0f));
+        return glm::vec2((pos.x + 1.0f) / 2.0f, (1.0f - pos.y) / 2.0f) * resolution;
+    };
+    
+    // Invert the linear part of the local to pixel transform,
+    // so that local = inverse * (pixel - origin)
+    glm::vec2 origin = toPixels(0.0f, 0.0f);
+    glm::vec2 axisX = toPixels(1.0f, 0.0f) - origin;
+    glm::vec2 axisY = toPixels(0.0f, 1.0f) - origin;
+    float det = axisX.x * axisY.y - axisY.x * axisX.y;
+    if(det == 0.0f)
+        det = 1.0f;
+    glm::vec2 inverseX = glm::vec2(axisY.y, -axisY.x) / det;
+    glm::vec2 inverseY = glm::vec2(-axisX.y, axisX.x) / det;
+    
+    // Row computing dot(dir, local - point) from the pixel position
+    auto gradientRow = [&](glm::vec2 dir, glm::vec2 point) {
+        glm::vec2 w = inverseX * dir.x + inverseY * dir.y;
+        return glm::vec4(w.x, w.y, -glm::dot(w, origin) - glm::dot(dir, point), 0.0f);
+    };
+    
     switch(style.type) {
         case Style::Type::LinearGradient:
+        {
             this->type = Type::Linear;
             this->startColor = style.linear.startColor;
             this->endColor = style.linear.endColor;
-            this->startPos = glm::vec2(MVP * glm::vec4(style.linear.startX,
-                                                       style.linear.startY,
-                                                       0.0f, 1.0f));
-            this->endPos = glm::vec2(MVP * glm::vec4(style.linear.endX,
-                                                     style.linear.endY,
-                                                     0.0f, 1.0f));
-            // Convert range (-1.0, 1.0) to (0.0, 1.0)
-            // and invert Y coordinate
-            this->startPos = (this->startPos + 1.0f) / 2.0f;
-            this->endPos = (this->endPos + 1.0f) / 2.0f;
-            this->startPos.y = 1.0f - this->startPos.y;
-            this->endPos.y = 1.0f - this->endPos.y;
+            glm::vec2 start = glm::vec2(style.linear.startX, style.linear.startY);
+            glm::vec2 dir = glm::vec2(style.linear.endX, style.linear.endY) - start;
+            float lengthSquared = glm::dot(dir, dir);
+            if(lengthSquared > 0.0f)
+                dir /= lengthSquared;
+            this->transformX = gradientRow(dir, start);
+        }
             break;
         case Style::Type::RadialGradient:
+        {
             this->type = Type::Radial;
             this->startColor = style.radial.startColor;
             this->endColor = style.radial.endColor;
-            this->startPos = glm::vec2(MVP * glm::vec4(style.radial.x,
-                                                       style.radial.y,
-                                                       0.0f, 1.0f));
-            this->startPos = (this->startPos + 1.0f) / 2.0f;
-            this->startPos.y = 1.0f - this->startPos.y;
-            this->radiusOrAngle = style.radial.radius;
+            glm::vec2 center = glm::vec2(style.radial.x, style.radial.y);
+            float scale = style.radial.radius != 0.0f ? 1.0f / style.radial.radius : 0.0f;
+            this->transformX = gradientRow(glm::vec2(scale, 0.0f), center);
+            this->transformY = gradientRow(glm::vec2(0.0f, scale), center);
+        }
             break;
         case Style::Type::ConicGradient:
+        {
             this->type = Type::Conic;
             this->startColor = style.conic.startColor;
             this->endColor = style.conic.endColor;
-            this->startPos = glm::vec2(MVP * glm::vec4(style.conic.x,
-                                                       style.conic.y,
-                                                       0.0f, 1.0f));
-            this->startPos = (this->startPos + 1.0f) / 2.0f;
-            this->startPos.y = 1.0f - this->startPos.y;
-        {
-            // Rotate angle with MVP matrix. Angle will be non zero
-            // if we deal with rotated matrix
-            glm::vec2 point1 = glm::vec2(MVP * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
-            glm::vec2 point2 = glm::vec2(MVP * glm::vec4(0.0f, -1.0f, 0.0f, 1.0f));
-            glm::vec2 relative = point2 - point1;
-            float addAngle = atan2f(relative.x, relative.y);
-            
-            this->radiusOrAngle = style.conic.angle + addAngle;
+            glm::vec2 center = glm::vec2(style.conic.x, style.conic.y);
+            // Rotate by -angle
+            float c = cosf(style.conic.angle);
+            float s = sinf(style.conic.angle);
+            this->transformX = gradientRow(glm::vec2(c, s), center);
+            this->transformY = gradientRow(glm::vec2(-s, c), center);
         }
             break;
         default:
             break;
     }
-    this->resolution = glm::vec2(context.width, context.height) * context.contentScale;
 }
 
 shader::GradientConstants::GradientConstants()
@@ -105,21 +157,91 @@ shader::GradientConstants::GradientConstants()
 
 namespace render {
 
-Diligent::InputLayoutDesc createInputLayoutDesc() {
-    Diligent::InputLayoutDesc Desc;
-    Diligent::LayoutElement LayoutElems[] =
-    {
-        // Attribute 0 - vertex position 2D
-        Diligent::LayoutElement{0, 0, 2, Diligent::VT_FLOAT32, Diligent::False}
-    };
-    Desc.LayoutElements = LayoutElems;
-    Desc.NumElements = _countof(LayoutElems);
-    return Desc;
+bool PipelineStateKey::operator==(const PipelineStateKey& other) const {
+    return type == other.type &&
+        colorBufferFormat == other.colorBufferFormat &&
+        depthBufferFormat == other.depthBufferFormat &&
+        numSamples == other.numSamples &&
+        clipMask == other.clipMask &&
+        isOpaque == other.isOpaque &&
+        blendingMode == other.blendingMode;
+}
+
+size_t PipelineStateKey::Hash::operator()(const PipelineStateKey& key) const {
+    size_t hash = (size_t)key.type;
+    hash = hash * 31 + (size_t)key.colorBufferFormat;
+    hash = hash * 31 + (size_t)key.depthBufferFormat;
+    hash = hash * 31 + (size_t)key.numSamples;
+    hash = hash * 31 + (size_t)key.clipMask;
+    hash = hash * 31 + (size_t)key.isOpaque;
+    hash = hash * 31 + (size_t)key.blendingMode;
+    return hash;
+}
+
+// How the pixel shaders fold the alpha into the color. Multiply and
+// screen blend premultiplied colors, and min and max ignore the blend
+// factors, so a transparent source has to become the neutral color
+enum class AlphaFold {
+    None,
+    OverBlack,
+    OverWhite
+};
+
+AlphaFold alphaFold(BlendingMode blendingMode) {
+    switch(blendingMode) {
+        case BlendingMode::Multiply:
+        case BlendingMode::Screen:
+        case BlendingMode::Lighter:
+            return AlphaFold::OverBlack;
+        case BlendingMode::Darker:
+            return AlphaFold::OverWhite;
+        default:
+            return AlphaFold::None;
+    }
+}
+
+void setBlendingMode(Diligent::RenderTargetBlendDesc& blendDesc, BlendingMode blendingMode) {
+    blendDesc.BlendEnable = Diligent::True;
+    blendDesc.SrcBlend = Diligent::BLEND_FACTOR_SRC_ALPHA;
+    blendDesc.DestBlend = Diligent::BLEND_FACTOR_INV_SRC_ALPHA;
+    blendDesc.BlendOp = Diligent::BLEND_OPERATION_ADD;
+    switch(blendingMode) {
+        case BlendingMode::Add:
+            blendDesc.DestBlend = Diligent::BLEND_FACTOR_ONE;
+            break;
+        case BlendingMode::Subtract:
+            blendDesc.DestBlend = Diligent::BLEND_FACTOR_ONE;
+            blendDesc.BlendOp = Diligent::BLEND_OPERATION_REV_SUBTRACT;
+            break;
+        case BlendingMode::Multiply:
+            // src * a * dst + dst * (1 - a)
+            blendDesc.SrcBlend = Diligent::BLEND_FACTOR_DEST_COLOR;
+            break;
+        case BlendingMode::Screen:
+            // src * a + dst * (1 - src * a)
+            blendDesc.SrcBlend = Diligent::BLEND_FACTOR_ONE;
+            blendDesc.DestBlend = Diligent::BLEND_FACTOR_INV_SRC_COLOR;
+            break;
+        case BlendingMode::Darker:
+            // The factors are ignored, the shader folds the alpha.
+            // Partial coverage only approximates a blend with the result
+            blendDesc.BlendOp = Diligent::BLEND_OPERATION_MIN;
+            break;
+        case BlendingMode::Lighter:
+            blendDesc.BlendOp = Diligent::BLEND_OPERATION_MAX;
+            break;
+        default:
+            // Divide and overlay can't be expressed with fixed
+            // function blending, so they are drawn as normal
+            break;
+    }
 }
 
-PipelineState::PipelineState(PipelineStateConfiguration conf,
-                             Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice)
+Diligent::RefCntAutoPtr<Diligent::IPipelineState>
+createPipelineState(PipelineStateConfiguration& conf,
+                    Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice)
 {
+    BVG_TRACE_ZONE("createPipelineState");
     Diligent::GraphicsPipelineStateCreateInfo PSOCreateInfo;
     PSOCreateInfo.PSODesc.Name = conf.name.c_str();
     PSOCreateInfo.PSODesc.PipelineType = Diligent::PIPELINE_TYPE_GRAPHICS;
@@ -129,253 +251,1163 @@ PipelineState::PipelineState(PipelineStateConfiguration conf,
     PSOCreateInfo.GraphicsPipeline.DSVFormat = conf.depthBufferFormat;
     PSOCreateInfo.GraphicsPipeline.PrimitiveTopology = Diligent::PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
     PSOCreateInfo.GraphicsPipeline.RasterizerDesc.CullMode = Diligent::CULL_MODE_NONE;
+    PSOCreateInfo.GraphicsPipeline.RasterizerDesc.ScissorEnable = Diligent::True;
+    // Everything is drawn where the stencil equals the clip level
     PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.StencilEnable = Diligent::True;
     Diligent::StencilOpDesc StencilDesc;
+    StencilDesc.StencilFunc = Diligent::COMPARISON_FUNC_EQUAL;
+    if(conf.clipMask == ClipMask::Push)
+        StencilDesc.StencilPassOp = Diligent::STENCIL_OP_INCR_SAT;
+    else if(conf.clipMask == ClipMask::Pop)
+        StencilDesc.StencilPassOp = Diligent::STENCIL_OP_DECR_SAT;
     PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.FrontFace = StencilDesc;
     PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.BackFace = StencilDesc;
-    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthEnable = Diligent::True;
-    if(!conf.isClippingMask) {
+    if(conf.clipMask == ClipMask::None) {
+        PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthEnable = Diligent::True;
+        PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthWriteEnable = conf.isOpaque;
+        // Later draws are never farther, so equal depth passes too
         PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthFunc =
-            Diligent::COMPARISON_FUNC_LESS;
+            Diligent::COMPARISON_FUNC_LESS_EQUAL;
     } else {
-        PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthFunc =
-            Diligent::COMPARISON_FUNC_ALWAYS;
+        PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthEnable = Diligent::False;
+        PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthWriteEnable = Diligent::False;
     }
 
     Diligent::BlendStateDesc BlendState;
-    BlendState.RenderTargets[0].BlendEnable = Diligent::True;
-    BlendState.RenderTargets[0].SrcBlend = Diligent::BLEND_FACTOR_SRC_ALPHA;
-    BlendState.RenderTargets[0].DestBlend = Diligent::BLEND_FACTOR_INV_SRC_ALPHA;
+    setBlendingMode(BlendState.RenderTargets[0], conf.blendingMode);
+    if(conf.clipMask != ClipMask::None)
+        BlendState.RenderTargets[0].RenderTargetWriteMask = Diligent::COLOR_MASK_NONE;
     PSOCreateInfo.GraphicsPipeline.BlendDesc = BlendState;
 
+    PSOCreateInfo.pPSOCache = conf.cache;
     PSOCreateInfo.pVS = conf.vertexShader;
     PSOCreateInfo.pPS = conf.pixelShader;
 
+    Diligent::LayoutElement GlyphLayoutElems[] =
+    {
+        // Attribute 0 - vertex position 2D
+        Diligent::LayoutElement{0, 0, 2, Diligent::VT_FLOAT32, Diligent::False},
+        // Attribute 1 - texture coordinate
+        Diligent::LayoutElement{1, 0, 2, Diligent::VT_FLOAT32, Diligent::False}
+    };
     Diligent::LayoutElement LayoutElems[] =
+    {
+        // Attribute 0 - vertex position 2D and coverage
+        Diligent::LayoutElement{0, 0, 3, Diligent::VT_FLOAT32, Diligent::False}
+    };
+    Diligent::LayoutElement InstancedLayoutElems[] =
+    {
+        // Attribute 0 - vertex position 2D and coverage
+        Diligent::LayoutElement{0, 0, 3, Diligent::VT_FLOAT32, Diligent::False},
+        // Attributes 1, 2 - instance transform rows
+        Diligent::LayoutElement{1, 1, 4, Diligent::VT_FLOAT32, Diligent::False,
+                                Diligent::INPUT_ELEMENT_FREQUENCY_PER_INSTANCE},
+        Diligent::LayoutElement{2, 1, 4, Diligent::VT_FLOAT32, Diligent::False,
+                                Diligent::INPUT_ELEMENT_FREQUENCY_PER_INSTANCE},
+        // Attribute 3 - instance color
+        Diligent::LayoutElement{3, 1, 4, Diligent::VT_FLOAT32, Diligent::False,
+                                Diligent::INPUT_ELEMENT_FREQUENCY_PER_INSTANCE}
+    };
+    Diligent::LayoutElement CurveLayoutElems[] =
     {
         // Attribute 0 - vertex position 2D
-        Diligent::LayoutElement{0, 0, 2, Diligent::VT_FLOAT32, Diligent::False}
+        Diligent::LayoutElement{0, 0, 2, Diligent::VT_FLOAT32, Diligent::False},
+        // Attribute 1 - curve coordinates and side
+        Diligent::LayoutElement{1, 0, 3, Diligent::VT_FLOAT32, Diligent::False}
+    };
+    Diligent::LayoutElement StrokeLayoutElems[] =
+    {
+        // Attribute 0 - template vertex and its part
+        Diligent::LayoutElement{0, 0, 3, Diligent::VT_FLOAT32, Diligent::False},
+        // Attributes 1, 2 - stroke part points and type
+        Diligent::LayoutElement{1, 1, 4, Diligent::VT_FLOAT32, Diligent::False,
+                                Diligent::INPUT_ELEMENT_FREQUENCY_PER_INSTANCE},
+        Diligent::LayoutElement{2, 1, 4, Diligent::VT_FLOAT32, Diligent::False,
+                                Diligent::INPUT_ELEMENT_FREQUENCY_PER_INSTANCE}
     };
-    PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = LayoutElems;
-    PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(LayoutElems);
+    if(conf.isCurve) {
+        PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = CurveLayoutElems;
+        PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(CurveLayoutElems);
+    } else if(conf.isStroke) {
+        PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = StrokeLayoutElems;
+        PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(StrokeLayoutElems);
+    } else if(conf.isInstanced) {
+        PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = InstancedLayoutElems;
+        PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(InstancedLayoutElems);
+    } else if(conf.isGlyph) {
+        PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = GlyphLayoutElems;
+        PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(GlyphLayoutElems);
+    } else {
+        PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = LayoutElems;
+        PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(LayoutElems);
+    }
     
-    PSOCreateInfo.PSODesc.ResourceLayout.DefaultVariableType = Diligent::SHADER_RESOURCE_VARIABLE_TYPE_STATIC;
+    // Constants are mutable, so every context binds its own
+    // buffers to a pipeline state shared with other contexts
+    PSOCreateInfo.PSODesc.ResourceLayout.DefaultVariableType =
+        Diligent::SHADER_RESOURCE_VARIABLE_TYPE_MUTABLE;
     
-    PSO.Release();
-    SRB.Release();
-
+    Diligent::ImmutableSamplerDesc samplers[] =
+    {
+        { Diligent::SHADER_TYPE_PIXEL, "g_RampTexture", Diligent::Sam_LinearClamp },
+        { Diligent::SHADER_TYPE_PIXEL, "g_Texture", Diligent::Sam_LinearClamp }
+    };
+    if(conf.isGlyph || conf.isGradient) {
+        PSOCreateInfo.PSODesc.ResourceLayout.ImmutableSamplers = samplers;
+        PSOCreateInfo.PSODesc.ResourceLayout.NumImmutableSamplers = conf.isGlyph ? 2 : 1;
+    }
+    
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> PSO;
+    threadAllocations().pipelineStateCreations++;
     renderDevice->CreateGraphicsPipelineState(PSOCreateInfo, &PSO);
+    return PSO;
+}
 
-    if(conf.VSConstants != nullptr) {
-        PSO->GetStaticVariableByName(Diligent::SHADER_TYPE_VERTEX, "Constants")->
-            Set(conf.VSConstants);
+PipelineState::PipelineState(Diligent::RefCntAutoPtr<Diligent::IPipelineState> PSO,
+                             Diligent::IBuffer* VSConstants,
+                             Diligent::IBuffer* PSConstants):
+    PSO(PSO)
+{
+    PSO->CreateShaderResourceBinding(&SRB, true);
+    if(VSConstants != nullptr) {
+        SRB->GetVariableByName(Diligent::SHADER_TYPE_VERTEX, "Constants")->Set(VSConstants);
     }
-    if(conf.PSConstants != nullptr) {
-        PSO->GetStaticVariableByName(Diligent::SHADER_TYPE_PIXEL, "Constants")->
-            Set(conf.PSConstants);
+    if(PSConstants != nullptr) {
+        SRB->GetVariableByName(Diligent::SHADER_TYPE_PIXEL, "Constants")->Set(PSConstants);
     }
-
-    PSO->CreateShaderResourceBinding(&SRB, true);
 }
 
 PipelineState::PipelineState()
 {
 }
 
-SolidColorPipelineStates::
-SolidColorPipelineStates(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
-                        Diligent::TEXTURE_FORMAT colorBufferFormat,
-                        Diligent::TEXTURE_FORMAT depthBufferFormat,
-                        int numSamples) {
-    createShaders(renderDevice);
-    recreate(renderDevice, colorBufferFormat, depthBufferFormat,
-             BlendingMode::Normal,numSamples);
-    this->isInitialized = true;
+DeviceResources::DeviceResources(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice):
+    mRenderDevice(renderDevice)
+{
 }
 
-void SolidColorPipelineStates::
-createShaders(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice) {
+DeviceResources::~DeviceResources() {
+    for(std::future<void>& task : mCompileTasks)
+        task.wait();
+    saveDiskCache();
+}
+
+// Bump when the format of the cached files changes
+static const uint32_t diskCacheVersion = 2;
+
+// Bytecode is only valid for the shader compiler of the Diligent
+// build and the graphics API version that made it
+struct DiskCacheHeader {
+    char magic[4] = { 'B', 'V', 'G', 'C' };
+    uint32_t version = diskCacheVersion;
+    uint32_t diligentVersion = DILIGENT_API_VERSION;
+    uint32_t deviceVersion = 0;
+    uint64_t key = 0;
+    uint64_t sourceLength = 0;
+};
+
+// 64-bit FNV-1a. Unlike std::hash it's the same in every build,
+// so keys of the files on disk stay valid
+static uint64_t stableHash(const void* data, size_t size,
+                           uint64_t hash = 0xcbf29ce484222325ull) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static bool readFile(const std::string& path, std::vector<char>& data) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file.is_open())
+        return false;
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    data.resize(size);
+    return (bool)file.read(data.data(), size);
+}
+
+// Several processes and threads may share the cache, so every writer
+// writes its own file aside and then renames it over the old one
+static void writeFile(const std::string& path, const std::vector<char>& data) {
+    // Random per process and counted per write within it
+    static const uint32_t processTag = std::random_device()();
+    static std::atomic<uint32_t> writeCounter(0);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%08x-%u.tmp", processTag, (unsigned)writeCounter++);
+    std::string tempPath = path + suffix;
+    bool isWritten = false;
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if(!file.is_open())
+            return;
+        file.write(data.data(), data.size());
+        file.close();
+        isWritten = !file.fail();
+    }
+    if(!isWritten || std::rename(tempPath.c_str(), path.c_str()) != 0)
+        std::remove(tempPath.c_str());
+}
+
+void DeviceResources::enableDiskCache(const std::string& directory) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCacheDirectory = directory;
+    
+    std::string path = mCacheDirectory + "/blazevg-pso-" +
+        std::to_string((int)mRenderDevice->GetDeviceInfo().Type) + ".bin";
+    std::vector<char> data;
+    Diligent::PipelineStateCacheCreateInfo CacheCI;
+    CacheCI.Desc.Name = "blazevg pipeline state cache";
+    if(readFile(path, data)) {
+        CacheCI.pCacheData = data.data();
+        CacheCI.CacheDataSize = (Diligent::Uint32)data.size();
+    }
+    // Not every backend supports the cache, then it stays nullptr.
+    // Stale data is discarded by the device itself
+    mRenderDevice->CreatePipelineStateCache(CacheCI, &mPipelineStateCache);
+}
+
+void DeviceResources::saveDiskCache() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(mPipelineStateCache == nullptr)
+        return;
+    Diligent::RefCntAutoPtr<Diligent::IDataBlob> blob;
+    mPipelineStateCache->GetData(&blob);
+    if(blob == nullptr)
+        return;
+    const char* begin = (const char*)blob->GetConstDataPtr();
+    std::vector<char> data(begin, begin + blob->GetSize());
+    writeFile(mCacheDirectory + "/blazevg-pso-" +
+              std::to_string((int)mRenderDevice->GetDeviceInfo().Type) + ".bin", data);
+}
+
+static DiskCacheHeader diskCacheHeader(Diligent::IRenderDevice* renderDevice,
+                                       uint64_t key, uint64_t sourceLength) {
+    const Diligent::Version& apiVersion = renderDevice->GetDeviceInfo().APIVersion;
+    DiskCacheHeader header;
+    header.deviceVersion = apiVersion.Major << 16 | apiVersion.Minor;
+    header.key = key;
+    header.sourceLength = sourceLength;
+    return header;
+}
+
+Diligent::RefCntAutoPtr<Diligent::IShader>
+DeviceResources::loadCachedShader(const std::string& path,
+                                  uint64_t key,
+                                  uint64_t sourceLength,
+                                  Diligent::ShaderCreateInfo ShaderCI) {
+    std::vector<char> data;
+    if(!readFile(path, data) || data.size() <= sizeof(DiskCacheHeader))
+        return nullptr;
+    DiskCacheHeader expected = diskCacheHeader(mRenderDevice, key, sourceLength);
+    DiskCacheHeader header;
+    memcpy(&header, data.data(), sizeof(DiskCacheHeader));
+    if(memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+       header.version != expected.version ||
+       header.diligentVersion != expected.diligentVersion ||
+       header.deviceVersion != expected.deviceVersion ||
+       header.key != expected.key ||
+       header.sourceLength != expected.sourceLength)
+        return nullptr;
+    
+    ShaderCI.Source = nullptr;
+    ShaderCI.ByteCode = data.data() + sizeof(DiskCacheHeader);
+    ShaderCI.ByteCodeSize = data.size() - sizeof(DiskCacheHeader);
+    Diligent::RefCntAutoPtr<Diligent::IShader> shader;
+    mRenderDevice->CreateShader(ShaderCI, &shader);
+    return shader;
+}
+
+void DeviceResources::storeCachedShader(const std::string& path,
+                                        uint64_t key,
+                                        uint64_t sourceLength,
+                                        Diligent::IShader* shader) {
+    const void* bytecode = nullptr;
+    Diligent::Uint64 size = 0;
+    shader->GetBytecode(&bytecode, size);
+    // OpenGL has no bytecode
+    if(bytecode == nullptr || size == 0)
+        return;
+    DiskCacheHeader header = diskCacheHeader(mRenderDevice, key, sourceLength);
+    std::vector<char> data(sizeof(DiskCacheHeader) + size);
+    memcpy(data.data(), &header, sizeof(DiskCacheHeader));
+    memcpy(data.data() + sizeof(DiskCacheHeader), bytecode, size);
+    writeFile(path, data);
+}
+
+std::shared_ptr<DeviceResources>
+DeviceResources::shared(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice) {
+    static std::mutex registryMutex;
+    static std::unordered_map<Diligent::IRenderDevice*, std::weak_ptr<DeviceResources>> registry;
+    
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::weak_ptr<DeviceResources>& entry = registry[renderDevice.RawPtr()];
+    std::shared_ptr<DeviceResources> resources = entry.lock();
+    if(resources == nullptr) {
+        resources = std::make_shared<DeviceResources>(renderDevice);
+        entry = resources;
+    }
+    return resources;
+}
+
+Diligent::RefCntAutoPtr<Diligent::IRenderDevice> DeviceResources::getRenderDevice() {
+    return mRenderDevice;
+}
+
+Diligent::RefCntAutoPtr<Diligent::IShader>
+DeviceResources::shader(Diligent::SHADER_TYPE type, const char* name, const char* source) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return findOrCreateShader(type, name, source);
+}
+
+Diligent::RefCntAutoPtr<Diligent::IShader>
+DeviceResources::findOrCreateShader(Diligent::SHADER_TYPE type,
+                                    const char* name,
+                                    const char* source) {
+    auto it = mShaders.find(source);
+    if(it != mShaders.end())
+        return it->second;
+    
     Diligent::ShaderCreateInfo ShaderCI;
     ShaderCI.SourceLanguage = Diligent::SHADER_SOURCE_LANGUAGE_HLSL;
     ShaderCI.UseCombinedTextureSamplers = Diligent::True;
+    ShaderCI.Desc.ShaderType = type;
+    ShaderCI.EntryPoint = "main";
+    ShaderCI.Desc.Name = name;
+    ShaderCI.Source = source;
     
-    // Create a vertex shader
-    {
-        ShaderCI.Desc.ShaderType = Diligent::SHADER_TYPE_VERTEX;
-        ShaderCI.EntryPoint = "main";
-        ShaderCI.Desc.Name = "blazevg vertex shader";
-        ShaderCI.Source = shader::VSSource;
-        renderDevice->CreateShader(ShaderCI, &VS);
-
-        Diligent::BufferDesc CBDesc;
-        CBDesc.Name = "blazevg VS constants CB";
-        CBDesc.Size = sizeof(shader::VSConstants);
-        CBDesc.Usage = Diligent::USAGE_DYNAMIC;
-        CBDesc.BindFlags = Diligent::BIND_UNIFORM_BUFFER;
-        CBDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
-        renderDevice->CreateBuffer(CBDesc, nullptr, &VSConstants);
-    }
-
-    // Create a pixel shader
+    Diligent::RefCntAutoPtr<Diligent::IShader> shader;
+    if(mCacheDirectory.empty()) {
+        mRenderDevice->CreateShader(ShaderCI, &shader);
+        mShaders[source] = shader;
+        return shader;
+    }
+    
+    uint64_t sourceLength = strlen(source);
+    uint32_t deviceType = (uint32_t)mRenderDevice->GetDeviceInfo().Type;
+    uint32_t shaderType = (uint32_t)type;
+    uint64_t key = stableHash(source, sourceLength);
+    key = stableHash(&deviceType, sizeof(deviceType), key);
+    key = stableHash(&shaderType, sizeof(shaderType), key);
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "/blazevg-shader-%016llx.bin", (unsigned long long)key);
+    std::string path = mCacheDirectory + fileName;
+    
+    shader = loadCachedShader(path, key, sourceLength, ShaderCI);
+    if(shader == nullptr) {
+        // The cache is missing or stale
+        mRenderDevice->CreateShader(ShaderCI, &shader);
+        if(shader != nullptr)
+            storeCachedShader(path, key, sourceLength, shader);
+    }
+    mShaders[source] = shader;
+    return shader;
+}
+
+Diligent::RefCntAutoPtr<Diligent::IShader>
+DeviceResources::findOrCreatePixelShader(const char* name,
+                                         const char* source,
+                                         BlendingMode blendingMode) {
+    std::string variant;
+    switch(alphaFold(blendingMode)) {
+        case AlphaFold::OverBlack:
+            variant = "#define FOLD_ALPHA_OVER_BLACK 1\n";
+            break;
+        case AlphaFold::OverWhite:
+            variant = "#define FOLD_ALPHA_OVER_WHITE 1\n";
+            break;
+        default:
+            break;
+    }
+    variant += shader::PSPrelude;
+    variant += source;
+    // The set keeps the source alive and its pointer stable
+    const std::string& stored = *mShaderVariants.insert(std::move(variant)).first;
+    return findOrCreateShader(Diligent::SHADER_TYPE_PIXEL, name, stored.c_str());
+}
+
+Diligent::RefCntAutoPtr<Diligent::IPipelineState>
+DeviceResources::pipelineState(const PipelineStateKey& key) {
+    PipelineStateConfiguration conf;
     {
-        ShaderCI.Desc.ShaderType = Diligent::SHADER_TYPE_PIXEL;
-        ShaderCI.EntryPoint = "main";
-        ShaderCI.Desc.Name = "blazevg solid color pixel shader";
-        ShaderCI.Source = shader::solidcol::PSSource;
-        renderDevice->CreateShader(ShaderCI, &PS);
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mPipelineStates.find(key);
+        if(it != mPipelineStates.end())
+            return it->second;
+        conf = configure(key);
+    }
+    
+    // Compiled without the lock, so other threads
+    // can keep using already compiled states
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState> PSO =
+        createPipelineState(conf, mRenderDevice);
+    
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mPipelineStates.find(key);
+    if(it != mPipelineStates.end())
+        return it->second;
+    mPipelineStates[key] = PSO;
+    return PSO;
+}
+
+Diligent::RefCntAutoPtr<Diligent::IPipelineState>
+DeviceResources::findPipelineState(const PipelineStateKey& key) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mPipelineStates.find(key);
+    if(it == mPipelineStates.end())
+        return nullptr;
+    return it->second;
+}
+
+void DeviceResources::compilePipelineStateAsync(const PipelineStateKey& key) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(mPipelineStates.find(key) != mPipelineStates.end() ||
+       mCompilingPipelineStates.find(key) != mCompilingPipelineStates.end())
+        return;
+    
+    // Forget the tasks that are already done
+    for(auto it = mCompileTasks.begin(); it != mCompileTasks.end();) {
+        if(it->wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            it = mCompileTasks.erase(it);
+        else
+            it++;
+    }
+    
+    mCompilingPipelineStates.insert(key);
+    mCompileTasks.push_back(std::async(std::launch::async, [this, key]() {
+        this->pipelineState(key);
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCompilingPipelineStates.erase(key);
+    }));
+}
+
+PipelineStateConfiguration DeviceResources::configure(const PipelineStateKey& key) {
+    PipelineStateConfiguration conf;
+    conf.colorBufferFormat = key.colorBufferFormat;
+    conf.depthBufferFormat = key.depthBufferFormat;
+    conf.numSamples = key.numSamples;
+    conf.clipMask = key.clipMask;
+    conf.isOpaque = key.isOpaque;
+    conf.blendingMode = key.blendingMode;
+    conf.cache = mPipelineStateCache;
+    switch(key.type) {
+        case PipelineStateKey::Type::SolidColor:
+            conf.name = key.clipMask == ClipMask::None ? "blazevg solid color PSO" :
+                                                         "blazevg clip PSO";
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg vertex shader",
+                                                   shader::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg solid color pixel shader",
+                                                       shader::solidcol::PSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::LinearGradient:
+            conf.name = "blazevg linear gradient PSO";
+            conf.isGradient = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg vertex shader",
+                                                   shader::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg linear gradient pixel shader",
+                                                       shader::grad::LinearPSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::RadialGradient:
+            conf.name = "blazevg radial gradient PSO";
+            conf.isGradient = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg vertex shader",
+                                                   shader::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg radial gradient pixel shader",
+                                                       shader::grad::RadialPSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::ConicGradient:
+            conf.name = "blazevg conic gradient PSO";
+            conf.isGradient = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg vertex shader",
+                                                   shader::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg conic gradient pixel shader",
+                                                       shader::grad::ConicPSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::Instanced:
+            conf.name = "blazevg instanced PSO";
+            conf.isInstanced = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg instanced vertex shader",
+                                                   shader::instanced::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg instanced pixel shader",
+                                                       shader::instanced::PSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::Stroke:
+            conf.name = "blazevg stroke PSO";
+            conf.isStroke = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg stroke vertex shader",
+                                                   shader::stroke::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg solid color pixel shader",
+                                                       shader::solidcol::PSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::DashedStroke:
+            conf.name = "blazevg dashed stroke PSO";
+            conf.isStroke = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg stroke vertex shader",
+                                                   shader::stroke::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg dashed stroke pixel shader",
+                                                       shader::stroke::DashPSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::Curve:
+            conf.name = "blazevg curve PSO";
+            conf.isCurve = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg curve vertex shader",
+                                                   shader::curve::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg curve pixel shader",
+                                                       shader::curve::PSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::Analytic:
+            conf.name = "blazevg analytic PSO";
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg analytic vertex shader",
+                                                   shader::analytic::VSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg analytic pixel shader",
+                                                       shader::analytic::PSSource,
+                                                       key.blendingMode);
+            break;
+        case PipelineStateKey::Type::Glyph:
+            conf.name = "blazevg font PSO";
+            conf.isGlyph = true;
+            conf.vertexShader = findOrCreateShader(Diligent::SHADER_TYPE_VERTEX,
+                                                   "blazevg glyph msdf vertex shader",
+                                                   shader::msdf::GlyphVSSource);
+            conf.pixelShader = findOrCreatePixelShader("blazevg glyph msdf pixel shader",
+                                                       shader::msdf::PSSource,
+                                                       key.blendingMode);
+            break;
+    }
+    return conf;
+}
+
+size_t GlyphAtlas::key() const {
+    return this->contentKey * 31 + (size_t)this->format;
+}
+
+bool GlyphAtlas::isSameFont(const GlyphAtlas& other) const {
+    return this->contentKey == other.contentKey &&
+           this->format == other.format &&
+           this->width == other.width &&
+           this->height == other.height &&
+           this->json == other.json;
+}
 
-        Diligent::BufferDesc CBDesc;
-        CBDesc.Name = "blazevg solid color PS constants CB";
-        CBDesc.Size = sizeof(shader::solidcol::PSConstants);
-        CBDesc.Usage = Diligent::USAGE_DYNAMIC;
-        CBDesc.BindFlags = Diligent::BIND_UNIFORM_BUFFER;
-        CBDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
-        renderDevice->CreateBuffer(CBDesc, nullptr, &PSConstants);
+std::shared_ptr<GlyphAtlas> DeviceResources::findGlyphAtlas(const GlyphAtlas& identity) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto range = mGlyphAtlases.equal_range(identity.key());
+    for(auto it = range.first; it != range.second; it++) {
+        std::shared_ptr<GlyphAtlas> atlas = it->second.lock();
+        if(atlas != nullptr && atlas->isSameFont(identity))
+            return atlas;
     }
+    return nullptr;
+}
+
+void DeviceResources::addGlyphAtlas(std::shared_ptr<GlyphAtlas> atlas) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    size_t key = atlas->key();
+    // Atlases of fonts that are gone are dropped on the way
+    auto range = mGlyphAtlases.equal_range(key);
+    for(auto it = range.first; it != range.second;) {
+        if(it->second.expired())
+            it = mGlyphAtlases.erase(it);
+        else
+            it++;
+    }
+    mGlyphAtlases.emplace(key, atlas);
+}
+
+void BlendingPipelineStates::reset(const PipelineStateKey& key) {
+    mKey = key;
+    for(int i = 0; i < numBlendingModes; i++)
+        mVariants[i].Release();
+}
+
+Diligent::IPipelineState* BlendingPipelineStates::get(DeviceResources& resources,
+                                                      BlendingMode blendingMode) {
+    Diligent::RefCntAutoPtr<Diligent::IPipelineState>& variant = mVariants[(int)blendingMode];
+    if(variant != nullptr)
+        return variant;
+    
+    PipelineStateKey key = mKey;
+    key.blendingMode = blendingMode;
+    if(blendingMode == BlendingMode::Normal) {
+        variant = resources.pipelineState(key);
+        return variant;
+    }
+    variant = resources.findPipelineState(key);
+    if(variant != nullptr)
+        return variant;
+    resources.compilePipelineStateAsync(key);
+    return this->get(resources, BlendingMode::Normal);
+}
+
+void BlendingPipelineStates::warmUp(DeviceResources& resources) {
+    for(int i = 0; i < numBlendingModes; i++) {
+        PipelineStateKey key = mKey;
+        key.blendingMode = (BlendingMode)i;
+        mVariants[i] = resources.pipelineState(key);
+    }
+}
+
+GPUTimers::GPUTimers(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice):
+    mRenderDevice(renderDevice)
+{
+    mIsSupported = renderDevice->GetDeviceInfo().Features.DurationQueries ==
+                   Diligent::DEVICE_FEATURE_STATE_ENABLED;
+}
+
+GPUTimers::GPUTimers()
+{
+}
+
+bool GPUTimers::isSupported() {
+    return mIsSupported;
+}
+
+void GPUTimers::nextFrame() {
+    if(!mIsSupported)
+        return;
+    mFrame = (mFrame + 1) % numFrames;
+    Frame& frame = mFrames[mFrame];
+    
+    float sums[numCategories] = {};
+    bool isComplete = true;
+    for(size_t i = 0; i < frame.numUsed; i++) {
+        Group& group = frame.groups[i];
+        Diligent::QueryDataDuration data;
+        if(!group.query->GetData(&data, sizeof(data)) || data.Frequency == 0) {
+            isComplete = false;
+            continue;
+        }
+        sums[(int)group.category] += (float)((double)data.Duration * 1000.0 /
+                                             (double)data.Frequency);
+    }
+    // Frame which isn't finished by the GPU yet is skipped
+    // instead of waiting for it
+    if(isComplete) {
+        for(int i = 0; i < numCategories; i++)
+            durations[i] = sums[i];
+    }
+    frame.numUsed = 0;
+}
+
+void GPUTimers::begin(Diligent::IDeviceContext* deviceContext, Category category) {
+    if(!mIsSupported || (mIsMeasuring && mCategory == category))
+        return;
+    this->end(deviceContext);
+    
+    Frame& frame = mFrames[mFrame];
+    if(frame.numUsed == frame.groups.size()) {
+        Diligent::QueryDesc desc;
+        desc.Name = "blazevg GPU timer query";
+        desc.Type = Diligent::QUERY_TYPE_DURATION;
+        Group group;
+        mRenderDevice->CreateQuery(desc, &group.query);
+        frame.groups.push_back(group);
+    }
+    Group& group = frame.groups[frame.numUsed];
+    group.category = category;
+    deviceContext->BeginQuery(group.query);
+    mCategory = category;
+    mIsMeasuring = true;
+}
+
+void GPUTimers::end(Diligent::IDeviceContext* deviceContext) {
+    if(!mIsMeasuring)
+        return;
+    Frame& frame = mFrames[mFrame];
+    deviceContext->EndQuery(frame.groups[frame.numUsed].query);
+    frame.numUsed++;
+    mIsMeasuring = false;
+}
+
+GradientRamps::GradientRamps(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice) {
+    Diligent::TextureDesc TexDesc;
+    TexDesc.Name = "blazevg gradient ramps";
+    TexDesc.Type = Diligent::RESOURCE_DIM_TEX_2D;
+    TexDesc.Width = width;
+    TexDesc.Height = height;
+    TexDesc.MipLevels = 1;
+    TexDesc.Format = Diligent::TEX_FORMAT_RGBA8_UNORM;
+    TexDesc.BindFlags = Diligent::BIND_SHADER_RESOURCE;
+    renderDevice->CreateTexture(TexDesc, nullptr, &texture);
+    textureSRV = texture->GetDefaultView(Diligent::TEXTURE_VIEW_SHADER_RESOURCE);
+}
+
+GradientRamps::GradientRamps()
+{
+}
+
+// Stops of the gradient without copying them. Start and end colors of a
+// gradient without stops are written to the storage of two stops
+static Span<ColorStop> gradientStops(const Style& style, ColorStop* storage) {
+    if(!style.stops.empty())
+        return Span<ColorStop>(style.stops);
+    switch(style.type) {
+        case Style::Type::LinearGradient:
+            storage[0] = ColorStop(0.0f, style.linear.startColor);
+            storage[1] = ColorStop(1.0f, style.linear.endColor);
+            break;
+        case Style::Type::RadialGradient:
+            storage[0] = ColorStop(0.0f, style.radial.startColor);
+            storage[1] = ColorStop(1.0f, style.radial.endColor);
+            break;
+        case Style::Type::ConicGradient:
+            storage[0] = ColorStop(0.0f, style.conic.startColor);
+            storage[1] = ColorStop(1.0f, style.conic.endColor);
+            break;
+        default:
+            storage[0] = ColorStop(0.0f, style.color);
+            return Span<ColorStop>(storage, 1);
+    }
+    return Span<ColorStop>(storage, 2);
+}
+
+static size_t hashStops(Span<ColorStop> stops) {
+    std::hash<float> hash;
+    size_t key = stops.size();
+    for(const ColorStop& stop : stops) {
+        key = key * 31 + hash(stop.offset);
+        key = key * 31 + hash(stop.color.r);
+        key = key * 31 + hash(stop.color.g);
+        key = key * 31 + hash(stop.color.b);
+        key = key * 31 + hash(stop.color.a);
+    }
+    return key;
+}
+
+static bool equalStops(Span<ColorStop> a, Span<ColorStop> b) {
+    if(a.size() != b.size())
+        return false;
+    for(size_t i = 0; i < a.size(); i++) {
+        if(a[i].offset != b[i].offset ||
+           a[i].color.r != b[i].color.r || a[i].color.g != b[i].color.g ||
+           a[i].color.b != b[i].color.b || a[i].color.a != b[i].color.a)
+            return false;
+    }
+    return true;
+}
+
+static Color rampColor(Span<ColorStop> stops, float t) {
+    if(t <= stops.front().offset)
+        return stops.front().color;
+    for(size_t i = 1; i < stops.size(); i++) {
+        if(t <= stops[i].offset) {
+            float length = stops[i].offset - stops[i - 1].offset;
+            float k = length > 0.0f ? (t - stops[i - 1].offset) / length : 1.0f;
+            return Color::lerp(stops[i - 1].color, stops[i].color, k);
+        }
+    }
+    return stops.back().color;
+}
+
+glm::vec4 GradientRamps::find(Diligent::IDeviceContext* deviceContext, const Style& style) {
+    ColorStop twoStops[2] = { ColorStop(0.0f, colors::Black), ColorStop(1.0f, colors::Black) };
+    Span<ColorStop> stops = gradientStops(style, twoStops);
+    size_t key = hashStops(stops);
+    
+    int index = -1;
+    auto it = mRowIndices.find(key);
+    if(it != mRowIndices.end() && equalStops(mRows[it->second].stops, stops)) {
+        index = it->second;
+    } else {
+        if(it != mRowIndices.end() && mRows[it->second].lastUsedFrame != mFrame) {
+            // Hash collision, the old ramp is replaced
+            index = it->second;
+        } else if((int)mRows.size() < height) {
+            index = (int)mRows.size();
+            mRows.push_back(Row());
+        } else {
+            // Rows used in this frame are only evicted
+            // if all of them are, after a flush
+            index = 0;
+            for(int i = 1; i < (int)mRows.size(); i++) {
+                if(mRows[i].lastUsedFrame < mRows[index].lastUsedFrame)
+                    index = i;
+            }
+            if(mRows[index].lastUsedFrame == mFrame)
+                deviceContext->Flush();
+            auto evicted = mRowIndices.find(mRows[index].key);
+            if(evicted != mRowIndices.end() && evicted->second == index)
+                mRowIndices.erase(evicted);
+        }
+        
+        unsigned char pixels[width * 4];
+        for(int x = 0; x < width; x++) {
+            Color color = rampColor(stops, (float)x / (float)(width - 1));
+            pixels[x * 4 + 0] = (unsigned char)(glm::clamp(color.r, 0.0f, 1.0f) * 255.0f + 0.5f);
+            pixels[x * 4 + 1] = (unsigned char)(glm::clamp(color.g, 0.0f, 1.0f) * 255.0f + 0.5f);
+            pixels[x * 4 + 2] = (unsigned char)(glm::clamp(color.b, 0.0f, 1.0f) * 255.0f + 0.5f);
+            pixels[x * 4 + 3] = (unsigned char)(glm::clamp(color.a, 0.0f, 1.0f) * 255.0f + 0.5f);
+        }
+        Diligent::TextureSubResData SubRes;
+        SubRes.pData = pixels;
+        SubRes.Stride = sizeof(pixels);
+        Diligent::Box box(0, width, index, index + 1);
+        deviceContext->UpdateTexture(texture, 0, 0, box, SubRes,
+                                     Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
+                                     Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+        
+        mRows[index].key = key;
+        mRows[index].stops.assign(stops.begin(), stops.end());
+        mRowIndices[key] = index;
+    }
+    mRows[index].lastUsedFrame = mFrame;
+    
+    // Sample the centers of the first and last texels
+    return glm::vec4((float)(width - 1) / (float)width,
+                     0.5f / (float)width,
+                     ((float)index + 0.5f) / (float)height,
+                     0.0f);
+}
+
+void GradientRamps::nextFrame() {
+    mFrame++;
+}
+
+Diligent::RefCntAutoPtr<Diligent::IBuffer>
+createConstantsBuffer(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+                      const char* name, size_t size) {
+    Diligent::BufferDesc CBDesc;
+    CBDesc.Name = name;
+    CBDesc.Size = size;
+    CBDesc.Usage = Diligent::USAGE_DYNAMIC;
+    CBDesc.BindFlags = Diligent::BIND_UNIFORM_BUFFER;
+    CBDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
+    Diligent::RefCntAutoPtr<Diligent::IBuffer> buffer;
+    threadAllocations().bufferCreations++;
+    threadAllocations().bufferBytes += CBDesc.Size;
+    renderDevice->CreateBuffer(CBDesc, nullptr, &buffer);
+    return buffer;
+}
+
+SolidColorPipelineStates::
+SolidColorPipelineStates(DeviceResources& resources,
+                        Diligent::TEXTURE_FORMAT colorBufferFormat,
+                        Diligent::TEXTURE_FORMAT depthBufferFormat,
+                        int numSamples) {
+    VSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg VS constants CB",
+                                        sizeof(shader::VSConstants));
+    PSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg solid color PS constants CB",
+                                        sizeof(shader::solidcol::PSConstants));
+    recreate(resources, colorBufferFormat, depthBufferFormat, numSamples);
+    this->isInitialized = true;
 }
 
 void SolidColorPipelineStates::
-recreate(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+recreate(DeviceResources& resources,
          Diligent::TEXTURE_FORMAT colorBufferFormat,
          Diligent::TEXTURE_FORMAT depthBufferFormat,
-         BlendingMode blendingMode,
          int numSamples)
 {
-    PipelineStateConfiguration conf;
-    conf.name = "Normal PSO";
-    conf.pixelShader = PS;
-    conf.vertexShader = VS;
-    conf.PSConstants = PSConstants;
-    conf.VSConstants = VSConstants;
-    conf.colorBufferFormat = colorBufferFormat;
-    conf.depthBufferFormat = depthBufferFormat;
-    conf.isClippingMask = false;
-    conf.numSamples = numSamples;
-    normalPSO = PipelineState(conf, renderDevice);
-    conf.name = "Clip PSO";
-    conf.isClippingMask = true;
-    clipPSO = PipelineState(conf, renderDevice);
+    PipelineStateKey key;
+    key.type = PipelineStateKey::Type::SolidColor;
+    key.colorBufferFormat = colorBufferFormat;
+    key.depthBufferFormat = depthBufferFormat;
+    key.numSamples = numSamples;
+    key.clipMask = ClipMask::None;
+    normalPSO = PipelineState(resources.pipelineState(key), VSConstants, PSConstants);
+    blendingPSOs.reset(key);
+    key.isOpaque = true;
+    opaquePSO = resources.pipelineState(key);
+    key.isOpaque = false;
+    key.clipMask = ClipMask::Push;
+    clipPSO = PipelineState(resources.pipelineState(key), VSConstants, PSConstants);
+    key.clipMask = ClipMask::Pop;
+    unclipPSO = resources.pipelineState(key);
+    this->numSamples = numSamples;
 }
 
 SolidColorPipelineStates::SolidColorPipelineStates()
 {
 }
 
-GradientPipelineStates::
-GradientPipelineStates(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
-                      Diligent::TEXTURE_FORMAT colorBufferFormat,
-                      Diligent::TEXTURE_FORMAT depthBufferFormat,
-                      int numSamples) {
-    createShaders(renderDevice);
-    recreate(renderDevice, colorBufferFormat, depthBufferFormat,
-             BlendingMode::Normal, numSamples);
-    this->isInitialized = true;
+InstancedPipelineStates::
+InstancedPipelineStates(DeviceResources& resources,
+                        Diligent::TEXTURE_FORMAT colorBufferFormat,
+                        Diligent::TEXTURE_FORMAT depthBufferFormat,
+                        int numSamples) {
+    VSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg instanced VS constants CB",
+                                        sizeof(shader::VSConstants));
+    recreate(resources, colorBufferFormat, depthBufferFormat, numSamples);
 }
 
-void GradientPipelineStates::
-createShaders(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice) {
-    Diligent::ShaderCreateInfo ShaderCI;
-    ShaderCI.SourceLanguage = Diligent::SHADER_SOURCE_LANGUAGE_HLSL;
-    ShaderCI.UseCombinedTextureSamplers = Diligent::True;
-    
-    // Create a vertex shader
-    {
-        ShaderCI.Desc.ShaderType = Diligent::SHADER_TYPE_VERTEX;
-        ShaderCI.EntryPoint = "main";
-        ShaderCI.Desc.Name = "blazevg vertex shader";
-        ShaderCI.Source = shader::VSSource;
-        renderDevice->CreateShader(ShaderCI, &VS);
-
-        Diligent::BufferDesc CBDesc;
-        CBDesc.Name = "blazevg VS constants CB";
-        CBDesc.Size = sizeof(shader::VSConstants);
-        CBDesc.Usage = Diligent::USAGE_DYNAMIC;
-        CBDesc.BindFlags = Diligent::BIND_UNIFORM_BUFFER;
-        CBDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
-        renderDevice->CreateBuffer(CBDesc, nullptr, &VSConstants);
-    }
-
-    // Create a pixel shader
-    {
-        ShaderCI.Desc.ShaderType = Diligent::SHADER_TYPE_PIXEL;
-        ShaderCI.EntryPoint = "main";
-        ShaderCI.Desc.Name = "blazevg linear gradient pixel shader";
-        ShaderCI.Source = shader::grad::PSSource;
-        renderDevice->CreateShader(ShaderCI, &PS);
+void InstancedPipelineStates::
+recreate(DeviceResources& resources,
+         Diligent::TEXTURE_FORMAT colorBufferFormat,
+         Diligent::TEXTURE_FORMAT depthBufferFormat,
+         int numSamples)
+{
+    PipelineStateKey key;
+    key.type = PipelineStateKey::Type::Instanced;
+    key.colorBufferFormat = colorBufferFormat;
+    key.depthBufferFormat = depthBufferFormat;
+    key.numSamples = numSamples;
+    normalPSO = PipelineState(resources.pipelineState(key), VSConstants, nullptr);
+    blendingPSOs.reset(key);
+    key.isOpaque = true;
+    opaquePSO = resources.pipelineState(key);
+    this->numSamples = numSamples;
+}
 
-        Diligent::BufferDesc CBDesc;
-        CBDesc.Name = "blazevg linear gradient PS constants CB";
-        CBDesc.Size = sizeof(shader::grad::PSConstants);
-        CBDesc.Usage = Diligent::USAGE_DYNAMIC;
-        CBDesc.BindFlags = Diligent::BIND_UNIFORM_BUFFER;
-        CBDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
-        renderDevice->CreateBuffer(CBDesc, nullptr, &PSConstants);
-    }
+InstancedPipelineStates::InstancedPipelineStates()
+{
 }
 
-void GradientPipelineStates::
-recreate(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+StrokePipelineStates::
+StrokePipelineStates(DeviceResources& resources,
+                     Diligent::TEXTURE_FORMAT colorBufferFormat,
+                     Diligent::TEXTURE_FORMAT depthBufferFormat,
+                     int numSamples) {
+    VSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg stroke VS constants CB",
+                                        sizeof(shader::stroke::VSConstants));
+    PSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg stroke PS constants CB",
+                                        sizeof(shader::solidcol::PSConstants));
+    dashPSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                            "blazevg dashed stroke PS constants CB",
+                                            sizeof(shader::stroke::DashPSConstants));
+    recreate(resources, colorBufferFormat, depthBufferFormat, numSamples);
+}
+
+void StrokePipelineStates::
+recreate(DeviceResources& resources,
          Diligent::TEXTURE_FORMAT colorBufferFormat,
          Diligent::TEXTURE_FORMAT depthBufferFormat,
-         BlendingMode blendingMode,
          int numSamples)
 {
-    Diligent::GraphicsPipelineStateCreateInfo PSOCreateInfo;
-    PSOCreateInfo.PSODesc.Name = "blazevg linear gradient PSO";
-    PSOCreateInfo.PSODesc.PipelineType = Diligent::PIPELINE_TYPE_GRAPHICS;
-    PSOCreateInfo.GraphicsPipeline.SmplDesc.Count = numSamples;
-    PSOCreateInfo.GraphicsPipeline.NumRenderTargets = 1;
-    PSOCreateInfo.GraphicsPipeline.RTVFormats[0] = colorBufferFormat;
-    PSOCreateInfo.GraphicsPipeline.DSVFormat = depthBufferFormat;
-    PSOCreateInfo.GraphicsPipeline.PrimitiveTopology = Diligent::PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    PSOCreateInfo.GraphicsPipeline.RasterizerDesc.CullMode = Diligent::CULL_MODE_NONE;
-//    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.StencilEnable = Diligent::True;
-//    Diligent::StencilOpDesc StencilDesc;
-//    StencilDesc.StencilFunc = Diligent::COMPARISON_FUNC_NOT_EQUAL;
-//    StencilDesc.StencilPassOp = Diligent::STENCIL_OP_REPLACE;
-//    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.FrontFace = StencilDesc;
-//    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.BackFace = StencilDesc;
-    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthEnable = Diligent::True;
-    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthFunc = Diligent::COMPARISON_FUNC_LESS;
+    PipelineStateKey key;
+    key.type = PipelineStateKey::Type::Stroke;
+    key.colorBufferFormat = colorBufferFormat;
+    key.depthBufferFormat = depthBufferFormat;
+    key.numSamples = numSamples;
+    normalPSO = PipelineState(resources.pipelineState(key), VSConstants, PSConstants);
+    blendingPSOs.reset(key);
+    key.isOpaque = true;
+    opaquePSO = resources.pipelineState(key);
+    // Dash ends are anti-aliased, so dashed strokes are never opaque
+    key.type = PipelineStateKey::Type::DashedStroke;
+    key.isOpaque = false;
+    dashedPSO = PipelineState(resources.pipelineState(key), VSConstants, dashPSConstants);
+    dashedBlendingPSOs.reset(key);
+    this->numSamples = numSamples;
+}
 
-    Diligent::BlendStateDesc BlendState;
-    BlendState.RenderTargets[0].BlendEnable = Diligent::True;
-    BlendState.RenderTargets[0].SrcBlend = Diligent::BLEND_FACTOR_SRC_ALPHA;
-    BlendState.RenderTargets[0].DestBlend = Diligent::BLEND_FACTOR_INV_SRC_ALPHA;
-    PSOCreateInfo.GraphicsPipeline.BlendDesc = BlendState;
+StrokePipelineStates::StrokePipelineStates()
+{
+}
 
-    PSOCreateInfo.pVS = VS;
-    PSOCreateInfo.pPS = PS;
+CurvePipelineStates::
+CurvePipelineStates(DeviceResources& resources,
+                    Diligent::TEXTURE_FORMAT colorBufferFormat,
+                    Diligent::TEXTURE_FORMAT depthBufferFormat,
+                    int numSamples) {
+    VSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg curve VS constants CB",
+                                        sizeof(shader::VSConstants));
+    PSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg curve PS constants CB",
+                                        sizeof(shader::solidcol::PSConstants));
+    recreate(resources, colorBufferFormat, depthBufferFormat, numSamples);
+}
 
-    Diligent::LayoutElement LayoutElems[] =
-    {
-        // Attribute 0 - vertex position 2D
-        Diligent::LayoutElement{0, 0, 2, Diligent::VT_FLOAT32, Diligent::False}
-    };
-    PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = LayoutElems;
-    PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(LayoutElems);
-    
-    PSOCreateInfo.PSODesc.ResourceLayout.DefaultVariableType = Diligent::SHADER_RESOURCE_VARIABLE_TYPE_STATIC;
+void CurvePipelineStates::
+recreate(DeviceResources& resources,
+         Diligent::TEXTURE_FORMAT colorBufferFormat,
+         Diligent::TEXTURE_FORMAT depthBufferFormat,
+         int numSamples)
+{
+    PipelineStateKey key;
+    key.type = PipelineStateKey::Type::Curve;
+    key.colorBufferFormat = colorBufferFormat;
+    key.depthBufferFormat = depthBufferFormat;
+    key.numSamples = numSamples;
+    normalPSO = PipelineState(resources.pipelineState(key), VSConstants, PSConstants);
+    blendingPSOs.reset(key);
+    this->numSamples = numSamples;
+}
 
-    PSO.Release();
-    SRB.Release();
-    
-    renderDevice->CreateGraphicsPipelineState(PSOCreateInfo, &PSO);
+CurvePipelineStates::CurvePipelineStates()
+{
+}
 
-    PSO->GetStaticVariableByName(Diligent::SHADER_TYPE_VERTEX, "Constants")->Set(VSConstants);
-    PSO->GetStaticVariableByName(Diligent::SHADER_TYPE_PIXEL, "Constants")->Set(PSConstants);
+AnalyticPipelineStates::
+AnalyticPipelineStates(DeviceResources& resources,
+                       Diligent::TEXTURE_FORMAT colorBufferFormat,
+                       Diligent::TEXTURE_FORMAT depthBufferFormat,
+                       int numSamples) {
+    VSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg analytic VS constants CB",
+                                        sizeof(shader::analytic::VSConstants));
+    PSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg analytic PS constants CB",
+                                        sizeof(shader::analytic::PSConstants));
+    recreate(resources, colorBufferFormat, depthBufferFormat, numSamples);
+}
 
-    PSO->CreateShaderResourceBinding(&SRB, true);
+void AnalyticPipelineStates::
+recreate(DeviceResources& resources,
+         Diligent::TEXTURE_FORMAT colorBufferFormat,
+         Diligent::TEXTURE_FORMAT depthBufferFormat,
+         int numSamples)
+{
+    PipelineStateKey key;
+    key.type = PipelineStateKey::Type::Analytic;
+    key.colorBufferFormat = colorBufferFormat;
+    key.depthBufferFormat = depthBufferFormat;
+    key.numSamples = numSamples;
+    normalPSO = PipelineState(resources.pipelineState(key), VSConstants, PSConstants);
+    blendingPSOs.reset(key);
+    this->numSamples = numSamples;
+}
+
+AnalyticPipelineStates::AnalyticPipelineStates()
+{
+}
+
+GradientPipelineStates::
+GradientPipelineStates(DeviceResources& resources,
+                      Diligent::ITextureView* rampSRV,
+                      Diligent::TEXTURE_FORMAT colorBufferFormat,
+                      Diligent::TEXTURE_FORMAT depthBufferFormat,
+                      int numSamples):
+    rampSRV(rampSRV)
+{
+    VSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg VS constants CB",
+                                        sizeof(shader::VSConstants));
+    PSConstants = createConstantsBuffer(resources.getRenderDevice(),
+                                        "blazevg gradient PS constants CB",
+                                        sizeof(shader::grad::PSConstants));
+    recreate(resources, colorBufferFormat, depthBufferFormat, numSamples);
+    this->isInitialized = true;
+}
+
+void GradientPipelineStates::
+recreate(DeviceResources& resources,
+         Diligent::TEXTURE_FORMAT colorBufferFormat,
+         Diligent::TEXTURE_FORMAT depthBufferFormat,
+         int numSamples)
+{
+    PipelineStateKey::Type types[] = {
+        PipelineStateKey::Type::LinearGradient,
+        PipelineStateKey::Type::RadialGradient,
+        PipelineStateKey::Type::ConicGradient
+    };
+    for(int i = 0; i < 3; i++) {
+        PipelineStateKey key;
+        key.type = types[i];
+        key.colorBufferFormat = colorBufferFormat;
+        key.depthBufferFormat = depthBufferFormat;
+        key.numSamples = numSamples;
+        normalPSOs[i] = PipelineState(resources.pipelineState(key), VSConstants, PSConstants);
+        normalPSOs[i].SRB->GetVariableByName(Diligent::SHADER_TYPE_PIXEL, "g_RampTexture")->
+            Set(rampSRV);
+        blendingPSOs[i].reset(key);
+        key.isOpaque = true;
+        opaquePSOs[i] = resources.pipelineState(key);
+    }
+    this->numSamples = numSamples;
 }
 
 GradientPipelineStates::GradientPipelineStates()
 {
 }
 
+StrokeTemplatePart strokeTemplatePart(factory::StrokePart::Type type) {
+    switch(type) {
+        case factory::StrokePart::Type::Join:
+            return StrokeTemplatePart::Join;
+        case factory::StrokePart::Type::Round:
+            return StrokeTemplatePart::Disc;
+        default:
+            return StrokeTemplatePart::Quad;
+    }
+}
+
+// Parts of a stroke in one mesh, at the index ranges of strokeTemplateFirstIndices.
+// The quad is used by segments and square caps, and x of a join vertex is its index
+factory::ShapeMesh strokeTemplate() {
+    factory::ShapeMesh mesh;
+    mesh.vertices = {
+        glm::vec2(0.0f, -1.0f), glm::vec2(1.0f, -1.0f),
+        glm::vec2(1.0f,  1.0f), glm::vec2(0.0f,  1.0f),
+        glm::vec2(0.0f, 0.0f), glm::vec2(1.0f, 0.0f),
+        glm::vec2(2.0f, 0.0f), glm::vec2(3.0f, 0.0f)
+    };
+    mesh.indices = {
+        { 0, 1, 2 }, { 0, 2, 3 },
+        { 4, 5, 6 }, { 4, 6, 7 }
+    };
+    
+    int center = (int)mesh.vertices.size();
+    mesh.vertices.push_back(glm::vec2(0.0f));
+    for(int i = 0; i < strokeDiscSegments; i++) {
+        float angle = (float)i / strokeDiscSegments * 2.0f * M_PI;
+        mesh.vertices.push_back(glm::vec2(cosf(angle), sinf(angle)));
+        int next = (i + 1) % strokeDiscSegments;
+        mesh.indices.push_back({ center, center + 1 + i, center + 1 + next });
+    }
+    return mesh;
+}
+
+struct ShapeVertex {
+    glm::vec2 position;
+    float coverage;
+};
+
 Shape::Shape(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
              factory::ShapeMesh& mesh) {
-    size_t verticesSize = mesh.vertices.size() * sizeof(glm::vec2);
-    size_t indicesSize = mesh.indices.size() * sizeof(factory::TriangeIndices);
+    std::vector<ShapeVertex> vertices(mesh.vertices.size());
+    for(size_t i = 0; i < vertices.size(); i++) {
+        vertices[i].position = mesh.vertices[i];
+        vertices[i].coverage = mesh.coverage.empty() ? 1.0f : mesh.coverage[i];
+    }
+    this->isFeathered = !mesh.coverage.empty();
+    createBuffers(renderDevice, vertices.data(), vertices.size() * sizeof(ShapeVertex),
+                  mesh.indices);
+}
+
+struct CurveVertex {
+    glm::vec2 position;
+    glm::vec3 curveCoords;
+};
+
+Shape::Shape(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+             factory::CurveMesh& mesh) {
+    std::vector<CurveVertex> vertices(mesh.vertices.size());
+    for(size_t i = 0; i < vertices.size(); i++) {
+        vertices[i].position = mesh.vertices[i];
+        vertices[i].curveCoords = mesh.curveCoords[i];
+    }
+    createBuffers(renderDevice, vertices.data(), vertices.size() * sizeof(CurveVertex),
+                  mesh.indices);
+}
+
+void Shape::createBuffers(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+                          const void* vertices, size_t verticesSize,
+                          Span<factory::TriangeIndices> indices) {
+    size_t indicesSize = indices.size() * sizeof(factory::TriangeIndices);
     
     Diligent::BufferDesc VertBuffDesc;
     VertBuffDesc.Name = "blazevg vertex buffer";
@@ -383,8 +1415,10 @@ Shape::Shape(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
     VertBuffDesc.BindFlags = Diligent::BIND_VERTEX_BUFFER;
     VertBuffDesc.Size = verticesSize;
     Diligent::BufferData VBData;
-    VBData.pData = mesh.vertices.data();
+    VBData.pData = vertices;
     VBData.DataSize = verticesSize;
+    threadAllocations().bufferCreations++;
+    threadAllocations().bufferBytes += VertBuffDesc.Size;
     renderDevice->CreateBuffer(VertBuffDesc, &VBData, &this->vertexBuffer);
 
     Diligent::BufferDesc IndBuffDesc;
@@ -393,13 +1427,44 @@ Shape::Shape(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
     IndBuffDesc.BindFlags = Diligent::BIND_INDEX_BUFFER;
     IndBuffDesc.Size = indicesSize;
     Diligent::BufferData IBData;
-    IBData.pData = mesh.indices.data();
+    IBData.pData = indices.data();
     IBData.DataSize = indicesSize;
+    threadAllocations().bufferCreations++;
+    threadAllocations().bufferBytes += IndBuffDesc.Size;
     renderDevice->CreateBuffer(IndBuffDesc, &IBData, &this->indexBuffer);
-    this->numIndices = (int)mesh.indices.size() * 3;
+    this->numIndices = (int)indices.size() * 3;
+}
+
+Shape::Shape()
+{
 }
 
 void Shape::draw(DiligentContext& context, Style& style) {
+    BVG_TRACE_ZONE("Shape::draw");
+    glm::mat4 MVP = context.getMatrix3D();
+    float depth = context.paintDepth();
+    context.mShapeDrawCounter++;
+    
+    DrawCommand command;
+    command.shape = *this;
+    context.setCommandStyle(command, style);
+    command.MVP = MVP;
+    command.depth = depth;
+    command.blendingMode = context.blendingMode;
+    command.isOpaque = context.blendingMode == BlendingMode::Normal && style.isOpaque() &&
+                       !this->isFeathered;
+    
+    // Clip shapes are drawn at endClip(), once it's known
+    // whether the clip is a scissor rectangle
+    if(context.mIsClipping) {
+        context.mClipStack.back().shapes.push_back(command);
+        return;
+    }
+    context.mDrawQueue.push_back(command);
+}
+
+void Shape::submit(DiligentContext& context, Style& style, glm::mat4& MVP, float depth,
+                   BlendingMode blendingMode, ClipMask clipMask) {
     Diligent::RefCntAutoPtr<Diligent::IDeviceContext> deviceCtx = context.mDeviceContext;
     
     Diligent::Uint64   offset = 0;
@@ -410,14 +1475,9 @@ void Shape::draw(DiligentContext& context, Style& style) {
     deviceCtx->SetIndexBuffer(this->indexBuffer, 0,
         Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
     
-    // Draw the shape in front of other one because depth buffer is enabled.
-    // When rendering, depth buffer compares current depth pixel values
-    // with those written to it. If they are the same, then it will discard
-    // them, so we need to constantly increment the Z coordinate
+    bool isOpaque = blendingMode == BlendingMode::Normal && style.isOpaque();
     
-    glm::mat4 MVP = context.getMatrix3D();
-    
-    if(context.mIsClipping) {
+    if(clipMask != ClipMask::None) {
         {
             Diligent::MapHelper<shader::VSConstants> CBConstants(deviceCtx,
                                                                  context.mSolidColorPSO
@@ -426,7 +1486,9 @@ void Shape::draw(DiligentContext& context, Style& style) {
                                                                  Diligent::MAP_FLAG_DISCARD);
             shader::VSConstants c;
             c.MVP = glm::transpose(MVP);
+            c.depth = depth;
             *CBConstants = c;
+            context.countConstantsUpload(sizeof(c));
         }
         {
             Diligent::MapHelper<shader::solidcol::PSConstants> CBConstants(deviceCtx,
@@ -438,8 +1500,12 @@ void Shape::draw(DiligentContext& context, Style& style) {
             Color transparent = Color(0.0f, 0.0f, 0.0f, 0.0f);
             c.color = transparent;
             *CBConstants = c;
+            context.countConstantsUpload(sizeof(c));
         }
-        deviceCtx->SetPipelineState(context.mSolidColorPSO.clipPSO.PSO);
+        if(clipMask == ClipMask::Push)
+            context.setPipelineState(context.mSolidColorPSO.clipPSO.PSO);
+        else
+            context.setPipelineState(context.mSolidColorPSO.unclipPSO);
         deviceCtx->CommitShaderResources(context.mSolidColorPSO.clipPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
     } else {
         switch(style.type) {
@@ -453,7 +1519,9 @@ void Shape::draw(DiligentContext& context, Style& style) {
                                                                      Diligent::MAP_FLAG_DISCARD);
                 shader::VSConstants c;
                 c.MVP = glm::transpose(MVP);
+                c.depth = depth;
                 *CBConstants = c;
+                context.countConstantsUpload(sizeof(c));
             }
             {
                 Diligent::MapHelper<shader::solidcol::PSConstants> CBConstants(deviceCtx,
@@ -464,8 +1532,13 @@ void Shape::draw(DiligentContext& context, Style& style) {
                 shader::solidcol::PSConstants c;
                 c.color = style.color;
                 *CBConstants = c;
+                context.countConstantsUpload(sizeof(c));
             }
-            deviceCtx->SetPipelineState(context.mSolidColorPSO.normalPSO.PSO);
+            if(isOpaque)
+                context.setPipelineState(context.mSolidColorPSO.opaquePSO);
+            else
+                context.setPipelineState(context.mSolidColorPSO.blendingPSOs.get(*context.mResources,
+                                                                                    blendingMode));
             deviceCtx->CommitShaderResources(context.mSolidColorPSO.normalPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
         }
             break;
@@ -473,6 +1546,7 @@ void Shape::draw(DiligentContext& context, Style& style) {
         case Style::Type::RadialGradient:
         case Style::Type::ConicGradient:
         {
+            int gradientType = 0;
             {
                 Diligent::MapHelper<shader::VSConstants> CBConstants(deviceCtx,
                                                                      context.mGradientPSO
@@ -481,7 +1555,9 @@ void Shape::draw(DiligentContext& context, Style& style) {
                                                                      Diligent::MAP_FLAG_DISCARD);
                 shader::VSConstants c;
                 c.MVP = glm::transpose(MVP);
+                c.depth = depth;
                 *CBConstants = c;
+                context.countConstantsUpload(sizeof(c));
             }
             {
                 Diligent::MapHelper<shader::grad::PSConstants> CBConstants(deviceCtx,
@@ -489,29 +1565,328 @@ void Shape::draw(DiligentContext& context, Style& style) {
                                                                                .PSConstants,
                                                                      Diligent::MAP_WRITE,
                                                                      Diligent::MAP_FLAG_DISCARD);
-                shader::grad::PSConstants c;
-                c.gradient = shader::GradientConstants(style, MVP, context);
-                *CBConstants = c;
-            }
-            deviceCtx->SetPipelineState(context.mGradientPSO.PSO);
-            deviceCtx->CommitShaderResources(context.mGradientPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
-        }
-            break;
-        default:
-            return;
-        }
+                shader::grad::PSConstants c;
+                c.gradient = shader::GradientConstants(style, MVP, context);
+                c.gradient.ramp = context.mGradientRamps.find(deviceCtx, style);
+                *CBConstants = c;
+                context.countConstantsUpload(sizeof(c));
+                gradientType = (int)c.gradient.type;
+            }
+            if(isOpaque)
+                context.setPipelineState(context.mGradientPSO.opaquePSOs[gradientType]);
+            else
+                context.setPipelineState(context.mGradientPSO.blendingPSOs[gradientType]
+                                            .get(*context.mResources, blendingMode));
+            deviceCtx->CommitShaderResources(context.mGradientPSO.normalPSOs[gradientType].SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+        }
+            break;
+        default:
+            return;
+        }
+    }
+
+    Diligent::DrawIndexedAttribs DrawAttrs;
+    DrawAttrs.IndexType = Diligent::VT_UINT32;
+    DrawAttrs.NumIndices = this->numIndices;
+    DrawAttrs.Flags = Diligent::DRAW_FLAG_VERIFY_ALL;
+
+    deviceCtx->SetStencilRef(context.mClipLevel);
+    
+    context.mFrameStats.drawCalls++;
+    deviceCtx->DrawIndexed(DrawAttrs);
+}
+
+void Shape::drawInstanced(DiligentContext& context,
+                          Diligent::Uint64 instanceOffset,
+                          Diligent::Uint32 numInstances,
+                          bool isOpaque) {
+    DrawCommand command;
+    command.shape = *this;
+    command.MVP = context.getMatrix3D();
+    command.depth = context.paintDepth();
+    command.blendingMode = context.blendingMode;
+    command.isOpaque = context.blendingMode == BlendingMode::Normal && isOpaque &&
+                       !this->isFeathered;
+    command.instanceOffset = instanceOffset;
+    command.numInstances = numInstances;
+    context.mShapeDrawCounter++;
+    context.mDrawQueue.push_back(command);
+}
+
+void Shape::drawAnalytic(DiligentContext& context, glm::vec4 bounds,
+                         shader::analytic::PSConstants& constants) {
+    DrawCommand command;
+    command.shape = *this;
+    command.MVP = context.getMatrix3D();
+    command.depth = context.paintDepth();
+    command.blendingMode = context.blendingMode;
+    // Edges are anti-aliased, so the shape is never opaque
+    command.isOpaque = false;
+    command.isAnalytic = true;
+    command.analyticBounds = bounds;
+    command.analytic = constants;
+    context.mShapeDrawCounter++;
+    context.mDrawQueue.push_back(command);
+}
+
+void Shape::submitAnalytic(DiligentContext& context, glm::mat4& MVP, float depth,
+                           BlendingMode blendingMode, glm::vec4 bounds,
+                           shader::analytic::PSConstants& constants) {
+    Diligent::RefCntAutoPtr<Diligent::IDeviceContext> deviceCtx = context.mDeviceContext;
+    
+    Diligent::Uint64   offset = 0;
+    Diligent::IBuffer* pBuffs[] = { this->vertexBuffer };
+    deviceCtx->SetVertexBuffers(0, 1, pBuffs, &offset,
+        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
+        Diligent::SET_VERTEX_BUFFERS_FLAG_RESET);
+    deviceCtx->SetIndexBuffer(this->indexBuffer, 0,
+        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    
+    {
+        Diligent::MapHelper<shader::analytic::VSConstants> CBConstants(deviceCtx,
+                                                                       context.mAnalyticPSO
+                                                                              .VSConstants,
+                                                                       Diligent::MAP_WRITE,
+                                                                       Diligent::MAP_FLAG_DISCARD);
+        shader::analytic::VSConstants c;
+        c.MVP = glm::transpose(MVP);
+        c.depth = depth;
+        c.bounds = bounds;
+        *CBConstants = c;
+        context.countConstantsUpload(sizeof(c));
+    }
+    {
+        Diligent::MapHelper<shader::analytic::PSConstants> CBConstants(deviceCtx,
+                                                                       context.mAnalyticPSO
+                                                                              .PSConstants,
+                                                                       Diligent::MAP_WRITE,
+                                                                       Diligent::MAP_FLAG_DISCARD);
+        *CBConstants = constants;
+        context.countConstantsUpload(sizeof(constants));
+    }
+    context.setPipelineState(context.mAnalyticPSO.blendingPSOs.get(*context.mResources,
+                                                                      blendingMode));
+    deviceCtx->CommitShaderResources(context.mAnalyticPSO.normalPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    
+    Diligent::DrawIndexedAttribs DrawAttrs;
+    DrawAttrs.IndexType = Diligent::VT_UINT32;
+    DrawAttrs.NumIndices = this->numIndices;
+    DrawAttrs.Flags = Diligent::DRAW_FLAG_VERIFY_ALL;
+    
+    deviceCtx->SetStencilRef(context.mClipLevel);
+    
+    context.mFrameStats.drawCalls++;
+    deviceCtx->DrawIndexed(DrawAttrs);
+}
+
+void Shape::drawStroke(DiligentContext& context, Style& style,
+                       Diligent::Uint64 partOffset,
+                       const Diligent::Uint32* partCounts,
+                       shader::stroke::DashPSConstants& dash) {
+    DrawCommand command;
+    command.shape = *this;
+    context.setCommandStyle(command, style);
+    command.MVP = context.getMatrix3D();
+    command.depth = context.paintDepth();
+    command.blendingMode = context.blendingMode;
+    command.isOpaque = context.blendingMode == BlendingMode::Normal && style.isOpaque();
+    command.instanceOffset = partOffset;
+    for(int i = 0; i < numStrokeTemplateParts; i++) {
+        command.strokeParts[i] = partCounts[i];
+        command.numInstances += partCounts[i];
+    }
+    command.isStroke = true;
+    command.lineWidth = context.lineWidth;
+    command.lineJoin = context.lineJoin;
+    command.isDashed = dash.count > 0.0f;
+    command.dash = dash;
+    command.isOpaque = command.isOpaque && !command.isDashed;
+    context.mShapeDrawCounter++;
+    context.mDrawQueue.push_back(command);
+}
+
+void Shape::submitStroke(DiligentContext& context, DrawCommand& command) {
+    Diligent::RefCntAutoPtr<Diligent::IDeviceContext> deviceCtx = context.mDeviceContext;
+    render::StrokePipelineStates& strokePSO = context.mStrokePSO;
+    
+    deviceCtx->SetIndexBuffer(this->indexBuffer, 0,
+        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    
+    {
+        Diligent::MapHelper<shader::stroke::VSConstants> CBConstants(deviceCtx,
+                                                                     strokePSO.VSConstants,
+                                                                     Diligent::MAP_WRITE,
+                                                                     Diligent::MAP_FLAG_DISCARD);
+        shader::stroke::VSConstants c;
+        c.MVP = glm::transpose(command.MVP);
+        c.depth = command.depth;
+        c.radius = command.lineWidth / 2.0f;
+        c.isMiterJoin = command.lineJoin == LineJoin::Miter ? 1.0f : 0.0f;
+        *CBConstants = c;
+        context.countConstantsUpload(sizeof(c));
+    }
+    if(command.isDashed) {
+        Diligent::MapHelper<shader::stroke::DashPSConstants> CBConstants(deviceCtx,
+                                                                         strokePSO.dashPSConstants,
+                                                                         Diligent::MAP_WRITE,
+                                                                         Diligent::MAP_FLAG_DISCARD);
+        shader::stroke::DashPSConstants c = command.dash;
+        c.color = command.color;
+        *CBConstants = c;
+        context.countConstantsUpload(sizeof(c));
+    } else {
+        Diligent::MapHelper<shader::solidcol::PSConstants> CBConstants(deviceCtx,
+                                                                       strokePSO.PSConstants,
+                                                                       Diligent::MAP_WRITE,
+                                                                       Diligent::MAP_FLAG_DISCARD);
+        shader::solidcol::PSConstants c;
+        c.color = command.color;
+        *CBConstants = c;
+        context.countConstantsUpload(sizeof(c));
+    }
+    if(command.isDashed) {
+        context.setPipelineState(strokePSO.dashedBlendingPSOs.get(*context.mResources,
+                                                                     command.blendingMode));
+        deviceCtx->CommitShaderResources(strokePSO.dashedPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    } else {
+        if(command.isOpaque)
+            context.setPipelineState(strokePSO.opaquePSO);
+        else
+            context.setPipelineState(strokePSO.blendingPSOs.get(*context.mResources,
+                                                                   command.blendingMode));
+        deviceCtx->CommitShaderResources(strokePSO.normalPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    }
+    
+    deviceCtx->SetStencilRef(context.mClipLevel);
+    
+    // One draw of every template part, only for its own instances
+    Diligent::Uint64 instanceOffset = command.instanceOffset;
+    for(int part = 0; part < numStrokeTemplateParts; part++) {
+        Diligent::Uint32 numInstances = command.strokeParts[part];
+        if(numInstances == 0)
+            continue;
+        Diligent::Uint64 offsets[] = { 0, instanceOffset };
+        Diligent::IBuffer* pBuffs[] = { this->vertexBuffer, context.mInstanceBuffer };
+        deviceCtx->SetVertexBuffers(0, 2, pBuffs, offsets,
+            Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
+            Diligent::SET_VERTEX_BUFFERS_FLAG_RESET);
+        
+        Diligent::DrawIndexedAttribs DrawAttrs;
+        DrawAttrs.IndexType = Diligent::VT_UINT32;
+        DrawAttrs.FirstIndexLocation = strokeTemplateFirstIndices[part];
+        DrawAttrs.NumIndices = strokeTemplateNumIndices[part];
+        DrawAttrs.NumInstances = numInstances;
+        DrawAttrs.Flags = Diligent::DRAW_FLAG_VERIFY_ALL;
+        
+        context.mFrameStats.drawCalls++;
+        deviceCtx->DrawIndexed(DrawAttrs);
+        instanceOffset += numInstances * sizeof(shader::stroke::InstanceData);
     }
+}
 
+void Shape::drawCurve(DiligentContext& context, Style& style) {
+    DrawCommand command;
+    command.shape = *this;
+    context.setCommandStyle(command, style);
+    command.MVP = context.getMatrix3D();
+    command.depth = context.paintDepth();
+    command.blendingMode = context.blendingMode;
+    // Curve edges are anti-aliased, so the fill is never opaque
+    command.isOpaque = false;
+    command.isCurve = true;
+    context.mShapeDrawCounter++;
+    context.mDrawQueue.push_back(command);
+}
+
+void Shape::submitCurve(DiligentContext& context, DrawCommand& command) {
+    Diligent::RefCntAutoPtr<Diligent::IDeviceContext> deviceCtx = context.mDeviceContext;
+    render::CurvePipelineStates& curvePSO = context.mCurvePSO;
+    
+    Diligent::Uint64   offset = 0;
+    Diligent::IBuffer* pBuffs[] = { this->vertexBuffer };
+    deviceCtx->SetVertexBuffers(0, 1, pBuffs, &offset,
+        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
+        Diligent::SET_VERTEX_BUFFERS_FLAG_RESET);
+    deviceCtx->SetIndexBuffer(this->indexBuffer, 0,
+        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    
+    {
+        Diligent::MapHelper<shader::VSConstants> CBConstants(deviceCtx,
+                                                             curvePSO.VSConstants,
+                                                             Diligent::MAP_WRITE,
+                                                             Diligent::MAP_FLAG_DISCARD);
+        shader::VSConstants c;
+        c.MVP = glm::transpose(command.MVP);
+        c.depth = command.depth;
+        *CBConstants = c;
+        context.countConstantsUpload(sizeof(c));
+    }
+    {
+        Diligent::MapHelper<shader::solidcol::PSConstants> CBConstants(deviceCtx,
+                                                                       curvePSO.PSConstants,
+                                                                       Diligent::MAP_WRITE,
+                                                                       Diligent::MAP_FLAG_DISCARD);
+        shader::solidcol::PSConstants c;
+        c.color = command.color;
+        *CBConstants = c;
+        context.countConstantsUpload(sizeof(c));
+    }
+    context.setPipelineState(curvePSO.blendingPSOs.get(*context.mResources,
+                                                          command.blendingMode));
+    deviceCtx->CommitShaderResources(curvePSO.normalPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    
     Diligent::DrawIndexedAttribs DrawAttrs;
     DrawAttrs.IndexType = Diligent::VT_UINT32;
     DrawAttrs.NumIndices = this->numIndices;
     DrawAttrs.Flags = Diligent::DRAW_FLAG_VERIFY_ALL;
-
-    deviceCtx->SetStencilRef(1);
     
+    deviceCtx->SetStencilRef(context.mClipLevel);
+    
+    context.mFrameStats.drawCalls++;
     deviceCtx->DrawIndexed(DrawAttrs);
+}
+
+void Shape::submitInstanced(DiligentContext& context, glm::mat4& MVP, float depth,
+                            BlendingMode blendingMode, bool isOpaque,
+                            Diligent::Uint64 instanceOffset, Diligent::Uint32 numInstances) {
+    Diligent::RefCntAutoPtr<Diligent::IDeviceContext> deviceCtx = context.mDeviceContext;
     
-    context.mShapeDrawCounter++;
+    Diligent::Uint64 offsets[] = { 0, instanceOffset };
+    Diligent::IBuffer* pBuffs[] = { this->vertexBuffer, context.mInstanceBuffer };
+    deviceCtx->SetVertexBuffers(0, 2, pBuffs, offsets,
+        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
+        Diligent::SET_VERTEX_BUFFERS_FLAG_RESET);
+    deviceCtx->SetIndexBuffer(this->indexBuffer, 0,
+        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    
+    {
+        Diligent::MapHelper<shader::VSConstants> CBConstants(deviceCtx,
+                                                             context.mInstancedPSO.VSConstants,
+                                                             Diligent::MAP_WRITE,
+                                                             Diligent::MAP_FLAG_DISCARD);
+        shader::VSConstants c;
+        c.MVP = glm::transpose(MVP);
+        c.depth = depth;
+        *CBConstants = c;
+        context.countConstantsUpload(sizeof(c));
+    }
+    if(isOpaque)
+        context.setPipelineState(context.mInstancedPSO.opaquePSO);
+    else
+        context.setPipelineState(context.mInstancedPSO.blendingPSOs.get(*context.mResources,
+                                                                           blendingMode));
+    deviceCtx->CommitShaderResources(context.mInstancedPSO.normalPSO.SRB, Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    
+    Diligent::DrawIndexedAttribs DrawAttrs;
+    DrawAttrs.IndexType = Diligent::VT_UINT32;
+    DrawAttrs.NumIndices = this->numIndices;
+    DrawAttrs.NumInstances = numInstances;
+    DrawAttrs.Flags = Diligent::DRAW_FLAG_VERIFY_ALL;
+    
+    deviceCtx->SetStencilRef(context.mClipLevel);
+    
+    context.mFrameStats.drawCalls++;
+    deviceCtx->DrawIndexed(DrawAttrs);
 }
 
 struct CharVertex {
@@ -547,6 +1922,8 @@ CharacterQuad::CharacterQuad(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> re
     Diligent::BufferData VBData;
     VBData.pData = vertices;
     VBData.DataSize = sizeof(vertices);
+    threadAllocations().bufferCreations++;
+    threadAllocations().bufferBytes += VertBuffDesc.Size;
     renderDevice->CreateBuffer(VertBuffDesc, &VBData, &this->vertexBuffer);
 }
 
@@ -555,43 +1932,12 @@ CharacterQuad::CharacterQuad()
 }
 
 GlyphMSDFShaders::GlyphMSDFShaders(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice) {
-    Diligent::ShaderCreateInfo ShaderCI;
-    ShaderCI.SourceLanguage = Diligent::SHADER_SOURCE_LANGUAGE_HLSL;
-    ShaderCI.UseCombinedTextureSamplers = Diligent::True;
-    
-    // Create a vertex shader
-    {
-        ShaderCI.Desc.ShaderType = Diligent::SHADER_TYPE_VERTEX;
-        ShaderCI.EntryPoint = "main";
-        ShaderCI.Desc.Name = "blazevg glyph msdf vertex shader";
-        ShaderCI.Source = shader::msdf::GlyphVSSource;
-        renderDevice->CreateShader(ShaderCI, &VS);
-
-        Diligent::BufferDesc CBDesc;
-        CBDesc.Name = "blazevg VS constants CB";
-        CBDesc.Size = sizeof(shader::VSConstants);
-        CBDesc.Usage = Diligent::USAGE_DYNAMIC;
-        CBDesc.BindFlags = Diligent::BIND_UNIFORM_BUFFER;
-        CBDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
-        renderDevice->CreateBuffer(CBDesc, nullptr, &VSConstants);
-    }
-
-    // Create a pixel shader
-    {
-        ShaderCI.Desc.ShaderType = Diligent::SHADER_TYPE_PIXEL;
-        ShaderCI.EntryPoint = "main";
-        ShaderCI.Desc.Name = "blazevg glyph msdf pixel shader";
-        ShaderCI.Source = shader::msdf::PSSource;
-        renderDevice->CreateShader(ShaderCI, &PS);
-
-        Diligent::BufferDesc CBDesc;
-        CBDesc.Name = "blazevg glyph msdf PS constants CB";
-        CBDesc.Size = sizeof(shader::msdf::PSConstants);
-        CBDesc.Usage = Diligent::USAGE_DYNAMIC;
-        CBDesc.BindFlags = Diligent::BIND_UNIFORM_BUFFER;
-        CBDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
-        renderDevice->CreateBuffer(CBDesc, nullptr, &PSConstants);
-    }
+    VSConstants = createConstantsBuffer(renderDevice,
+                                        "blazevg VS constants CB",
+                                        sizeof(shader::VSConstants));
+    PSConstants = createConstantsBuffer(renderDevice,
+                                        "blazevg glyph msdf PS constants CB",
+                                        sizeof(shader::msdf::PSConstants));
     
     Diligent::BufferDesc IndBuffDesc;
     IndBuffDesc.Name = "blazevg glyph quad index buffer";
@@ -601,6 +1947,8 @@ GlyphMSDFShaders::GlyphMSDFShaders(Diligent::RefCntAutoPtr<Diligent::IRenderDevi
     Diligent::BufferData IBData;
     IBData.pData = GlyphQuadIndices;
     IBData.DataSize = sizeof(GlyphQuadIndices);
+    threadAllocations().bufferCreations++;
+    threadAllocations().bufferBytes += IndBuffDesc.Size;
     renderDevice->CreateBuffer(IndBuffDesc, &IBData, &quadIndexBuffer);
 }
 
@@ -610,19 +1958,26 @@ GlyphMSDFShaders::GlyphMSDFShaders()
 
 } // namespace render
 
-glm::mat4 DiligentContext::bringToFrontMatrix(glm::mat4 MVP) {
-    return glm::translate(
-        glm::vec3(0.0f, 0.0f, 1.0f -
-                  ((float)mShapeDrawCounter + 1.0f) * 0.000001f)
-        ) * MVP;
+glm::mat4 DiligentContext::getMatrix3D() {
+    return this->viewProj * math::toMatrix3D(this->matrix);
 }
 
-glm::mat4 DiligentContext::getMatrix3D() {
-    return bringToFrontMatrix(this->viewProj * math::toMatrix3D(this->matrix));
+// Every draw is one step of a 24-bit depth buffer closer than the
+// previous one. The steps are exact in both D24 and D32 formats, and
+// draws past the last step share its depth, still in paint order
+float DiligentContext::paintDepth() {
+    static const int numSteps = 1 << 24;
+    int order = std::min(mShapeDrawCounter + 1, numSteps - 1);
+    return 1.0f - (float)order / (float)numSteps;
 }
 
 void DiligentContext::convexFill() {
     this->assertDrawingIsBegan();
+    this->checkClipRect();
+    if(this->drawAnalytic(this->fillStyle, 0.0f))
+        return;
+    // Meshes are uploaded right away, so the arena is rewound after every draw
+    ArenaScope scope(&mArena);
     factory::ShapeMesh mesh = internalConvexFill();
     render::Shape shape = render::Shape(mRenderDevice, mesh);
     shape.draw(*this, this->fillStyle);
@@ -630,6 +1985,18 @@ void DiligentContext::convexFill() {
 
 void DiligentContext::fill() {
     this->assertDrawingIsBegan();
+    this->checkClipRect();
+    if(this->drawAnalytic(this->fillStyle, 0.0f))
+        return;
+    ArenaScope scope(&mArena);
+    // Curves are anti-aliased by the pixel shader instead of a fringe
+    if(!mCurves.empty() && !mIsClipping && !this->isFeathering() &&
+       this->fillStyle.type == Style::Type::SolidColor) {
+        factory::CurveMesh mesh = internalCurveFill();
+        render::Shape shape = render::Shape(mRenderDevice, mesh);
+        shape.drawCurve(*this, this->fillStyle);
+        return;
+    }
     factory::ShapeMesh mesh = internalFill();
     render::Shape shape = render::Shape(mRenderDevice, mesh);
     shape.draw(*this, this->fillStyle);
@@ -638,11 +2005,197 @@ void DiligentContext::fill() {
 
 void DiligentContext::stroke() {
     this->assertDrawingIsBegan();
+    bool isLineDash = this->lineDash.gapLength != 0.0f;
+    if(!isLineDash && this->drawAnalytic(this->strokeStyle, this->lineWidth))
+        return;
+    ArenaScope scope(&mArena);
+    // Clip shapes are drawn again to pop them, so they keep a mesh.
+    // Extruded parts have no fringe and only take solid colors
+    if(!mIsClipping && !this->isFeathering() &&
+       this->strokeStyle.type == Style::Type::SolidColor && this->drawStroke())
+        return;
     factory::ShapeMesh mesh = internalStroke();
     render::Shape shape = render::Shape(mRenderDevice, mesh);
     shape.draw(*this, this->strokeStyle);
 }
 
+bool DiligentContext::drawAnalytic(Style& style, float strokeWidth) {
+    // Clip shapes are drawn into the stencil and need real coverage
+    if(mIsClipping || style.type != Style::Type::SolidColor)
+        return false;
+    const AnalyticShape& analytic = mAnalyticShape;
+    if(analytic.type == AnalyticShape::Type::None)
+        return false;
+    
+    bool isSharp = analytic.type == AnalyticShape::Type::RoundedRect &&
+                   analytic.radii == glm::vec4(0.0f);
+    // Filled sharp rectangle is already a quad, and stays in the opaque pass
+    if(strokeWidth == 0.0f && isSharp)
+        return false;
+    // Bevelled corners have no simple distance function
+    if(strokeWidth > 0.0f && isSharp && this->lineJoin == LineJoin::Bevel)
+        return false;
+    
+    // Leave room for the anti-aliased edge of about two pixels
+    glm::vec2 extent = analytic.halfSize + strokeWidth / 2.0f + 2.0f * this->pixelWidth();
+    
+    glm::vec4 bounds(analytic.center - extent, extent * 2.0f);
+    
+    shader::analytic::PSConstants constants;
+    constants.color = style.color;
+    constants.radii = analytic.radii;
+    constants.center = analytic.center;
+    constants.halfSize = analytic.halfSize;
+    constants.strokeWidth = strokeWidth;
+    constants.isEllipse = analytic.type == AnalyticShape::Type::Ellipse ? 1.0f : 0.0f;
+    constants.isSharp = isSharp && this->lineJoin != LineJoin::Round ? 1.0f : 0.0f;
+    
+    mUnitQuad.drawAnalytic(*this, bounds, constants);
+    GeometryStats& stats = strokeWidth > 0.0f ? mFrameStats.stroke : mFrameStats.fill;
+    stats.vertices += 4;
+    stats.triangles += 2;
+    return true;
+}
+
+// Clip shapes only touch the stencil, where a fringe would widen them
+bool DiligentContext::isFeathering() {
+    return !mIsClipping && Context::isFeathering();
+}
+
+void DiligentContext::fillInstanced(const Instance* instances, size_t count) {
+    this->assertDrawingIsBegan();
+    if(count == 0)
+        return;
+    // Clip shapes are kept one by one to be popped later
+    if(mIsClipping) {
+        Context::fillInstanced(instances, count);
+        return;
+    }
+    
+    ArenaScope scope(&mArena);
+    factory::ShapeMesh mesh = internalFill();
+    render::Shape shape = render::Shape(mRenderDevice, mesh);
+    this->drawInstances(shape, instances, count);
+}
+
+void DiligentContext::fillQuads(const Instance* quads, size_t count) {
+    this->assertDrawingIsBegan();
+    if(count == 0)
+        return;
+    if(mIsClipping) {
+        Context::fillQuads(quads, count);
+        return;
+    }
+    this->drawInstances(mUnitQuad, quads, count);
+}
+
+void DiligentContext::fillMesh(factory::ShapeMesh& mesh, Style& style) {
+    render::Shape shape = render::Shape(mRenderDevice, mesh);
+    shape.draw(*this, style);
+}
+
+void DiligentContext::drawInstances(render::Shape& shape, const Instance* instances, size_t count) {
+    Diligent::Uint64 offset = this->allocateInstances(count *
+                                                      sizeof(shader::instanced::InstanceData));
+    shader::instanced::InstanceData* data =
+        reinterpret_cast<shader::instanced::InstanceData*>(mInstanceData.data() + offset);
+    bool isOpaque = true;
+    for(size_t i = 0; i < count; i++) {
+        const glm::mat3& m = instances[i].matrix;
+        data[i].row0 = glm::vec4(m[0][0], m[1][0], m[2][0], 0.0f);
+        data[i].row1 = glm::vec4(m[0][1], m[1][1], m[2][1], 0.0f);
+        data[i].color = instances[i].color;
+        isOpaque = isOpaque && instances[i].color.a >= 1.0f;
+    }
+    shape.drawInstanced(*this, offset, (Diligent::Uint32)count, isOpaque);
+}
+
+Diligent::Uint64 DiligentContext::allocateInstances(size_t size) {
+    Diligent::Uint64 offset = mInstanceData.size();
+    mInstanceData.resize(mInstanceData.size() + size);
+    return offset;
+}
+
+void DiligentContext::uploadInstances() {
+    if(mInstanceData.empty())
+        return;
+    if(mInstanceBufferSize < mInstanceData.size()) {
+        // Doubled, so that growing frames rarely recreate it
+        mInstanceBufferSize = std::max(mInstanceBufferSize * 2,
+                                       (Diligent::Uint64)mInstanceData.size());
+        Diligent::BufferDesc InstBuffDesc;
+        InstBuffDesc.Name = "blazevg instance buffer";
+        InstBuffDesc.Usage = Diligent::USAGE_DYNAMIC;
+        InstBuffDesc.BindFlags = Diligent::BIND_VERTEX_BUFFER;
+        InstBuffDesc.CPUAccessFlags = Diligent::CPU_ACCESS_WRITE;
+        InstBuffDesc.Size = mInstanceBufferSize;
+        mInstanceBuffer.Release();
+        threadAllocations().bufferCreations++;
+        threadAllocations().bufferBytes += InstBuffDesc.Size;
+        mRenderDevice->CreateBuffer(InstBuffDesc, nullptr, &mInstanceBuffer);
+    }
+    {
+        Diligent::MapHelper<unsigned char> instances(mDeviceContext, mInstanceBuffer,
+                                                     Diligent::MAP_WRITE,
+                                                     Diligent::MAP_FLAG_DISCARD);
+        memcpy(instances, mInstanceData.data(), mInstanceData.size());
+    }
+    mFrameStats.bytesUploaded += mInstanceData.size();
+    mInstanceData.clear();
+}
+
+bool DiligentContext::dashConstants(shader::stroke::DashPSConstants& constants) {
+    float phase = 0.0f;
+    ArenaVector<float> pattern = this->dashPattern(phase);
+    float period = 0.0f;
+    for(float length : pattern)
+        period += length;
+    // Round dash ends can't be told from the arc length alone
+    if(pattern.size() % 2 != 0 || pattern.size() > shader::stroke::maxDashes ||
+       period <= 0.0f || this->lineCap == LineCap::Round)
+        return false;
+    
+    for(size_t i = 0; i < pattern.size(); i++)
+        constants.dash[i] = pattern[i];
+    constants.count = (float)pattern.size();
+    constants.period = period;
+    constants.phase = phase;
+    // Same as the square caps of the stroke
+    constants.extension = this->lineCap == LineCap::Square ? this->lineWidth : 0.0f;
+    return true;
+}
+
+bool DiligentContext::drawStroke() {
+    shader::stroke::DashPSConstants dash;
+    bool isLineDash = this->lineDash.gapLength != 0.0f;
+    if(isLineDash && !this->dashConstants(dash))
+        return false;
+    
+    ArenaVector<factory::StrokePart> parts = internalStrokeParts(false);
+    if(parts.empty())
+        return true;
+    Diligent::Uint64 offset = this->allocateInstances(parts.size() *
+                                                      sizeof(shader::stroke::InstanceData));
+    shader::stroke::InstanceData* data =
+        reinterpret_cast<shader::stroke::InstanceData*>(mInstanceData.data() + offset);
+    
+    // Sorted by template part, so that every part is one instanced draw
+    Diligent::Uint32 partCounts[render::numStrokeTemplateParts] = {};
+    for(const factory::StrokePart& part : parts)
+        partCounts[(int)render::strokeTemplatePart(part.type)]++;
+    size_t starts[render::numStrokeTemplateParts] = {};
+    for(int i = 1; i < render::numStrokeTemplateParts; i++)
+        starts[i] = starts[i - 1] + partCounts[i - 1];
+    for(const factory::StrokePart& part : parts) {
+        shader::stroke::InstanceData& instance =
+            data[starts[(int)render::strokeTemplatePart(part.type)]++];
+        instance.points = glm::vec4(part.a, part.b);
+        instance.extra = glm::vec4(part.c, (float)part.type, part.length);
+    }
+    mStrokeTemplate.drawStroke(*this, this->strokeStyle, offset, partCounts, dash);
+    return true;
+}
+
 void DiligentContext::test() {
     this->assertDrawingIsBegan();
     vg_context ctx;
@@ -676,12 +2229,20 @@ void DiligentContext::test() {
 }
 
 void DiligentContext::print(std::wstring str, float x, float y) {
+    BVG_TRACE_ZONE("print");
     this->assertDrawingIsBegan();
     assert(this->font != nullptr);
+    this->flushDraws();
+    this->applyScissor();
+    
+    // Font is still loading in background
+    if(!this->font->isLoaded)
+        return;
     
     float scale = fontSize / (float)font->size;
     glm::vec2 pos = glm::vec2(x, y);
     glm::mat4 transform = getMatrix3D();
+    float depth = paintDepth();
     
     DiligentFont* fnt = static_cast<DiligentFont*>(this->font);
     fnt->recreatePipelineState(mColorBufferFormat,
@@ -698,15 +2259,17 @@ void DiligentContext::print(std::wstring str, float x, float y) {
             continue;
         }
         
-        render::CharacterQuad& character = fnt->chars[symbol];
+        render::CharacterQuad* character = fnt->findCharacter(symbol);
+        if (character == nullptr)
+            continue;
 
         if (symbol == ' ')
         {
-            pos.x += (float)character.advance * scale;
+            pos.x += (float)character->advance * scale;
             continue;
         }
         
-        if (character.vertexBuffer == nullptr)
+        if (character->vertexBuffer == nullptr)
             continue;
         
         glm::mat4 MVP = transform * glm::scale(
@@ -719,7 +2282,9 @@ void DiligentContext::print(std::wstring str, float x, float y) {
                                                                  Diligent::MAP_FLAG_DISCARD);
             shader::VSConstants c;
             c.MVP = glm::transpose(MVP);
+            c.depth = depth;
             *CBConstants = c;
+            this->countConstantsUpload(sizeof(c));
         }
         {
             Diligent::MapHelper<shader::msdf::PSConstants> CBConstants(mDeviceContext,
@@ -733,19 +2298,21 @@ void DiligentContext::print(std::wstring str, float x, float y) {
             if(this->fillStyle.type == Style::Type::LinearGradient) {
                 c.isLinearGradient = true;
                 c.gradient = shader::GradientConstants(this->fillStyle, MVP, *this);
+                c.gradient.ramp = mGradientRamps.find(mDeviceContext, this->fillStyle);
             }
             *CBConstants = c;
+            this->countConstantsUpload(sizeof(c));
         }
 
         Diligent::Uint64   offset = 0;
-        Diligent::IBuffer* pBuffs[] = { character.vertexBuffer };
+        Diligent::IBuffer* pBuffs[] = { character->vertexBuffer };
         mDeviceContext->SetVertexBuffers(0, 1, pBuffs, &offset,
             Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
             Diligent::SET_VERTEX_BUFFERS_FLAG_RESET);
         mDeviceContext->SetIndexBuffer(mGlyphShaders.quadIndexBuffer, 0,
             Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
 
-        mDeviceContext->SetPipelineState(fnt->PSO);
+        this->setPipelineState(fnt->blendingPSOs.get(*mResources, this->blendingMode));
 
         mDeviceContext->CommitShaderResources(fnt->SRB,
                                        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
@@ -755,14 +2322,20 @@ void DiligentContext::print(std::wstring str, float x, float y) {
         DrawAttrs.NumIndices = _countof(render::GlyphQuadIndices);
         DrawAttrs.Flags = Diligent::DRAW_FLAG_VERIFY_ALL;
 
+        mDeviceContext->SetStencilRef(mClipLevel);
+        if(this->measureGPUTime)
+            mGPUTimers.begin(mDeviceContext, render::GPUTimers::Category::Text);
+        mFrameStats.drawCalls++;
+        mFrameStats.text.vertices += 4;
+        mFrameStats.text.triangles += 2;
         mDeviceContext->DrawIndexed(DrawAttrs);
 
-        pos.x += (float)character.advance * scale;
+        pos.x += (float)character->advance * scale;
     }
     mShapeDrawCounter++;
 }
 
-float tAtLengthClosed(float length, std::vector<float> lengths, float fullLength, bool closed) {
+float tAtLengthClosed(float length, Span<float> lengths, float fullLength, bool closed) {
     if(closed) {
         float cyclesLength = 0;
         int cycles = (int)floorf(length / fullLength);
@@ -775,16 +2348,24 @@ float tAtLengthClosed(float length, std::vector<float> lengths, float fullLength
 }
 
 void DiligentContext::printOnPath(std::wstring str, float x, float y) {
+    BVG_TRACE_ZONE("printOnPath");
     this->assertDrawingIsBegan();
     assert(this->font != nullptr);
+    this->flushDraws();
+    this->applyScissor();
+    
+    if(!this->font->isLoaded)
+        return;
     
-    std::vector<glm::vec2> polyline = this->toOnePolyline(mPolylines);
+    ArenaScope scope(&mArena);
+    factory::Polyline polyline = this->toOnePolyline(mPolylines, &mArena);
     
     float scale = fontSize / (float)font->size;
     float length = x;
     glm::mat4 transform = getMatrix3D();
+    float depth = paintDepth();
     
-    std::vector<float> polylineLengths = factory::measurePolyline(polyline);
+    ArenaVector<float> polylineLengths = factory::measurePolyline(polyline, &mArena);
     float polylineLength = 0;
     for(float len : polylineLengths)
         polylineLength += len;
@@ -804,21 +2385,23 @@ void DiligentContext::printOnPath(std::wstring str, float x, float y) {
             continue;
         }
         
-        render::CharacterQuad& character = fnt->chars[symbol];
+        render::CharacterQuad* character = fnt->findCharacter(symbol);
+        if (character == nullptr)
+            continue;
 
         if (symbol == ' ')
         {
-            length += (float)character.advance * scale;
+            length += (float)character->advance * scale;
             continue;
         }
         
-        if (character.vertexBuffer == nullptr)
+        if (character->vertexBuffer == nullptr)
             continue;
         
         float t = tAtLengthClosed(length, polylineLengths, polylineLength, closed);
         glm::vec2 pos = factory::getPointAtT(polyline, t);
         
-        float t2 = tAtLengthClosed(length + (float)character.advance, polylineLengths,
+        float t2 = tAtLengthClosed(length + (float)character->advance, polylineLengths,
                                    polylineLength, closed);
         glm::vec2 pos2 = factory::getPointAtT(polyline, t2);
         
@@ -833,7 +2416,7 @@ void DiligentContext::printOnPath(std::wstring str, float x, float y) {
                 glm::vec2 dir = glm::normalize(polyline.back() - polyline.at(polyline.size() - 2));
                 float lengthFromOrigin = length - polylineLength;
                 pos = origin + dir * lengthFromOrigin;
-                pos2 = origin + dir * (lengthFromOrigin + (float)character.advance);
+                pos2 = origin + dir * (lengthFromOrigin + (float)character->advance);
             }
         }
         
@@ -853,7 +2436,9 @@ void DiligentContext::printOnPath(std::wstring str, float x, float y) {
                                                                  Diligent::MAP_FLAG_DISCARD);
             shader::VSConstants c;
             c.MVP = glm::transpose(MVP);
+            c.depth = depth;
             *CBConstants = c;
+            this->countConstantsUpload(sizeof(c));
         }
         {
             Diligent::MapHelper<shader::msdf::PSConstants> CBConstants(mDeviceContext,
@@ -867,19 +2452,21 @@ void DiligentContext::printOnPath(std::wstring str, float x, float y) {
             if(this->fillStyle.type == Style::Type::LinearGradient) {
                 c.isLinearGradient = true;
                 c.gradient = shader::GradientConstants(this->fillStyle, MVP, *this);
+                c.gradient.ramp = mGradientRamps.find(mDeviceContext, this->fillStyle);
             }
             *CBConstants = c;
+            this->countConstantsUpload(sizeof(c));
         }
 
         Diligent::Uint64   offset = 0;
-        Diligent::IBuffer* pBuffs[] = { character.vertexBuffer };
+        Diligent::IBuffer* pBuffs[] = { character->vertexBuffer };
         mDeviceContext->SetVertexBuffers(0, 1, pBuffs, &offset,
             Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION,
             Diligent::SET_VERTEX_BUFFERS_FLAG_RESET);
         mDeviceContext->SetIndexBuffer(mGlyphShaders.quadIndexBuffer, 0,
             Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
 
-        mDeviceContext->SetPipelineState(fnt->PSO);
+        this->setPipelineState(fnt->blendingPSOs.get(*mResources, this->blendingMode));
 
         mDeviceContext->CommitShaderResources(fnt->SRB,
                                        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
@@ -889,9 +2476,15 @@ void DiligentContext::printOnPath(std::wstring str, float x, float y) {
         DrawAttrs.NumIndices = _countof(render::GlyphQuadIndices);
         DrawAttrs.Flags = Diligent::DRAW_FLAG_VERIFY_ALL;
 
+        mDeviceContext->SetStencilRef(mClipLevel);
+        if(this->measureGPUTime)
+            mGPUTimers.begin(mDeviceContext, render::GPUTimers::Category::Text);
+        mFrameStats.drawCalls++;
+        mFrameStats.text.vertices += 4;
+        mFrameStats.text.triangles += 2;
         mDeviceContext->DrawIndexed(DrawAttrs);
 
-        length += (float)character.advance * scale;
+        length += (float)character->advance * scale;
     }
     mShapeDrawCounter++;
 }
@@ -899,6 +2492,9 @@ void DiligentContext::printOnPath(std::wstring str, float x, float y) {
 float DiligentContext::measureTextWidth(std::wstring str) {
     assert(this->font != nullptr);
     
+    if(!this->font->isLoaded)
+        return 0.0f;
+    
     float scale = fontSize / (float)font->size;
     float width = 0.0f;
     
@@ -909,91 +2505,80 @@ float DiligentContext::measureTextWidth(std::wstring str) {
         if (symbol == '\n')
             return width;
         
-        render::CharacterQuad& character = fnt->chars[symbol];
+        render::CharacterQuad* character = fnt->findCharacter(symbol);
+        if (character == nullptr)
+            continue;
 
-        width += (float)character.advance * scale;
+        width += (float)character->advance * scale;
     }
     return width;
 }
 float DiligentContext::measureTextHeight() {
     assert(this->font != nullptr);
     
+    if(!this->font->isLoaded)
+        return 0.0f;
+    
     float scale = fontSize / (float)font->size;
     return this->font->lineHeight * scale;
 }
 
-void DiligentContext::loadFontFromMemory(std::string& json,
-                        std::string fontName,
-                        void* imageData,
-                        int width,
-                        int height,
-                        int numChannels)
-{
-    DiligentFont* font = new DiligentFont(mRenderDevice,
-                                          mColorBufferFormat,
-                                          mDepthBufferFormat,
-                                          this->mNumSamples,
-                                          json,
-                                          imageData,
-                                          width,
-                                          height,
-                                          numChannels,
-                                          *this);
-    this->fonts[fontName] = static_cast<Font*>(font);
-}
-
-DiligentFont::DiligentFont(Diligent::RefCntAutoPtr<Diligent::IRenderDevice> renderDevice,
+Font* DiligentContext::createFont() {
+    return new DiligentFont(mResources,
+                            mColorBufferFormat,
+                            mDepthBufferFormat,
+                            this->mNumSamples,
+                            *this);
+}
+
+DiligentFont::DiligentFont(std::shared_ptr<render::DeviceResources> resources,
                            Diligent::TEXTURE_FORMAT colorBufferFormat,
                            Diligent::TEXTURE_FORMAT depthBufferFormat,
                            int numSamples,
-                           std::string& json,
-                           void* imageData,
-                           int width,
-                           int height,
-                           int numChannels,
                            DiligentContext& context):
-    mRenderDevice(renderDevice),
-    mContext(context)
+    mResources(resources),
+    mContext(context),
+    mColorBufferFormat(colorBufferFormat),
+    mDepthBufferFormat(depthBufferFormat),
+    mNumSamples(numSamples)
 {
-    createTexture(colorBufferFormat, imageData, width, height, numChannels);
-    recreatePipelineState(colorBufferFormat, depthBufferFormat, numSamples);
-    this->parseJson(json);
 }
 
-void* convertRGBToRGBA(char* imageData,
-                       int width,
-                       int height)
-{
-    char* newImage = new char[width * height * 4];
-    for(size_t i = 0; i < width * height; i++) {
-        size_t oldIndex = i * 3LL;
-        size_t newIndex = i * 4LL;
-        newImage[newIndex] = imageData[oldIndex]; // Red
-        newImage[newIndex + 1LL] = imageData[oldIndex + 1LL]; // Green
-        newImage[newIndex + 2LL] = imageData[oldIndex + 2LL]; // Blue
-        newImage[newIndex + 3LL] = 255; // Alpha
-    }
-    return newImage;
-}
-
-void DiligentFont::createTexture(Diligent::TEXTURE_FORMAT colorBufferFormat,
-                                 void* imageData,
-                                 int width,
-                                 int height,
-                                 int numChannels)
-{
-    assert(imageData != nullptr);
-    
-    int RGBAStride = width * numChannels;
-    if(numChannels == 3) {
-        RGBAStride = width * 4;
-        imageData = convertRGBToRGBA((char*)imageData, width, height);
+void DiligentFont::upload(Data& data) {
+    BVG_TRACE_ZONE("DiligentFont::upload");
+    // Another context may have uploaded the same font already
+    std::shared_ptr<render::GlyphAtlas> atlas = std::make_shared<render::GlyphAtlas>();
+    atlas->json = data.json;
+    atlas->width = data.width;
+    atlas->height = data.height;
+    atlas->format = mColorBufferFormat;
+    atlas->contentKey = data.key;
+    glyphs = mResources->findGlyphAtlas(*atlas);
+    bool isNewAtlas = glyphs == nullptr;
+    if(isNewAtlas) {
+        glyphs = atlas;
+        createTexture(data);
     }
-    // RGBAStride = (RGBAStride + 3) & (-4);
+    Font::upload(data);
+    if(isNewAtlas)
+        mResources->addGlyphAtlas(glyphs);
+    createPipelineState();
+}
+
+render::CharacterQuad* DiligentFont::findCharacter(int unicode) {
+    auto it = glyphs->chars.find(unicode);
+    if(it == glyphs->chars.end())
+        return nullptr;
+    return &it->second;
+}
+
+void DiligentFont::createTexture(Data& data)
+{
+    assert(!data.pixels.empty());
 
     Diligent::TextureSubResData SubRes;
-    SubRes.Stride = RGBAStride;
-    SubRes.pData = imageData;
+    SubRes.Stride = data.width * data.numChannels;
+    SubRes.pData = data.pixels.data();
 
     Diligent::TextureData TexData;
     TexData.NumSubresources = 1;
@@ -1001,17 +2586,13 @@ void DiligentFont::createTexture(Diligent::TEXTURE_FORMAT colorBufferFormat,
 
     Diligent::TextureDesc TexDesc;
     TexDesc.Type = Diligent::RESOURCE_DIM_TEX_2D;
-    TexDesc.Width = width;
-    TexDesc.Height = height;
+    TexDesc.Width = data.width;
+    TexDesc.Height = data.height;
     TexDesc.MipLevels = 1;
-    TexDesc.Format = colorBufferFormat;
+    TexDesc.Format = mColorBufferFormat;
     TexDesc.BindFlags = Diligent::BIND_SHADER_RESOURCE;
-    mRenderDevice->CreateTexture(TexDesc, &TexData, &mTexture);
-    textureSRV = mTexture->GetDefaultView(Diligent::TEXTURE_VIEW_SHADER_RESOURCE);
-    
-    if(numChannels == 3) {
-        delete[] (char*)imageData;
-    }
+    mResources->getRenderDevice()->CreateTexture(TexDesc, &TexData, &glyphs->texture);
+    glyphs->textureSRV = glyphs->texture->GetDefaultView(Diligent::TEXTURE_VIEW_SHADER_RESOURCE);
 }
 
 void DiligentFont::recreatePipelineState(Diligent::TEXTURE_FORMAT colorBufferFormat,
@@ -1027,70 +2608,37 @@ void DiligentFont::recreatePipelineState(Diligent::TEXTURE_FORMAT colorBufferFor
     mDepthBufferFormat = depthBufferFormat;
     mNumSamples = numSamples;
     
-    Diligent::GraphicsPipelineStateCreateInfo PSOCreateInfo;
-    PSOCreateInfo.PSODesc.Name = "blazevg font PSO";
-    PSOCreateInfo.PSODesc.PipelineType = Diligent::PIPELINE_TYPE_GRAPHICS;
-    PSOCreateInfo.GraphicsPipeline.SmplDesc.Count = numSamples;
-    PSOCreateInfo.GraphicsPipeline.NumRenderTargets = 1;
-    PSOCreateInfo.GraphicsPipeline.RTVFormats[0] = colorBufferFormat;
-    PSOCreateInfo.GraphicsPipeline.DSVFormat = depthBufferFormat;
-    PSOCreateInfo.GraphicsPipeline.PrimitiveTopology = Diligent::PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    PSOCreateInfo.GraphicsPipeline.RasterizerDesc.CullMode = Diligent::CULL_MODE_NONE;
-    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.StencilEnable = Diligent::True;
-    PSOCreateInfo.GraphicsPipeline.DepthStencilDesc.DepthEnable = Diligent::True;
-
-    Diligent::BlendStateDesc BlendState;
-    BlendState.RenderTargets[0].BlendEnable = Diligent::True;
-    BlendState.RenderTargets[0].SrcBlend = Diligent::BLEND_FACTOR_SRC_ALPHA;
-    BlendState.RenderTargets[0].DestBlend = Diligent::BLEND_FACTOR_INV_SRC_ALPHA;
-    PSOCreateInfo.GraphicsPipeline.BlendDesc = BlendState;
-
-    PSOCreateInfo.pVS = mContext.mGlyphShaders.VS;
-    PSOCreateInfo.pPS = mContext.mGlyphShaders.PS;
+    // The pipeline is created on upload, once the texture exists
+    if(this->isLoaded)
+        createPipelineState();
+}
 
-    Diligent::LayoutElement LayoutElems[] =
-    {
-        // Attribute 0 - vertex position
-        Diligent::LayoutElement{0, 0, 2, Diligent::VT_FLOAT32, Diligent::False},
-        // Attribute 1 - texture coordinate
-        Diligent::LayoutElement{1, 0, 2, Diligent::VT_FLOAT32, Diligent::False}
-    };
-    PSOCreateInfo.GraphicsPipeline.InputLayout.LayoutElements = LayoutElems;
-    PSOCreateInfo.GraphicsPipeline.InputLayout.NumElements = _countof(LayoutElems);
+void DiligentFont::createPipelineState() {
+    render::PipelineStateKey key;
+    key.type = render::PipelineStateKey::Type::Glyph;
+    key.colorBufferFormat = mColorBufferFormat;
+    key.depthBufferFormat = mDepthBufferFormat;
+    key.numSamples = mNumSamples;
     
-    PSOCreateInfo.PSODesc.ResourceLayout.DefaultVariableType = Diligent::SHADER_RESOURCE_VARIABLE_TYPE_STATIC;
-    
-    Diligent::ShaderResourceVariableDesc variables[] =
-    {
-        { Diligent::SHADER_TYPE_PIXEL, "g_Texture", Diligent::SHADER_RESOURCE_VARIABLE_TYPE_MUTABLE }
-    };
-    PSOCreateInfo.PSODesc.ResourceLayout.Variables = variables;
-    PSOCreateInfo.PSODesc.ResourceLayout.NumVariables = _countof(variables);
-
-    Diligent::ImmutableSamplerDesc samplers[] =
-    {
-        { Diligent::SHADER_TYPE_PIXEL, "g_Texture", Diligent::Sam_LinearClamp }
-    };
-    PSOCreateInfo.PSODesc.ResourceLayout.ImmutableSamplers = samplers;
-    PSOCreateInfo.PSODesc.ResourceLayout.NumImmutableSamplers = _countof(samplers);
-
-    PSO.Release();
     SRB.Release();
-    
-    mRenderDevice->CreateGraphicsPipelineState(PSOCreateInfo, &PSO);
-
-    PSO->GetStaticVariableByName(Diligent::SHADER_TYPE_VERTEX, "Constants")->
+    PSO = mResources->pipelineState(key);
+    blendingPSOs.reset(key);
+    PSO->CreateShaderResourceBinding(&SRB, true);
+    SRB->GetVariableByName(Diligent::SHADER_TYPE_VERTEX, "Constants")->
         Set(mContext.mGlyphShaders.VSConstants);
-    PSO->GetStaticVariableByName(Diligent::SHADER_TYPE_PIXEL, "Constants")->
+    SRB->GetVariableByName(Diligent::SHADER_TYPE_PIXEL, "Constants")->
         Set(mContext.mGlyphShaders.PSConstants);
-
-    PSO->CreateShaderResourceBinding(&SRB, true);
     SRB->GetVariableByName(Diligent::SHADER_TYPE_PIXEL, "g_Texture")->
-        Set(textureSRV);
+        Set(glyphs->textureSRV);
+    SRB->GetVariableByName(Diligent::SHADER_TYPE_PIXEL, "g_RampTexture")->
+        Set(mContext.mGradientRamps.textureSRV);
 }
 
 void DiligentFont::loadCharacter(Character& character) {
-    this->chars[character.unicode] = render::CharacterQuad(mRenderDevice, character, this->size);
+    if(glyphs->chars.find(character.unicode) != glyphs->chars.end())
+        return;
+    glyphs->chars[character.unicode] = render::CharacterQuad(mResources->getRenderDevice(),
+                                                             character, this->size);
 }
 
 void DiligentContext::
@@ -1107,10 +2655,28 @@ setupPipelineStates(Diligent::TEXTURE_FORMAT colorBufferFormat,
     mDepthBufferFormat = depthBufferFormat;
     mNumSamples = numSamples;
     
-    mSolidColorPSO.recreate(mRenderDevice, mColorBufferFormat, mDepthBufferFormat,
-                            this->blendingMode, numSamples);
-    mGradientPSO.recreate(mRenderDevice, mColorBufferFormat, mDepthBufferFormat,
-                          this->blendingMode, numSamples);
+    mSolidColorPSO.recreate(*mResources, mColorBufferFormat, mDepthBufferFormat, numSamples);
+    mInstancedPSO.recreate(*mResources, mColorBufferFormat, mDepthBufferFormat, numSamples);
+    mAnalyticPSO.recreate(*mResources, mColorBufferFormat, mDepthBufferFormat, numSamples);
+    mStrokePSO.recreate(*mResources, mColorBufferFormat, mDepthBufferFormat, numSamples);
+    mCurvePSO.recreate(*mResources, mColorBufferFormat, mDepthBufferFormat, numSamples);
+    mGradientPSO.recreate(*mResources, mColorBufferFormat, mDepthBufferFormat, numSamples);
+}
+
+void DiligentContext::warmUpPipelineStates() {
+    mSolidColorPSO.blendingPSOs.warmUp(*mResources);
+    mInstancedPSO.blendingPSOs.warmUp(*mResources);
+    mAnalyticPSO.blendingPSOs.warmUp(*mResources);
+    mStrokePSO.blendingPSOs.warmUp(*mResources);
+    mStrokePSO.dashedBlendingPSOs.warmUp(*mResources);
+    mCurvePSO.blendingPSOs.warmUp(*mResources);
+    for(render::BlendingPipelineStates& blendingPSOs : mGradientPSO.blendingPSOs)
+        blendingPSOs.warmUp(*mResources);
+    for(auto& entry : fonts) {
+        DiligentFont* font = (DiligentFont*)entry.second;
+        if(font->isLoaded)
+            font->blendingPSOs.warmUp(*mResources);
+    }
 }
 
 void DiligentContext::specifyTextureViews(Diligent::ITextureView* RTV,
@@ -1118,23 +2684,221 @@ void DiligentContext::specifyTextureViews(Diligent::ITextureView* RTV,
     mDSV = DSV;
 }
 
+void DiligentContext::beginDrawing() {
+    Context::beginDrawing();
+    mCurrentPSO = nullptr;
+    if(this->measureGPUTime)
+        mGPUTimers.nextFrame();
+    mGradientRamps.nextFrame();
+    // The stencil is cleared by the caller, and the clips with it
+    mIsClipping = false;
+    mClipStack.clear();
+    mClipLevel = 0;
+    mScissor = this->fullScissor();
+}
+
+void DiligentContext::endDrawing() {
+    this->flushDraws();
+    if(this->measureGPUTime) {
+        mGPUTimers.end(mDeviceContext);
+        float* durations = mGPUTimers.durations;
+        mFrameStats.gpuSolidTime = durations[(int)render::GPUTimers::Category::Solid];
+        mFrameStats.gpuGradientTime = durations[(int)render::GPUTimers::Category::Gradient];
+        mFrameStats.gpuTextTime = durations[(int)render::GPUTimers::Category::Text];
+        mFrameStats.gpuClipTime = durations[(int)render::GPUTimers::Category::Clip];
+    }
+    Context::endDrawing();
+}
+
+void DiligentContext::setPipelineState(Diligent::IPipelineState* PSO) {
+    if(PSO == mCurrentPSO)
+        return;
+    mCurrentPSO = PSO;
+    mFrameStats.pipelineSwitches++;
+    mDeviceContext->SetPipelineState(PSO);
+}
+
+void DiligentContext::countConstantsUpload(size_t size) {
+    mFrameStats.constantBufferMaps++;
+    mFrameStats.bytesUploaded += size;
+}
+
+void DiligentContext::flushDraws() {
+    BVG_TRACE_ZONE("flushDraws");
+    if(mDrawQueue.empty())
+        return;
+    this->uploadInstances();
+    this->applyScissor();
+    // Front-to-back, so that hidden pixels of opaque
+    // shapes are rejected by the depth test before shading
+    for(auto it = mDrawQueue.rbegin(); it != mDrawQueue.rend(); it++) {
+        if(it->isOpaque)
+            this->submit(*it);
+    }
+    for(render::DrawCommand& command : mDrawQueue) {
+        if(!command.isOpaque)
+            this->submit(command);
+    }
+    mDrawQueue.clear();
+}
+
+void DiligentContext::setCommandStyle(render::DrawCommand& command, const Style& style) {
+    command.styleType = style.type;
+    if(style.type == Style::Type::SolidColor)
+        command.color = style.color;
+    else
+        command.style = this->internStyle(style);
+}
+
+Style& DiligentContext::commandStyle(render::DrawCommand& command) {
+    if(command.styleType != Style::Type::SolidColor)
+        return mInternedStyles[command.style];
+    mSolidCommandStyle.type = Style::Type::SolidColor;
+    mSolidCommandStyle.color = command.color;
+    return mSolidCommandStyle;
+}
+
+void DiligentContext::submit(render::DrawCommand& command) {
+    if(this->measureGPUTime) {
+        // Instanced and analytic draws have no style
+        bool isGradient = command.numInstances == 0 && !command.isAnalytic &&
+                          command.styleType != Style::Type::SolidColor;
+        mGPUTimers.begin(mDeviceContext, isGradient ? render::GPUTimers::Category::Gradient
+                                                    : render::GPUTimers::Category::Solid);
+    }
+    if(command.isStroke) {
+        command.shape.submitStroke(*this, command);
+    } else if(command.isCurve) {
+        command.shape.submitCurve(*this, command);
+    } else if(command.numInstances > 0) {
+        command.shape.submitInstanced(*this, command.MVP, command.depth, command.blendingMode,
+                                      command.isOpaque, command.instanceOffset,
+                                      command.numInstances);
+    } else if(command.isAnalytic) {
+        command.shape.submitAnalytic(*this, command.MVP, command.depth, command.blendingMode,
+                                     command.analyticBounds, command.analytic);
+    } else {
+        command.shape.submit(*this, this->commandStyle(command), command.MVP, command.depth,
+                             command.blendingMode);
+    }
+}
+
+Diligent::Rect DiligentContext::fullScissor() {
+    return Diligent::Rect(0, 0,
+                          (Diligent::Int32)(this->width * this->contentScale),
+                          (Diligent::Int32)(this->height * this->contentScale));
+}
+
+void DiligentContext::applyScissor() {
+    Diligent::Rect full = this->fullScissor();
+    mDeviceContext->SetScissorRects(1, &mScissor, (Diligent::Uint32)full.right,
+                                    (Diligent::Uint32)full.bottom);
+}
+
+void DiligentContext::checkClipRect() {
+    if(!mIsClipping)
+        return;
+    Clip& clip = mClipStack.back();
+    clip.isRect = false;
+    if(!clip.shapes.empty())
+        return;
+    
+    glm::vec2 min, max;
+    if(!this->isPathAxisAlignedRect(min, max))
+        return;
+    
+    glm::vec2 resolution = glm::vec2(this->width, this->height) * this->contentScale;
+    glm::vec2 corner1 = glm::vec2(this->viewProj * glm::vec4(min, 0.0f, 1.0f));
+    glm::vec2 corner2 = glm::vec2(this->viewProj * glm::vec4(max, 0.0f, 1.0f));
+    corner1 = glm::vec2((corner1.x + 1.0f) / 2.0f, (1.0f - corner1.y) / 2.0f) * resolution;
+    corner2 = glm::vec2((corner2.x + 1.0f) / 2.0f, (1.0f - corner2.y) / 2.0f) * resolution;
+    glm::vec2 pixelMin = glm::min(corner1, corner2);
+    glm::vec2 pixelMax = glm::max(corner1, corner2);
+    
+    // With multisampling a scissor would lose the partial
+    // coverage of the edges that are between pixels
+    glm::vec2 roundedMin = glm::vec2(roundf(pixelMin.x), roundf(pixelMin.y));
+    glm::vec2 roundedMax = glm::vec2(roundf(pixelMax.x), roundf(pixelMax.y));
+    glm::vec2 errorMin = glm::abs(pixelMin - roundedMin);
+    glm::vec2 errorMax = glm::abs(pixelMax - roundedMax);
+    float error = std::max(std::max(errorMin.x, errorMin.y), std::max(errorMax.x, errorMax.y));
+    if(mNumSamples > 1 && error > 0.01f)
+        return;
+    
+    clip.isRect = true;
+    clip.rect = Diligent::Rect((Diligent::Int32)roundedMin.x, (Diligent::Int32)roundedMin.y,
+                               (Diligent::Int32)roundedMax.x, (Diligent::Int32)roundedMax.y);
+}
+
 void DiligentContext::beginClip() {
     if(mDSV == nullptr) {
         std::cerr << "blazevg: Error: Depth-stencil view is not specified. Please specify with specifyTextureViews()" << std::endl;
         exit(-1);
     }
+    if(mClipLevel >= 255) {
+        std::cerr << "blazevg: Error: Too many nested clips. Call popClip() or clearClip() to replace a clip" << std::endl;
+        exit(-1);
+    }
+    this->flushDraws();
     mIsClipping = true;
-    mDeviceContext->ClearDepthStencil(mDSV, Diligent::CLEAR_DEPTH_FLAG, 0.0f, 0,
-        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    mClipStack.push_back(Clip());
 }
 
 void DiligentContext::endClip() {
     mIsClipping = false;
+    Clip& clip = mClipStack.back();
+    if(clip.isRect && clip.shapes.size() == 1) {
+        // Intersect with the scissor of the parent clip
+        clip.scissor.left = std::max(mScissor.left, clip.rect.left);
+        clip.scissor.top = std::max(mScissor.top, clip.rect.top);
+        clip.scissor.right = std::max(clip.scissor.left, std::min(mScissor.right, clip.rect.right));
+        clip.scissor.bottom = std::max(clip.scissor.top, std::min(mScissor.bottom, clip.rect.bottom));
+        mScissor = clip.scissor;
+        return;
+    }
+    
+    clip.isRect = false;
+    clip.scissor = mScissor;
+    this->applyScissor();
+    if(this->measureGPUTime)
+        mGPUTimers.begin(mDeviceContext, render::GPUTimers::Category::Clip);
+    for(render::DrawCommand& command : clip.shapes) {
+        command.shape.submit(*this, this->commandStyle(command), command.MVP, command.depth,
+                             BlendingMode::Normal, render::ClipMask::Push);
+    }
+    mClipLevel++;
+}
+
+void DiligentContext::popClip() {
+    assert(!mIsClipping);
+    if(mClipStack.empty())
+        return;
+    this->flushDraws();
+    Clip& clip = mClipStack.back();
+    if(!clip.isRect) {
+        // Decrement only where this level was pushed,
+        // no need to clear the depth-stencil target
+        this->applyScissor();
+        if(this->measureGPUTime)
+            mGPUTimers.begin(mDeviceContext, render::GPUTimers::Category::Clip);
+        for(render::DrawCommand& command : clip.shapes) {
+            command.shape.submit(*this, this->commandStyle(command), command.MVP, command.depth,
+                                 BlendingMode::Normal, render::ClipMask::Pop);
+        }
+        mClipLevel--;
+    }
+    mClipStack.pop_back();
+    mScissor = mClipStack.empty() ? this->fullScissor() : mClipStack.back().scissor;
+}
+
+int DiligentContext::clipDepth() {
+    return mIsClipping ? (int)mClipStack.size() - 1 : (int)mClipStack.size();
 }
 
 void DiligentContext::clearClip() {
-    mDeviceContext->ClearDepthStencil(mDSV, Diligent::CLEAR_DEPTH_FLAG, 1.0f, 0,
-        Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+    this->flushDraws();
+    while(!mClipStack.empty())
+        this->popClip();
 }
 
 } // namespace bvg
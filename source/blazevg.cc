@@ -8,15 +8,344 @@
 #include <iostream>
 #include <list>
 #include <codecvt>
+#include <cassert>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <atomic>
+#include <fstream>
+#include <string_view>
 
 namespace bvg {
 
+static thread_local AllocationStats gThreadAllocations;
+
+AllocationStats& threadAllocations() {
+    return gThreadAllocations;
+}
+
+AllocationStats AllocationStats::operator-(const AllocationStats& b) const {
+    AllocationStats stats;
+    stats.heapAllocations = this->heapAllocations - b.heapAllocations;
+    stats.heapBytes = this->heapBytes - b.heapBytes;
+    stats.bufferCreations = this->bufferCreations - b.bufferCreations;
+    stats.bufferBytes = this->bufferBytes - b.bufferBytes;
+    stats.pipelineStateCreations = this->pipelineStateCreations - b.pipelineStateCreations;
+    return stats;
+}
+
+bool AllocationStats::exceeds(const AllocationStats& budget) const {
+    return this->heapAllocations > budget.heapAllocations ||
+           this->heapBytes > budget.heapBytes ||
+           this->bufferCreations > budget.bufferCreations ||
+           this->bufferBytes > budget.bufferBytes ||
+           this->pipelineStateCreations > budget.pipelineStateCreations;
+}
+
+namespace trace {
+
+static std::atomic<uint64_t> gNumEvents(0);
+
+// The sequence is the index of the event plus one once it is written,
+// and zero while it is being written. Readers compare it before and
+// after reading, so they skip slots that are claimed but not written
+struct Slot {
+    std::atomic<uint64_t> sequence;
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> duration;
+    std::atomic<uint32_t> thread;
+};
+
+static Slot* ringBuffer() {
+    static std::vector<Slot> slots(ringBufferSize);
+    return slots.data();
+}
+
+static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t threadIndex() {
+    static std::atomic<uint32_t> nextIndex(0);
+    thread_local uint32_t index = nextIndex++;
+    return index;
+}
+
+Zone::Zone(const char* name):
+    mName(name),
+    mStart(now())
+{
+}
+
+Zone::~Zone() {
+    uint64_t duration = now() - mStart;
+    uint64_t index = gNumEvents.fetch_add(1);
+    Slot& slot = ringBuffer()[index % ringBufferSize];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(mName, std::memory_order_relaxed);
+    slot.start.store(mStart, std::memory_order_relaxed);
+    slot.duration.store(duration, std::memory_order_relaxed);
+    slot.thread.store(threadIndex(), std::memory_order_relaxed);
+    slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+// Copies the event out of the slot, unless it is being written
+static bool readEvent(uint64_t index, Event& event) {
+    Slot& slot = ringBuffer()[index % ringBufferSize];
+    uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if(sequence != index + 1)
+        return false;
+    event.name = slot.name.load(std::memory_order_relaxed);
+    event.start = slot.start.load(std::memory_order_relaxed);
+    event.duration = slot.duration.load(std::memory_order_relaxed);
+    event.thread = slot.thread.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == sequence && event.name != nullptr;
+}
+
+void write(std::ostream& stream) {
+    uint64_t numEvents = gNumEvents.load();
+    uint64_t first = numEvents > ringBufferSize ? numEvents - ringBufferSize : 0;
+    bool isFirst = true;
+    stream << "{\"traceEvents\":[";
+    for(uint64_t i = first; i < numEvents; i++) {
+        Event event;
+        if(!readEvent(i, event))
+            continue;
+        if(!isFirst)
+            stream << ",";
+        isFirst = false;
+        stream << "\n{\"name\":\"" << event.name << "\",\"cat\":\"blazevg\",\"ph\":\"X\"," <<
+            "\"ts\":" << event.start << ",\"dur\":" << event.duration << "," <<
+            "\"pid\":0,\"tid\":" << event.thread << "}";
+    }
+    stream << "\n]}\n";
+}
+
+bool writeToFile(const std::string& path) {
+    std::ofstream file(path);
+    if(!file.is_open()) {
+        std::cerr << "blazevg: Error: Unable to open trace file " << path << std::endl;
+        return false;
+    }
+    write(file);
+    return true;
+}
+
+void clear() {
+    gNumEvents = 0;
+}
+
+} // namespace trace
+
+void GeometryStats::add(const factory::ShapeMesh& mesh) {
+    this->vertices += mesh.vertices.size();
+    this->triangles += mesh.indices.size();
+}
+
+#ifdef BLAZEVG_FRAME_TIMINGS
+// Adds the milliseconds of its lifetime to the counter
+class StatsTimer {
+public:
+    StatsTimer(float& counter):
+        mCounter(counter),
+        mStart(std::chrono::steady_clock::now())
+    {
+    }
+    
+    ~StatsTimer() {
+        std::chrono::duration<float, std::milli> duration =
+            std::chrono::steady_clock::now() - mStart;
+        mCounter += duration.count();
+    }
+    
+private:
+    float& mCounter;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+#define BVG_STATS_TIMER(counter) StatsTimer statsTimer(counter)
+#else
+#define BVG_STATS_TIMER(counter)
+#endif
+
+} // namespace bvg
+
+#ifdef BLAZEVG_COUNT_ALLOCATIONS
+
+// Replaces the global allocation functions of the whole process, not
+// just of blazevg, to count every allocation of the thread. Array forms
+// call these
+void* operator new(size_t size) {
+    bvg::AllocationStats& stats = bvg::threadAllocations();
+    stats.heapAllocations++;
+    stats.heapBytes += size;
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if(p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    bvg::AllocationStats& stats = bvg::threadAllocations();
+    stats.heapAllocations++;
+    stats.heapBytes += size;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+
+#endif
+
+namespace bvg {
+
+Arena::Arena(size_t blockSize):
+    mBlockSize(blockSize)
+{
+}
+
+Arena::~Arena() {
+    for(Block& block : mBlocks)
+        ::operator delete(block.data);
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    while(mCurrentBlock < mBlocks.size()) {
+        Block& block = mBlocks[mCurrentBlock];
+        size_t offset = (mOffset + alignment - 1) / alignment * alignment;
+        if(offset + size <= block.size) {
+            mOffset = offset + size;
+            return block.data + offset;
+        }
+        mCurrentBlock++;
+        mOffset = 0;
+    }
+    // Blocks are allocated by operator new, so they are aligned
+    // for any type
+    Block block;
+    block.size = std::max(mBlockSize, size);
+    block.data = static_cast<char*>(::operator new(block.size));
+    mBlocks.push_back(block);
+    mCurrentBlock = mBlocks.size() - 1;
+    mOffset = size;
+    return block.data;
+}
+
+Arena::Marker Arena::mark() {
+    Marker marker;
+    marker.block = mCurrentBlock;
+    marker.offset = mOffset;
+    return marker;
+}
+
+void Arena::rewind(Marker marker) {
+    mCurrentBlock = marker.block;
+    mOffset = marker.offset;
+}
+
+void Arena::reset() {
+    if(mBlocks.size() > 1) {
+        size_t size = this->capacity();
+        for(Block& block : mBlocks)
+            ::operator delete(block.data);
+        mBlocks.clear();
+        Block block;
+        block.size = size;
+        block.data = static_cast<char*>(::operator new(size));
+        mBlocks.push_back(block);
+    }
+    mCurrentBlock = 0;
+    mOffset = 0;
+}
+
+size_t Arena::capacity() {
+    size_t size = 0;
+    for(Block& block : mBlocks)
+        size += block.size;
+    return size;
+}
+
+void InternIndex::clear() {
+    std::fill(mSlots.begin(), mSlots.end(), Slot());
+    mSize = 0;
+}
+
+size_t InternIndex::start(size_t hash, size_t mask) {
+    // Hashes of floats keep their entropy in the high bits
+    uint64_t mixed = (uint64_t)hash * 0x9E3779B97F4A7C15ull;
+    return (size_t)(mixed ^ (mixed >> 32)) & mask;
+}
+
+void InternIndex::insert(size_t hash, uint32_t index) {
+    // At most half full, so that probes stay short
+    if((mSize + 1) * 2 > mSlots.size())
+        this->grow();
+    size_t mask = mSlots.size() - 1;
+    size_t i = start(hash, mask);
+    while(mSlots[i].index != notFound)
+        i = (i + 1) & mask;
+    mSlots[i].hash = hash;
+    mSlots[i].index = index;
+    mSize++;
+}
+
+void InternIndex::grow() {
+    std::vector<Slot> slots(std::max((size_t)16, mSlots.size() * 2));
+    std::swap(slots, mSlots);
+    mSize = 0;
+    for(const Slot& slot : slots) {
+        if(slot.index != notFound)
+            this->insert(slot.hash, slot.index);
+    }
+}
+
+ArenaScope::ArenaScope(Arena* arena):
+    mArena(arena)
+{
+    if(mArena != nullptr)
+        mMarker = mArena->mark();
+}
+
+ArenaScope::~ArenaScope() {
+    if(mArena != nullptr)
+        mArena->rewind(mMarker);
+}
+
 namespace factory {
 
-ShapeMesh strokePolyline(std::vector<glm::vec2>& points, const float diameter) {
+TwoPolylines::TwoPolylines(Arena* arena):
+    first(arena), second(arena)
+{
+}
+
+ShapeMesh::ShapeMesh(Arena* arena):
+    vertices(arena), indices(arena), coverage(arena)
+{
+}
+
+CurveMesh::CurveMesh(Arena* arena):
+    vertices(arena), curveCoords(arena), indices(arena)
+{
+}
+
+ShapeMesh strokePolyline(Span<glm::vec2> points, const float diameter, Arena* arena) {
     float radius = diameter / 2.0f;
     size_t numPoints = points.size();
-    ShapeMesh mesh;
+    ShapeMesh mesh(arena);
     
     if(points.size() < 2)
         return mesh;
@@ -77,9 +406,71 @@ ShapeMesh strokePolyline(std::vector<glm::vec2>& points, const float diameter) {
     return mesh;
 }
 
-void ShapeMesh::add(ShapeMesh& b) {
+ShapeMesh featherPolyline(Span<glm::vec2> points, float offset, float width,
+                          bool isClosed, Arena* arena) {
+    ShapeMesh mesh(arena);
+    
+    // Zero-length segments have no direction, so repeated points are skipped
+    Polyline unique(arena);
+    unique.reserve(points.size());
+    for(const glm::vec2& point : points) {
+        if(unique.empty() || point != unique.back())
+            unique.push_back(point);
+    }
+    points = unique;
+    size_t numPoints = points.size();
+    
+    if(isClosed && numPoints > 2 && points.front() == points.back())
+        numPoints--;
+    if(numPoints < 2)
+        return mesh;
+    
+    size_t numBridges = isClosed ? numPoints : numPoints - 1;
+    mesh.vertices.resize(numPoints * 2);
+    mesh.coverage.resize(numPoints * 2);
+    mesh.indices.resize(numBridges * 2);
+    
+    for(size_t i = 0; i < numPoints; i++) {
+        bool isStart = !isClosed && i == 0;
+        bool isEnd = !isClosed && i == numPoints - 1;
+        
+        // Same directions as in strokePolyline, so the
+        // fringe of a stroke sticks to its edges
+        glm::vec2 currentPoint = points[i];
+        glm::vec2 backPoint = !isStart ? points[(i + numPoints - 1) % numPoints] : currentPoint;
+        glm::vec2 nextPoint = !isEnd   ? points[(i + 1) % numPoints] : currentPoint;
+        glm::vec2 forwardDir  = glm::normalize(nextPoint - currentPoint);
+        glm::vec2 backwardDir = glm::normalize(backPoint - currentPoint) * -1.0f;
+        glm::vec2 meanDir;
+        if (isStart) meanDir = forwardDir;
+        else if (isEnd) meanDir = backwardDir;
+        else meanDir = (forwardDir + backwardDir) / 2.0f;
+        glm::vec2 normal = glm::vec2(meanDir.y, -meanDir.x);
+        
+        mesh.vertices[i * 2] = currentPoint + normal * (offset - width / 2.0f);
+        mesh.vertices[i * 2 + 1] = currentPoint + normal * (offset + width / 2.0f);
+        mesh.coverage[i * 2] = 1.0f;
+        mesh.coverage[i * 2 + 1] = 0.0f;
+    }
+    for(size_t i = 0; i < numBridges; i++) {
+        int a = (int)(i * 2);
+        int b = (int)(((i + 1) % numPoints) * 2);
+        mesh.indices[i * 2] = TriangeIndices { a, a + 1, b };
+        mesh.indices[i * 2 + 1] = TriangeIndices { a + 1, b, b + 1 };
+    }
+    return mesh;
+}
+
+void ShapeMesh::add(const ShapeMesh& b) {
     int plusVertices = this->vertices.size();
     int plusIndices = this->indices.size();
+    if(!this->coverage.empty() || !b.coverage.empty()) {
+        this->coverage.resize(plusVertices, 1.0f);
+        if(b.coverage.empty())
+            this->coverage.resize(plusVertices + b.vertices.size(), 1.0f);
+        else
+            this->coverage.insert(this->coverage.end(), b.coverage.begin(), b.coverage.end());
+    }
     this->vertices.resize(this->vertices.size() + b.vertices.size());
     this->indices.resize(this->indices.size() + b.indices.size());
     for(int i = 0; i < b.vertices.size(); i++)
@@ -93,15 +484,16 @@ void ShapeMesh::add(ShapeMesh& b) {
     }
 }
 
-bool isCurvesCorrectForJoining(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b) {
+bool isCurvesCorrectForJoining(Span<glm::vec2> a, Span<glm::vec2> b) {
     if (a.size() < 2 || b.size() < 2)
         return false;
     return true;
 }
 
-ShapeMesh bevelJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const float diameter) {
+ShapeMesh bevelJoin(Span<glm::vec2> a, Span<glm::vec2> b, const float diameter,
+                    Arena* arena) {
     float radius = diameter / 2.0f;
-    ShapeMesh mesh;
+    ShapeMesh mesh(arena);
     
     if(!isCurvesCorrectForJoining(a, b))
         return mesh;
@@ -142,8 +534,9 @@ ShapeMesh bevelJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const
     return mesh;
 }
 
-std::vector<glm::vec2> quadraticBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, int segments) {
-    auto points = std::vector<glm::vec2>(segments);
+Polyline quadraticBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, int segments,
+                         Arena* arena) {
+    Polyline points(segments, arena);
     float step = 1.0f / (segments - 1);
     float t = 0.0f;
     for (int i = 0; i < segments; i++) {
@@ -156,8 +549,47 @@ std::vector<glm::vec2> quadraticBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2,
     return points;
 }
 
-std::vector<glm::vec2> cubicBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm::vec2 p3, int segments) {
-    auto points = std::vector<glm::vec2>(segments);
+static glm::vec2 getPointOnCubic(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm::vec2 p3,
+                                 float t) {
+    float s = 1.0f - t;
+    return p0 * (s * s * s) + p1 * (3.0f * s * s * t) + p2 * (3.0f * s * t * t) + p3 * (t * t * t);
+}
+
+static glm::vec2 cubicDerivative(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm::vec2 p3,
+                                 float t) {
+    float s = 1.0f - t;
+    return (p1 - p0) * (3.0f * s * s) + (p2 - p1) * (6.0f * s * t) + (p3 - p2) * (3.0f * t * t);
+}
+
+ArenaVector<QuadraticCurve> cubicToQuadratics(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2,
+                                              glm::vec2 p3, float tolerance,
+                                              Arena* arena) {
+    // Error of the midpoint approximation falls with the cube of the
+    // number of pieces
+    float error = sqrtf(3.0f) / 36.0f * glm::length(p3 - p2 * 3.0f + p1 * 3.0f - p0);
+    int numPieces = (int)ceilf(cbrtf(error / tolerance));
+    numPieces = std::min(std::max(numPieces, 1), 32);
+    
+    ArenaVector<QuadraticCurve> curves(numPieces, arena);
+    for(int i = 0; i < numPieces; i++) {
+        float t0 = (float)i / numPieces;
+        float t1 = (float)(i + 1) / numPieces;
+        // Control points of the piece from t0 to t1
+        glm::vec2 a = getPointOnCubic(p0, p1, p2, p3, t0);
+        glm::vec2 d = getPointOnCubic(p0, p1, p2, p3, t1);
+        float length = t1 - t0;
+        glm::vec2 b = a + cubicDerivative(p0, p1, p2, p3, t0) * (length / 3.0f);
+        glm::vec2 c = d - cubicDerivative(p0, p1, p2, p3, t1) * (length / 3.0f);
+        curves[i].start = a;
+        curves[i].control = ((b + c) * 3.0f - a - d) / 4.0f;
+        curves[i].end = d;
+    }
+    return curves;
+}
+
+Polyline cubicBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm::vec2 p3, int segments,
+                     Arena* arena) {
+    Polyline points(segments, arena);
     float step = 1.0f / (segments - 1);
     float t = 0.0f;
     for (int i = 0; i < segments; i++) {
@@ -173,9 +605,68 @@ std::vector<glm::vec2> cubicBezier(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2, glm
     return points;
 }
 
-std::vector<TriangeIndices> createIndicesConvex(int numVertices) {
+glm::mat3 segmentQuad(const Segment& segment) {
+    glm::vec2 direction = segment.end - segment.start;
+    float length = glm::length(direction);
+    glm::vec2 normal = length > 0.0f ? glm::vec2(-direction.y, direction.x) / length
+                                     : glm::vec2(0.0f, 1.0f);
+    normal *= segment.width;
+    return glm::mat3(glm::vec3(direction, 0.0f),
+                     glm::vec3(normal, 0.0f),
+                     glm::vec3(segment.start - normal / 2.0f, 1.0f));
+}
+
+glm::mat3 rectQuad(const Rect& rect) {
+    return glm::mat3(glm::vec3(rect.width, 0.0f, 0.0f),
+                     glm::vec3(0.0f, rect.height, 0.0f),
+                     glm::vec3(rect.x, rect.y, 1.0f));
+}
+
+glm::mat3 pointQuad(const Point& point) {
+    return glm::mat3(glm::vec3(point.size, 0.0f, 0.0f),
+                     glm::vec3(0.0f, point.size, 0.0f),
+                     glm::vec3(point.position - point.size / 2.0f, 1.0f));
+}
+
+static const glm::vec2 unitQuadVertices[] = {
+    glm::vec2(0.0f, 0.0f),
+    glm::vec2(1.0f, 0.0f),
+    glm::vec2(1.0f, 1.0f),
+    glm::vec2(0.0f, 1.0f)
+};
+
+// Same as createIndicesConvex(4)
+static const TriangeIndices unitQuadIndices[] = {
+    { 0, 1, 2 },
+    { 0, 2, 3 }
+};
+
+ShapeMesh unitQuad(Arena* arena) {
+    ShapeMesh mesh(arena);
+    mesh.vertices.assign(std::begin(unitQuadVertices), std::end(unitQuadVertices));
+    mesh.indices.assign(std::begin(unitQuadIndices), std::end(unitQuadIndices));
+    return mesh;
+}
+
+ShapeMesh quads(const glm::mat3* transforms, size_t count, Arena* arena) {
+    ShapeMesh mesh(arena);
+    mesh.vertices.resize(count * 4);
+    mesh.indices.resize(count * 2);
+    for(size_t i = 0; i < count; i++) {
+        for(int j = 0; j < 4; j++)
+            mesh.vertices[i * 4 + j] = transforms[i] * glm::vec3(unitQuadVertices[j], 1.0f);
+        for(int j = 0; j < 2; j++) {
+            TriangeIndices tri = unitQuadIndices[j];
+            int offset = (int)(i * 4);
+            mesh.indices[i * 2 + j] = TriangeIndices { tri.a + offset, tri.b + offset, tri.c + offset };
+        }
+    }
+    return mesh;
+}
+
+ArenaVector<TriangeIndices> createIndicesConvex(int numVertices, Arena* arena) {
     size_t amount = numVertices - 2;
-    auto indices = std::vector<TriangeIndices>(amount);
+    ArenaVector<TriangeIndices> indices(amount, arena);
     int k = 1;
     for (size_t i = 0; i < amount; i++)
     {
@@ -189,17 +680,26 @@ std::vector<TriangeIndices> createIndicesConvex(int numVertices) {
     return indices;
 }
 
-std::vector<glm::vec2> createArc(float startAngle, float endAngle, float radius, int segments, glm::vec2 offset) {
-    auto arcVerts = std::vector<glm::vec2>(segments);
+// Appends the points of the arc, so that joins and caps put
+// them right after their center
+static void appendArc(Polyline& points, float startAngle, float endAngle, float radius,
+                      int segments, glm::vec2 offset) {
     float angle = startAngle;
     float arcLength = endAngle - startAngle;
     for (int i = 0; i <= segments - 1; i++) {
         float x = sin(angle) * radius;
         float y = cos(angle) * radius;
 
-        arcVerts[i] = glm::vec2(x, y) + offset;
+        points.push_back(glm::vec2(x, y) + offset);
         angle += arcLength / (segments - 1);
     }
+}
+
+Polyline createArc(float startAngle, float endAngle, float radius, int segments,
+                   glm::vec2 offset, Arena* arena) {
+    Polyline arcVerts(arena);
+    arcVerts.reserve(segments);
+    appendArc(arcVerts, startAngle, endAngle, radius, segments, offset);
     return arcVerts;
 }
 
@@ -217,9 +717,10 @@ float positiveAngle(float angle) {
     return angle;
 }
 
-ShapeMesh roundJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const float diameter) {
+ShapeMesh roundJoin(Span<glm::vec2> a, Span<glm::vec2> b, const float diameter,
+                    Arena* arena) {
     float radius = diameter / 2.0f;
-    ShapeMesh mesh;
+    ShapeMesh mesh(arena);
     
     if(!isCurvesCorrectForJoining(a, b))
         return mesh;
@@ -240,9 +741,8 @@ ShapeMesh roundJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const
     float angle = glm::orientedAngle(dirA, dirB);
     
     static const int numCurveSegments = 32;
-    mesh.vertices.resize(1);
-    mesh.vertices.at(0) = center;
-    std::vector<glm::vec2> curve;
+    mesh.vertices.reserve(1 + numCurveSegments);
+    mesh.vertices.push_back(center);
     float start = 0;
     float end = 0;
     
@@ -260,17 +760,13 @@ ShapeMesh roundJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const
     }
     
     glm::vec2 meanOnArc = meanPointOnArc(start, end, radius);
-    if(glm::dot(glm::normalize(meanOnArc), up) >= 0) {
-        curve = createArc(start, end, radius, 32, center);
-    } else {
+    if(glm::dot(glm::normalize(meanOnArc), up) < 0) {
         // if arc is inverted
         start = positiveAngle(start);
         end = positiveAngle(end);
-        curve = createArc(start, end, radius, 32, center);
     }
-    mesh.vertices.insert(mesh.vertices.end(), curve.begin(), curve.end());
-    std::vector<TriangeIndices> tris = createIndicesConvex(mesh.vertices.size());
-    mesh.indices.insert(mesh.indices.end(), tris.begin(), tris.end());
+    appendArc(mesh.vertices, start, end, radius, numCurveSegments, center);
+    mesh.indices = createIndicesConvex(mesh.vertices.size(), arena);
     
     return mesh;
 }
@@ -299,10 +795,10 @@ glm::vec2 LineLineIntersection(glm::vec2 v1, glm::vec2 v2, glm::vec2 v3, glm::ve
     return EliminationLineLineIntersection(v1, v2, v3, v4);
 }
 
-ShapeMesh miterJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const float diameter,
-                    float miterLimitAngle) {
+ShapeMesh miterJoin(Span<glm::vec2> a, Span<glm::vec2> b, const float diameter,
+                    float miterLimitAngle, Arena* arena) {
     float radius = diameter / 2.0f;
-    ShapeMesh mesh;
+    ShapeMesh mesh(arena);
     
     if(!isCurvesCorrectForJoining(a, b))
         return mesh;
@@ -314,7 +810,7 @@ ShapeMesh miterJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const
     float angle = glm::orientedAngle(dirA, dirB);
     
     if (fabsf(angle) > miterLimitAngle)
-        return bevelJoin(a, b, diameter);
+        return bevelJoin(a, b, diameter, arena);
     
     glm::vec2 Ad = glm::vec2(dirA.y, -dirA.x) * radius;
     glm::vec2 Bd = -Ad;
@@ -344,16 +840,15 @@ ShapeMesh miterJoin(std::vector<glm::vec2>& a, std::vector<glm::vec2>& b, const
     // 1---2
     //  \ /
     //   3
-    std::vector<TriangeIndices> tris = {
+    mesh.indices = {
         { 0, 1, 2 },
         { 1, 2, 3 }
     };
-    mesh.indices.insert(mesh.indices.end(), tris.begin(), tris.end());
     
     return mesh;
 }
 
-glm::vec2 getPointAtT(std::vector<glm::vec2>& points, float t) {
+glm::vec2 getPointAtT(Span<glm::vec2> points, float t) {
     if (points.size() == 0)
         return glm::vec2(0.0f);
     if (t <= 0)
@@ -368,15 +863,19 @@ glm::vec2 getPointAtT(std::vector<glm::vec2>& points, float t) {
     return glm::mix(points.at(segmentIdx), points.at(segmentIdx + 1), segmentT);
 }
 
-TwoPolylines dividePolyline(std::vector<glm::vec2>& points, float t) {
-    TwoPolylines twoLines;
+// Writes into buffers that dashing reuses for every dash. Neither
+// of them may be the points
+static void dividePolylineInto(Span<glm::vec2> points, float t,
+                               Polyline& first, Polyline& second) {
+    first.clear();
+    second.clear();
     if (t <= 0) {
-        twoLines.second = points;
-        return twoLines;
+        second.assign(points.begin(), points.end());
+        return;
     }
     if (t >= 1) {
-        twoLines.first = points;
-        return twoLines;
+        first.assign(points.begin(), points.end());
+        return;
     }
     float remapedT = t * (float)(points.size() - 1);
     int segmentIdx = (int)floorf(remapedT);
@@ -384,22 +883,20 @@ TwoPolylines dividePolyline(std::vector<glm::vec2>& points, float t) {
     
     glm::vec2 pointAtT = glm::mix(points.at(segmentIdx), points.at(segmentIdx + 1), segmentT);
     
-    twoLines.first.resize(segmentIdx + 2);
-    for (int i = 0; i < segmentIdx + 1; i++) {
-        twoLines.first.at(i) = points.at(i);
-    }
-    twoLines.first.at(segmentIdx + 1) = pointAtT;
-    
-    twoLines.second.resize(points.size() - segmentIdx);
-    for (int i = 1; i < twoLines.second.size(); i++){
-        twoLines.second.at(i) = points.at(segmentIdx + i);
-    }
-    twoLines.second.at(0) = pointAtT;
+    first.assign(points.begin(), points.begin() + segmentIdx + 1);
+    first.push_back(pointAtT);
     
+    second.assign(points.begin() + segmentIdx, points.end());
+    second.at(0) = pointAtT;
+}
+
+TwoPolylines dividePolyline(Span<glm::vec2> points, float t, Arena* arena) {
+    TwoPolylines twoLines(arena);
+    dividePolylineInto(points, t, twoLines.first, twoLines.second);
     return twoLines;
 }
 
-float lengthOfPolyline(std::vector<glm::vec2>& points) {
+float lengthOfPolyline(Span<glm::vec2> points) {
     if (points.size() < 2)
         return 0.0f;
 
@@ -412,16 +909,20 @@ float lengthOfPolyline(std::vector<glm::vec2>& points) {
     return length;
 }
 
-std::vector<float> measurePolyline(std::vector<glm::vec2>& points) {
-    std::vector<float> lengths;
+static void measurePolylineInto(Span<glm::vec2> points, ArenaVector<float>& lengths) {
     lengths.resize(points.size() - 1); // number of segments
     for (size_t i = 0; i < lengths.size(); i++) {
         lengths.at(i) = glm::distance(points.at(i), points.at(i + 1LL));
     }
+}
+
+ArenaVector<float> measurePolyline(Span<glm::vec2> points, Arena* arena) {
+    ArenaVector<float> lengths(arena);
+    measurePolylineInto(points, lengths);
     return lengths;
 }
 
-float tAtLength(float length, std::vector<float>& lengths) {
+float tAtLength(float length, Span<float> lengths) {
     size_t pointBeforeLength = 0;
     float previousLength = 0.0f;
     float currentLength = 0.0f;
@@ -439,8 +940,8 @@ float tAtLength(float length, std::vector<float>& lengths) {
     return t;
 }
 
-std::vector<float> divideDashRight(std::vector<float>& dash, float l) {
-    std::vector<float> newDash;
+ArenaVector<float> divideDashRight(Span<float> dash, float l, Arena* arena) {
+    ArenaVector<float> newDash(arena);
     float currentLength = 0;
     float currentNumber;
     for(int i = dash.size() - 1; i >= 0; i--) {
@@ -462,14 +963,18 @@ std::vector<float> divideDashRight(std::vector<float>& dash, float l) {
     return newDash;
 }
 
-std::vector<std::vector<glm::vec2>> dashedPolylineNew(std::vector<glm::vec2>& points,
-                                                   std::vector<float>& dash,
-                                                      float offset) {
-    std::vector<std::vector<glm::vec2>> lines;
-    std::vector<glm::vec2> currentPath = points;
+Polylines dashedPolylineNew(Span<glm::vec2> points, Span<float> dash, float offset,
+                            Arena* arena) {
+    BVG_TRACE_ZONE("dashedPolylineNew");
+    Polylines lines(arena);
+    // Every dash reuses the same buffers
+    Polyline currentPath(points.begin(), points.end(), arena);
+    Polyline first(arena), second(arena);
+    ArenaVector<float> lengths(arena);
     
     if(dash.size() < 2) {
-        return { currentPath };
+        lines.push_back(currentPath);
+        return lines;
     }
     
     float fullLength = 0;
@@ -481,13 +986,14 @@ std::vector<std::vector<glm::vec2>> dashedPolylineNew(std::vector<glm::vec2>& po
     if(offset < 0)
         localOffset = fullLength - localOffset;
     
-    std::vector<float> startDash;
-    std::vector<float>* curDash = &startDash;
+    ArenaVector<float> startDash(arena);
+    Span<float> curDash = startDash;
     
     if(offset == 0) {
-        curDash = &dash;
+        curDash = dash;
     } else {
-        startDash = divideDashRight(dash, localOffset);
+        startDash = divideDashRight(dash, localOffset, arena);
+        curDash = startDash;
     }
     
     bool isStartTooShort = true;
@@ -498,121 +1004,130 @@ std::vector<std::vector<glm::vec2>> dashedPolylineNew(std::vector<glm::vec2>& po
         }
     }
     if(isStartTooShort)
-        curDash = &dash;
+        curDash = dash;
     
     int dashIndex = 0;
     static const int maxDashes = 999;
     for(int i = 0; i < maxDashes; i++) {
         float dashLength, gapLength;
-        dashLength = curDash->at(dashIndex);
-        gapLength = curDash->at(dashIndex + 1);
+        dashLength = curDash.at(dashIndex);
+        gapLength = curDash.at(dashIndex + 1);
         
-        std::vector<float> lengths = measurePolyline(currentPath);
+        measurePolylineInto(currentPath, lengths);
         
         if(dashLength == 0) {
-            currentPath = dividePolyline(currentPath, tAtLength(gapLength, lengths)).second;
+            dividePolylineInto(currentPath, tAtLength(gapLength, lengths), first, second);
+            currentPath.swap(second);
             if(currentPath.size() < 2)
                 break;
         } else {
-            TwoPolylines twoPathes = dividePolyline(currentPath, tAtLength(dashLength, lengths));
-            if(twoPathes.first.size() < 2)
+            dividePolylineInto(currentPath, tAtLength(dashLength, lengths), first, second);
+            if(first.size() < 2)
                 break;
-            lines.push_back(twoPathes.first);
-            if(twoPathes.second.size() < 2)
+            lines.push_back(first);
+            if(second.size() < 2)
                 break;
-            std::vector<float> secondLengths = measurePolyline(twoPathes.second);
-            currentPath = dividePolyline(twoPathes.second, tAtLength(gapLength,
-                                                                     secondLengths)).second;
+            measurePolylineInto(second, lengths);
+            dividePolylineInto(second, tAtLength(gapLength, lengths), first, currentPath);
             if(currentPath.size() < 2)
                 break;
         }
         dashIndex+=2;
-        if(dashIndex + 1 >= curDash->size()) {
-            curDash = &dash;
+        if(dashIndex + 1 >= curDash.size()) {
+            curDash = dash;
             dashIndex = 0;
         }
     }
     
     if(lines.size() == 0)
-        return { currentPath };
+        lines.push_back(currentPath);
     
     return lines;
 }
 
-std::vector<std::vector<glm::vec2>> dashedPolyline(std::vector<glm::vec2>& points,
-                                                   float dashLength, float gapLength,
-                                                   float offset) {
-    std::vector<std::vector<glm::vec2>> lines;
-    std::vector<glm::vec2> currentPath = points;
+Polylines dashedPolyline(Span<glm::vec2> points, float dashLength, float gapLength,
+                         float offset, Arena* arena) {
+    BVG_TRACE_ZONE("dashedPolyline");
+    Polylines lines(arena);
+    // Every dash reuses the same buffers
+    Polyline currentPath(points.begin(), points.end(), arena);
+    Polyline first(arena), second(arena);
+    ArenaVector<float> lengths(arena);
     
     float dashGapLength = dashLength + gapLength;
     float offsetTimes = floorf(fabsf(offset) / dashGapLength);
     float localOffset = fabsf(offset) - offsetTimes * dashGapLength;
     if(offset > 0) {
-        std::vector<float> lengths = measurePolyline(currentPath);
+        measurePolylineInto(currentPath, lengths);
         if(localOffset > gapLength) {
             float startDashLength = localOffset - gapLength;
-            lines.push_back(dividePolyline(currentPath, tAtLength(startDashLength, lengths)).first);
+            dividePolylineInto(currentPath, tAtLength(startDashLength, lengths), first, second);
+            lines.push_back(first);
         }
-        currentPath = dividePolyline(currentPath, tAtLength(localOffset, lengths)).second;
+        dividePolylineInto(currentPath, tAtLength(localOffset, lengths), first, second);
+        currentPath.swap(second);
     }
     else if(offset < 0) {
-        std::vector<float> lengths = measurePolyline(currentPath);
+        measurePolylineInto(currentPath, lengths);
         if(localOffset < dashLength) {
             float startDashLength = dashLength - localOffset;
-            lines.push_back(dividePolyline(currentPath, tAtLength(startDashLength, lengths)).first);
+            dividePolylineInto(currentPath, tAtLength(startDashLength, lengths), first, second);
+            lines.push_back(first);
         }
-        currentPath = dividePolyline(currentPath, tAtLength(dashGapLength - localOffset,
-                                                            lengths)).second;
+        dividePolylineInto(currentPath, tAtLength(dashGapLength - localOffset, lengths),
+                           first, second);
+        currentPath.swap(second);
     }
+    // The offset can take the whole polyline when it is shorter than the pattern
+    if(currentPath.size() < 2)
+        return lines;
     
     static const int maxDashes = 999;
     for(int i = 0; i < maxDashes; i++) {
-        std::vector<float> lengths = measurePolyline(currentPath);
-        TwoPolylines twoPathes = dividePolyline(currentPath, tAtLength(dashLength, lengths));
-        if(twoPathes.first.size() < 2)
+        measurePolylineInto(currentPath, lengths);
+        dividePolylineInto(currentPath, tAtLength(dashLength, lengths), first, second);
+        if(first.size() < 2)
             break;
-        lines.push_back(twoPathes.first);
-        if(twoPathes.second.size() < 2)
+        lines.push_back(first);
+        if(second.size() < 2)
             break;
-        std::vector<float> secondLengths = measurePolyline(twoPathes.second);
-        currentPath = dividePolyline(twoPathes.second, tAtLength(gapLength, secondLengths)).second;
+        measurePolylineInto(second, lengths);
+        dividePolylineInto(second, tAtLength(gapLength, lengths), first, currentPath);
         if(currentPath.size() < 2)
             break;
     }
     return lines;
 }
 
-ShapeMesh roundedCap(glm::vec2 position, glm::vec2 direction, const float diameter) {
+ShapeMesh roundedCap(glm::vec2 position, glm::vec2 direction, const float diameter,
+                     Arena* arena) {
     float radius = diameter / 2.0f;
-    ShapeMesh mesh;
+    ShapeMesh mesh(arena);
     
     glm::vec2 Ad = glm::vec2(direction.y, -direction.x) * radius;
     glm::vec2 Bd = -Ad;
     
     static const int numCurveSegments = 32;
-    mesh.vertices.resize(1);
-    mesh.vertices.at(0) = position;
+    mesh.vertices.reserve(1 + numCurveSegments);
+    mesh.vertices.push_back(position);
     
     float dirAngle = atan2f(direction.x, direction.y);
     float start = glm::orientedAngle(direction, Ad) + dirAngle;
     float end = glm::orientedAngle(direction, Bd) + dirAngle + 0.15f;
     
-    std::vector<glm::vec2> curve = createArc(start, end, radius, 32, position);
-    mesh.vertices.insert(mesh.vertices.end(), curve.begin(), curve.end());
-    
-    std::vector<TriangeIndices> tris = createIndicesConvex(mesh.vertices.size());
-    mesh.indices.insert(mesh.indices.end(), tris.begin(), tris.end());
+    appendArc(mesh.vertices, start, end, radius, numCurveSegments, position);
+    mesh.indices = createIndicesConvex(mesh.vertices.size(), arena);
     
     return mesh;
 }
 
-ShapeMesh squareCap(glm::vec2 position, glm::vec2 direction, const float diameter) {
-    std::vector<glm::vec2> points {
+ShapeMesh squareCap(glm::vec2 position, glm::vec2 direction, const float diameter,
+                    Arena* arena) {
+    glm::vec2 points[] = {
         position,
         position + glm::normalize(direction) * diameter
     };
-    return strokePolyline(points, diameter);
+    return strokePolyline(Span<glm::vec2>(points, 2), diameter, arena);
 }
 
 } // namespace factory
@@ -636,6 +1151,42 @@ Color Color::lerp(Color a, Color b, float t) {
     return c;
 }
 
+Instance::Instance(glm::mat3 matrix, Color color):
+    matrix(matrix), color(color)
+{
+}
+
+Instance::Instance()
+{
+}
+
+Segment::Segment(glm::vec2 start, glm::vec2 end, float width, Color color):
+    start(start), end(end), width(width), color(color)
+{
+}
+
+Segment::Segment()
+{
+}
+
+Rect::Rect(float x, float y, float width, float height, Color color):
+    x(x), y(y), width(width), height(height), color(color)
+{
+}
+
+Rect::Rect()
+{
+}
+
+Point::Point(glm::vec2 position, float size, Color color):
+    position(position), size(size), color(color)
+{
+}
+
+Point::Point()
+{
+}
+
 LineDash::LineDash()
     : length(10.0f), gapLength(0.0f), offset(0.0f)
 {
@@ -645,10 +1196,47 @@ LineDash::LineDash(float length, float gapLength, float offset)
 {
 }
 
+ColorStop::ColorStop(float offset, Color color):
+    offset(offset), color(color)
+{
+}
+
 Style::Style()
 {
 }
 
+std::vector<ColorStop> Style::colorStops() const {
+    if(!this->stops.empty())
+        return this->stops;
+    switch(this->type) {
+        case Type::LinearGradient:
+            return { ColorStop(0.0f, linear.startColor), ColorStop(1.0f, linear.endColor) };
+        case Type::RadialGradient:
+            return { ColorStop(0.0f, radial.startColor), ColorStop(1.0f, radial.endColor) };
+        case Type::ConicGradient:
+            return { ColorStop(0.0f, conic.startColor), ColorStop(1.0f, conic.endColor) };
+        default:
+            return { ColorStop(0.0f, color) };
+    }
+}
+
+bool Style::isOpaque() const {
+    if(this->type == Type::SolidColor)
+        return this->color.a >= 1.0f;
+    for(const ColorStop& stop : this->colorStops()) {
+        if(stop.color.a < 1.0f)
+            return false;
+    }
+    return true;
+}
+
+static void sortStops(std::vector<ColorStop>& stops) {
+    assert(!stops.empty());
+    std::stable_sort(stops.begin(), stops.end(), [](const ColorStop& a, const ColorStop& b) {
+        return a.offset < b.offset;
+    });
+}
+
 Style SolidColor(Color color) {
     Style style;
     style.type = Style::Type::SolidColor;
@@ -690,11 +1278,36 @@ Style ConicGradient(float x, float y, float angle, Color start, Color end) {
     return style;
 }
 
-Context::Context(float width, float height) {
+Style LinearGradient(float sx, float sy, float ex, float ey, std::vector<ColorStop> stops) {
+    sortStops(stops);
+    Style style = LinearGradient(sx, sy, ex, ey, stops.front().color, stops.back().color);
+    style.stops = std::move(stops);
+    return style;
+}
+
+Style RadialGradient(float x, float y, float radius, std::vector<ColorStop> stops) {
+    sortStops(stops);
+    Style style = RadialGradient(x, y, radius, stops.front().color, stops.back().color);
+    style.stops = std::move(stops);
+    return style;
+}
+
+Style ConicGradient(float x, float y, float angle, std::vector<ColorStop> stops) {
+    sortStops(stops);
+    Style style = ConicGradient(x, y, angle, stops.front().color, stops.back().color);
+    style.stops = std::move(stops);
+    return style;
+}
+
+Context::Context(float width, float height):
+    mPolylines(&mPathArena)
+{
     this->orthographic(width, height);
+    this->mStates.reserve(64);
 }
 
-Context::Context()
+Context::Context():
+    mPolylines(&mPathArena)
 {
 }
 
@@ -710,11 +1323,42 @@ void Context::beginDrawing() {
         exit(-1);
     }
     this->mDrawingBegan = true;
+    this->mFrameStartAllocations = threadAllocations();
+    this->mFrameStats = FrameStats();
     this->mShapeDrawCounter = 0;
+    this->mStates.clear();
+    this->mArena.reset();
+    this->mScratchArena.reset();
+    // Saved states are gone, so nothing refers to the interned values
+    this->mNumInternedStyles = 0;
+    this->mInternedStyleIndices.clear();
+    this->mNumInternedDashes = 0;
+    this->mInternedDashIndices.clear();
+    this->uploadPendingFonts(false);
 }
 
 void Context::endDrawing() {
     this->mDrawingBegan = false;
+    mFrameAllocations = threadAllocations() - mFrameStartAllocations;
+    mFrameStats.allocations = mFrameAllocations;
+    mFrameStats.bytesUploaded += mFrameAllocations.bufferBytes;
+    mLastFrameStats = mFrameStats;
+    if(this->enforceAllocationBudget && mFrameAllocations.exceeds(this->allocationBudget)) {
+        std::cerr << "blazevg: Error: frame exceeded the allocation budget: " <<
+            mFrameAllocations.heapAllocations << " heap allocations (" <<
+            mFrameAllocations.heapBytes << " bytes), " <<
+            mFrameAllocations.bufferCreations << " buffers, " <<
+            mFrameAllocations.pipelineStateCreations << " pipeline states" << std::endl;
+        exit(-1);
+    }
+}
+
+AllocationStats Context::frameAllocations() {
+    return mFrameAllocations;
+}
+
+FrameStats Context::frameStats() {
+    return mLastFrameStats;
 }
 
 float round3f(float t) {
@@ -729,8 +1373,169 @@ bool isApproxEqualVec2(glm::vec2 a, glm::vec2 b) {
     return a1 == b1 && a2 == b2;
 }
 
+static bool isEqualColor(const Color& a, const Color& b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static size_t hashColor(size_t hash, const Color& color) {
+    std::hash<float> hashFloat;
+    hash = hash * 31 + hashFloat(color.r);
+    hash = hash * 31 + hashFloat(color.g);
+    hash = hash * 31 + hashFloat(color.b);
+    hash = hash * 31 + hashFloat(color.a);
+    return hash;
+}
+
+static bool isEqualStyle(const Style& a, const Style& b) {
+    if(a.type != b.type || a.stops.size() != b.stops.size())
+        return false;
+    for(size_t i = 0; i < a.stops.size(); i++) {
+        if(a.stops[i].offset != b.stops[i].offset ||
+           !isEqualColor(a.stops[i].color, b.stops[i].color))
+            return false;
+    }
+    switch(a.type) {
+        case Style::Type::SolidColor:
+            return isEqualColor(a.color, b.color);
+        case Style::Type::LinearGradient:
+            return isEqualColor(a.linear.startColor, b.linear.startColor) &&
+                isEqualColor(a.linear.endColor, b.linear.endColor) &&
+                a.linear.startX == b.linear.startX && a.linear.startY == b.linear.startY &&
+                a.linear.endX == b.linear.endX && a.linear.endY == b.linear.endY;
+        case Style::Type::RadialGradient:
+            return isEqualColor(a.radial.startColor, b.radial.startColor) &&
+                isEqualColor(a.radial.endColor, b.radial.endColor) &&
+                a.radial.x == b.radial.x && a.radial.y == b.radial.y &&
+                a.radial.radius == b.radial.radius;
+        case Style::Type::ConicGradient:
+            return isEqualColor(a.conic.startColor, b.conic.startColor) &&
+                isEqualColor(a.conic.endColor, b.conic.endColor) &&
+                a.conic.x == b.conic.x && a.conic.y == b.conic.y &&
+                a.conic.angle == b.conic.angle;
+    }
+    return false;
+}
+
+static size_t hashStyle(const Style& style) {
+    std::hash<float> hashFloat;
+    size_t hash = (size_t)style.type;
+    switch(style.type) {
+        case Style::Type::SolidColor:
+            hash = hashColor(hash, style.color);
+            break;
+        case Style::Type::LinearGradient:
+            hash = hashColor(hashColor(hash, style.linear.startColor), style.linear.endColor);
+            hash = hash * 31 + hashFloat(style.linear.startX);
+            hash = hash * 31 + hashFloat(style.linear.startY);
+            hash = hash * 31 + hashFloat(style.linear.endX);
+            hash = hash * 31 + hashFloat(style.linear.endY);
+            break;
+        case Style::Type::RadialGradient:
+            hash = hashColor(hashColor(hash, style.radial.startColor), style.radial.endColor);
+            hash = hash * 31 + hashFloat(style.radial.x);
+            hash = hash * 31 + hashFloat(style.radial.y);
+            hash = hash * 31 + hashFloat(style.radial.radius);
+            break;
+        case Style::Type::ConicGradient:
+            hash = hashColor(hashColor(hash, style.conic.startColor), style.conic.endColor);
+            hash = hash * 31 + hashFloat(style.conic.x);
+            hash = hash * 31 + hashFloat(style.conic.y);
+            hash = hash * 31 + hashFloat(style.conic.angle);
+            break;
+    }
+    for(const ColorStop& stop : style.stops)
+        hash = hashColor(hash * 31 + hashFloat(stop.offset), stop.color);
+    return hash;
+}
+
+uint32_t Context::internStyle(const Style& style) {
+    size_t hash = hashStyle(style);
+    uint32_t index = mInternedStyleIndices.find(hash, [&](uint32_t i) {
+        return isEqualStyle(mInternedStyles[i], style);
+    });
+    if(index != InternIndex::notFound)
+        return index;
+    index = mNumInternedStyles++;
+    // Assigning reuses the stops of the slot from an earlier frame
+    if(index < mInternedStyles.size())
+        mInternedStyles[index] = style;
+    else
+        mInternedStyles.push_back(style);
+    mInternedStyleIndices.insert(hash, index);
+    return index;
+}
+
+uint32_t Context::internLineDash(const LineDash& lineDash) {
+    std::hash<float> hashFloat;
+    size_t hash = hashFloat(lineDash.length);
+    hash = hash * 31 + hashFloat(lineDash.gapLength);
+    hash = hash * 31 + hashFloat(lineDash.offset);
+    for(float length : lineDash.dash)
+        hash = hash * 31 + hashFloat(length);
+    
+    uint32_t index = mInternedDashIndices.find(hash, [&](uint32_t i) {
+        const LineDash& other = mInternedDashes[i];
+        return other.length == lineDash.length && other.gapLength == lineDash.gapLength &&
+               other.offset == lineDash.offset && other.dash == lineDash.dash;
+    });
+    if(index != InternIndex::notFound)
+        return index;
+    index = mNumInternedDashes++;
+    if(index < mInternedDashes.size())
+        mInternedDashes[index] = lineDash;
+    else
+        mInternedDashes.push_back(lineDash);
+    mInternedDashIndices.insert(hash, index);
+    return index;
+}
+
+void Context::save() {
+    State state;
+    state.matrix = this->matrix;
+    state.blendingMode = this->blendingMode;
+    state.lineJoin = this->lineJoin;
+    state.lineCap = this->lineCap;
+    state.lineWidth = this->lineWidth;
+    state.blurRadius = this->blurRadius;
+    state.font = this->font;
+    state.fontSize = this->fontSize;
+    state.fillStyle = this->internStyle(this->fillStyle);
+    state.strokeStyle = this->internStyle(this->strokeStyle);
+    state.lineDash = this->internLineDash(this->lineDash);
+    state.clipDepth = this->clipDepth();
+    mStates.push_back(state);
+}
+
+void Context::restore() {
+    if(mStates.empty()) {
+        std::cerr << "blazevg: Error: restore() is called without save()" << std::endl;
+        exit(-1);
+    }
+    State& state = mStates.back();
+    this->matrix = state.matrix;
+    this->blendingMode = state.blendingMode;
+    this->lineJoin = state.lineJoin;
+    this->lineCap = state.lineCap;
+    this->lineWidth = state.lineWidth;
+    this->blurRadius = state.blurRadius;
+    this->font = state.font;
+    this->fontSize = state.fontSize;
+    // Assignment reuses the capacity of the stops and dash vectors
+    this->fillStyle = mInternedStyles[state.fillStyle];
+    this->strokeStyle = mInternedStyles[state.strokeStyle];
+    this->lineDash = mInternedDashes[state.lineDash];
+    while(this->clipDepth() > state.clipDepth)
+        this->popClip();
+    mStates.pop_back();
+}
+
 void Context::beginPath() {
-    this->mPolylines.clear();
+    this->mFrameStats.paths++;
+    // Polylines are dropped before their memory is reused
+    this->mPolylines = factory::Polylines(&mPathArena);
+    this->mPathArena.reset();
+    this->mCurves.clear();
+    this->mAnalyticShape = AnalyticShape();
     this->mIsPolylineClosed = false;
     this->mCurrentPos = glm::vec2(0.0f);
 }
@@ -745,12 +1550,12 @@ void Context::closePath() {
        this->mPolylines.front().front()))
         return;
     
-    std::vector<glm::vec2> line {
+    factory::Polyline line({
         this->mPolylines.back().back(),
         this->mPolylines.front().front()
-    };
+    }, &mPathArena);
     
-    this->mPolylines.push_back(line);
+    this->mPolylines.push_back(std::move(line));
 }
 
 void Context::moveTo(float x, float y) {
@@ -758,107 +1563,272 @@ void Context::moveTo(float x, float y) {
 }
 
 void Context::lineTo(float x, float y) {
-    std::vector<glm::vec2> line {
+    factory::Polyline line({
         mCurrentPos,
         glm::vec2(x, y)
-    };
-    mPolylines.push_back(line);
+    }, &mPathArena);
+    mFrameStats.flattenedPoints += line.size();
+    mPolylines.push_back(std::move(line));
     mCurrentPos = glm::vec2(x, y);
+    mAnalyticShape.type = AnalyticShape::Type::None;
 }
 
 void Context::cubicTo(float cp1x, float cp1y, float cp2x, float cp2y, float x, float y) {
-    std::vector<glm::vec2> curve = factory::cubicBezier(mCurrentPos,
-                                                        glm::vec2(cp1x, cp1y),
-                                                        glm::vec2(cp2x, cp2y),
-                                                        glm::vec2(x, y),
-                                                        32);
-    mPolylines.push_back(curve);
+    BVG_STATS_TIMER(mFrameStats.flatteningTime);
+    factory::Polyline curve = factory::cubicBezier(mCurrentPos,
+                                                   glm::vec2(cp1x, cp1y),
+                                                   glm::vec2(cp2x, cp2y),
+                                                   glm::vec2(x, y),
+                                                   32, &mPathArena);
+    {
+        ArenaScope scope(&mScratchArena);
+        ArenaVector<factory::QuadraticCurve> quadratics =
+            factory::cubicToQuadratics(mCurrentPos, glm::vec2(cp1x, cp1y), glm::vec2(cp2x, cp2y),
+                                       glm::vec2(x, y), curveTolerance, &mScratchArena);
+        for(factory::QuadraticCurve& quadratic : quadratics)
+            mCurves.push_back(PathCurve { mPolylines.size(), quadratic });
+    }
+    mFrameStats.flattenedPoints += curve.size();
+    mPolylines.push_back(std::move(curve));
     mCurrentPos = glm::vec2(x, y);
+    mAnalyticShape.type = AnalyticShape::Type::None;
 }
 
 void Context::quadraticTo(float cpx, float cpy, float x, float y) {
-    std::vector<glm::vec2> curve = factory::quadraticBezier(mCurrentPos,
-                                                        glm::vec2(cpx, cpy),
-                                                        glm::vec2(x, y),
-                                                        32);
-    mPolylines.push_back(curve);
+    BVG_STATS_TIMER(mFrameStats.flatteningTime);
+    factory::Polyline curve = factory::quadraticBezier(mCurrentPos,
+                                                       glm::vec2(cpx, cpy),
+                                                       glm::vec2(x, y),
+                                                       32, &mPathArena);
+    factory::QuadraticCurve quadratic { mCurrentPos, glm::vec2(cpx, cpy), glm::vec2(x, y) };
+    mCurves.push_back(PathCurve { mPolylines.size(), quadratic });
+    mFrameStats.flattenedPoints += curve.size();
+    mPolylines.push_back(std::move(curve));
     mCurrentPos = glm::vec2(x, y);
+    mAnalyticShape.type = AnalyticShape::Type::None;
 }
 
-std::vector<glm::vec2> Context::toOnePolyline(std::vector<std::vector<glm::vec2>> polylines) {
-    std::vector<glm::vec2> onePolyline;
+factory::Polyline Context::toOnePolyline(const factory::Polylines& polylines, Arena* arena) {
+    factory::Polyline onePolyline(arena);
     if(polylines.size() == 0)
         return onePolyline;
-    onePolyline = polylines.front();
+    size_t numPoints = 0;
+    for(const factory::Polyline& polyline : polylines)
+        numPoints += polyline.size();
+    onePolyline.reserve(numPoints);
+    onePolyline.assign(polylines.front().begin(), polylines.front().end());
     for(int i = 1; i < polylines.size(); i++) {
-        std::vector<glm::vec2> ongoing = polylines.at(i);
+        const factory::Polyline& ongoing = polylines.at(i);
+        auto first = ongoing.begin();
         
-        // Remove previous point (duplicate)
-        if(isApproxEqualVec2(onePolyline.back(), ongoing.front()))
-            ongoing.erase(ongoing.begin());
+        // Skip previous point (duplicate)
+        if(!ongoing.empty() && isApproxEqualVec2(onePolyline.back(), ongoing.front()))
+            first++;
         
-        onePolyline.insert(onePolyline.end(), ongoing.begin(), ongoing.end());
+        onePolyline.insert(onePolyline.end(), first, ongoing.end());
     }
     return onePolyline;
 }
 
 factory::ShapeMesh Context::internalConvexFill() {
-    factory::ShapeMesh mesh;
-    mesh.vertices = this->toOnePolyline(mPolylines);
-    mesh.indices = factory::createIndicesConvex(mesh.vertices.size());
+    BVG_TRACE_ZONE("internalConvexFill");
+    factory::ShapeMesh mesh(&mArena);
+    mesh.vertices = this->toOnePolyline(mPolylines, &mArena);
+    mesh.indices = factory::createIndicesConvex(mesh.vertices.size(), &mArena);
+    if(this->isFeathering())
+        this->featherFill(mesh);
+    mFrameStats.fill.add(mesh);
     return mesh;
 }
 
 factory::ShapeMesh Context::internalFill() {
-    factory::ShapeMesh mesh;
-    mesh.vertices = this->toOnePolyline(mPolylines);
-    mesh.indices = earcut::triangulate(mesh.vertices);
+    BVG_TRACE_ZONE("internalFill");
+    factory::ShapeMesh mesh(&mArena);
+    mesh.vertices = this->toOnePolyline(mPolylines, &mArena);
+    {
+        BVG_STATS_TIMER(mFrameStats.triangulationTime);
+        mesh.indices = earcut::triangulate(mesh.vertices, &mArena);
+    }
+    if(this->isFeathering())
+        this->featherFill(mesh);
+    mFrameStats.fill.add(mesh);
     return mesh;
 }
 
+factory::CurveMesh Context::internalCurveFill() {
+    BVG_TRACE_ZONE("internalCurveFill");
+    factory::CurveMesh mesh(&mArena);
+    ArenaScope scope(&mScratchArena);
+    
+    // Control points on the inner side of the outline are a part
+    // of the polygon, and curves on the outer side are added to it
+    factory::Polyline flattened = this->toOnePolyline(mPolylines, &mScratchArena);
+    float area = 0.0f;
+    for(size_t i = 0; i < flattened.size(); i++) {
+        glm::vec2 a = flattened[i];
+        glm::vec2 b = flattened[(i + 1) % flattened.size()];
+        area += a.x * b.y - b.x * a.y;
+    }
+    
+    factory::Polyline outline(&mScratchArena);
+    ArenaVector<glm::vec3>& curveCoords = mesh.curveCoords;
+    ArenaVector<factory::TriangeIndices>& curveIndices = mesh.indices;
+    size_t curveIndex = 0;
+    for(size_t i = 0; i < mPolylines.size(); i++) {
+        if(curveIndex >= mCurves.size() || mCurves[curveIndex].polyline != i) {
+            for(const glm::vec2& point : mPolylines[i]) {
+                if(outline.empty() || !isApproxEqualVec2(outline.back(), point))
+                    outline.push_back(point);
+            }
+            continue;
+        }
+        for(; curveIndex < mCurves.size() && mCurves[curveIndex].polyline == i; curveIndex++) {
+            factory::QuadraticCurve& curve = mCurves[curveIndex].curve;
+            glm::vec2 chord = curve.end - curve.start;
+            glm::vec2 toControl = curve.control - curve.start;
+            bool isInner = (chord.x * toControl.y - chord.y * toControl.x) * area > 0.0f;
+            
+            if(outline.empty() || !isApproxEqualVec2(outline.back(), curve.start))
+                outline.push_back(curve.start);
+            if(isInner)
+                outline.push_back(curve.control);
+            outline.push_back(curve.end);
+            
+            // Inner curves keep the side of the control point
+            float side = isInner ? -1.0f : 1.0f;
+            int first = (int)mesh.vertices.size();
+            mesh.vertices.push_back(curve.start);
+            mesh.vertices.push_back(curve.control);
+            mesh.vertices.push_back(curve.end);
+            curveCoords.push_back(glm::vec3(0.0f, 0.0f, side));
+            curveCoords.push_back(glm::vec3(0.5f, 0.0f, side));
+            curveCoords.push_back(glm::vec3(1.0f, 1.0f, side));
+            curveIndices.push_back(factory::TriangeIndices { first, first + 1, first + 2 });
+        }
+    }
+    
+    // Polygon is inside of the curve everywhere
+    int numCurveVertices = (int)mesh.vertices.size();
+    ArenaVector<factory::TriangeIndices> polygonIndices(&mScratchArena);
+    {
+        BVG_STATS_TIMER(mFrameStats.triangulationTime);
+        polygonIndices = earcut::triangulate(outline, &mScratchArena);
+    }
+    mesh.vertices.insert(mesh.vertices.end(), outline.begin(), outline.end());
+    curveCoords.resize(mesh.vertices.size(), glm::vec3(0.0f, 1.0f, 1.0f));
+    for(factory::TriangeIndices& tri : polygonIndices) {
+        curveIndices.push_back(factory::TriangeIndices { tri.a + numCurveVertices,
+                                                         tri.b + numCurveVertices,
+                                                         tri.c + numCurveVertices });
+    }
+    mFrameStats.fill.vertices += mesh.vertices.size();
+    mFrameStats.fill.triangles += mesh.indices.size();
+    return mesh;
+}
+
+float Context::pixelWidth() {
+    float scale = std::sqrt(std::abs(this->matrix[0][0] * this->matrix[1][1] -
+                                     this->matrix[1][0] * this->matrix[0][1]));
+    return 1.0f / std::max(scale * this->contentScale, 1e-6f);
+}
+
+bool Context::isFeathering() {
+    return this->antiAliasing == AntiAliasing::Feather;
+}
+
+void Context::featherFill(factory::ShapeMesh& mesh) {
+    Span<glm::vec2> outline = mesh.vertices;
+    if(outline.size() < 3)
+        return;
+    // The fringe goes outwards, which depends on the winding
+    float area = 0.0f;
+    for(size_t i = 0; i < outline.size(); i++) {
+        glm::vec2 a = outline[i];
+        glm::vec2 b = outline[(i + 1) % outline.size()];
+        area += a.x * b.y - b.x * a.y;
+    }
+    float width = area > 0.0f ? this->pixelWidth() : -this->pixelWidth();
+    ArenaScope scope(&mScratchArena);
+    // The fringe is built before the mesh grows and moves the outline
+    factory::ShapeMesh fringe = factory::featherPolyline(outline, 0.0f, width, true,
+                                                         &mScratchArena);
+    mesh.add(fringe);
+}
+
+factory::Polylines Context::dashPolylines() {
+    BVG_TRACE_ZONE("dashPolylines");
+    BVG_STATS_TIMER(mFrameStats.dashingTime);
+    factory::Polylines allPolylines(&mArena);
+    
+    float gapLength = this->lineDash.gapLength;
+    // Add extra space for line caps between
+    // two polylines
+    if(this->lineCap != LineCap::Butt)
+        gapLength += this->lineWidth;
+    
+    float currentLength = 0.0f;
+    
+    for(int i = 0; i < this->mPolylines.size(); i++) {
+        // Buffers of dashing are freed after every polyline, and
+        // only the dashes are copied out
+        ArenaScope scope(&mScratchArena);
+        factory::Polylines dashed(&mScratchArena);
+        if(this->lineDash.dash.size() > 1) {
+            dashed =
+                factory::dashedPolylineNew(this->mPolylines[i],
+                                        this->lineDash.dash,
+                                        this->lineDash.offset - currentLength,
+                                        &mScratchArena);
+        } else {
+            dashed =
+                factory::dashedPolyline(this->mPolylines[i],
+                                        this->lineDash.length,
+                                        gapLength,
+                                        this->lineDash.offset - currentLength,
+                                        &mScratchArena);
+        }
+        for(factory::Polyline& polyline : dashed)
+            allPolylines.emplace_back(polyline.begin(), polyline.end(), &mArena);
+        currentLength += factory::lengthOfPolyline(this->mPolylines[i]);
+    }
+    return allPolylines;
+}
+
+ArenaVector<float> Context::dashPattern(float& phase) {
+    ArenaVector<float> pattern(&mArena);
+    // Pattern of many dashes is shifted forward by the offset,
+    // and a single dash is shifted backward
+    if(this->lineDash.dash.size() > 1) {
+        pattern.assign(this->lineDash.dash.begin(), this->lineDash.dash.end());
+        phase = this->lineDash.offset;
+    } else {
+        float gapLength = this->lineDash.gapLength;
+        if(this->lineCap != LineCap::Butt)
+            gapLength += this->lineWidth;
+        pattern = { this->lineDash.length, gapLength };
+        phase = -this->lineDash.offset;
+    }
+    return pattern;
+}
+
 factory::ShapeMesh Context::internalStroke() {
-    factory::ShapeMesh mesh;
-    auto* allPolylines = &this->mPolylines;
+    BVG_TRACE_ZONE("internalStroke");
+    BVG_STATS_TIMER(mFrameStats.strokingTime);
+    factory::ShapeMesh mesh(&mArena);
+    factory::Polylines* allPolylines = &this->mPolylines;
     
     bool isLineDash = this->lineDash.gapLength != 0.0f;
     bool isStartEndTooClose = true;
+    factory::Polylines dashedPolylines(&mArena);
     if(isLineDash) {
-        allPolylines = new std::vector<std::vector<glm::vec2>>();
-        
-        float gapLength = this->lineDash.gapLength;
-        // Add extra space for line caps between
-        // two polylines
-        if(this->lineCap != LineCap::Butt)
-            gapLength += this->lineWidth;
-        
-        float currentLength = 0.0f;
-        
-        for(int i = 0; i < this->mPolylines.size(); i++) {
-            std::vector<std::vector<glm::vec2>> dashed;
-            if(this->lineDash.dash.size() > 1) {
-                dashed =
-                    factory::dashedPolylineNew(this->mPolylines[i],
-                                            this->lineDash.dash,
-                                            this->lineDash.offset - currentLength);
-            } else {
-                dashed =
-                    factory::dashedPolyline(this->mPolylines[i],
-                                            this->lineDash.length,
-                                            gapLength,
-                                            this->lineDash.offset - currentLength);
-            }
-            allPolylines->insert(allPolylines->end(), dashed.begin(), dashed.end());
-            currentLength += factory::lengthOfPolyline(this->mPolylines[i]);
-        }
+        dashedPolylines = this->dashPolylines();
+        allPolylines = &dashedPolylines;
         
         // If shape was closed and then dashed, it
         // isn't a fact that it's still closed, so
         // we need to make a check
         isStartEndTooClose = isApproxEqualVec2(allPolylines->front().front(),
                                                allPolylines->back().back());
-        
-        // Don't forget to free memory at the end
-        // of this function
     }
     
     bool isConnectedWithPrevious = false;
@@ -871,16 +1841,32 @@ factory::ShapeMesh Context::internalStroke() {
         if(!isConnectedWithPrevious)
             addStartCap = true;
         
-        std::vector<glm::vec2>& polyline = allPolylines->at(i);
-        factory::ShapeMesh polylineMesh = factory::strokePolyline(polyline, this->lineWidth);
+        // Parts are merged into the mesh and freed with the scope
+        ArenaScope scope(&mScratchArena);
+        factory::Polyline& polyline = allPolylines->at(i);
+        factory::ShapeMesh polylineMesh = factory::strokePolyline(polyline, this->lineWidth,
+                                                                  &mScratchArena);
         mesh.add(polylineMesh);
+        mFrameStats.stroke.add(polylineMesh);
+        if(this->isFeathering()) {
+            float radius = this->lineWidth / 2.0f;
+            float width = this->pixelWidth();
+            factory::ShapeMesh rightFringe = factory::featherPolyline(polyline, radius, width,
+                                                                      false, &mScratchArena);
+            factory::ShapeMesh leftFringe = factory::featherPolyline(polyline, -radius, -width,
+                                                                     false, &mScratchArena);
+            mesh.add(rightFringe);
+            mesh.add(leftFringe);
+            mFrameStats.stroke.add(rightFringe);
+            mFrameStats.stroke.add(leftFringe);
+        }
         if(!isLast || mIsPolylineClosed) {
-            std::vector<glm::vec2>* nextOrFirstPolyline;
+            factory::Polyline* nextOrFirstPolyline;
             if(mIsPolylineClosed && isLast)
                 nextOrFirstPolyline = &allPolylines->at(0);
             else
                 nextOrFirstPolyline = &allPolylines->at(i + 1);
-            std::vector<glm::vec2>& nextPolyline = *nextOrFirstPolyline;
+            factory::Polyline& nextPolyline = *nextOrFirstPolyline;
             // If next polyline is connected with current.
             // When we using bezier curves, the end tip coords
             // may vary in severay digits after floating point,
@@ -895,24 +1881,31 @@ factory::ShapeMesh Context::internalStroke() {
                     {
                         factory::ShapeMesh joinMesh = factory::miterJoin(polyline,
                                                                          nextPolyline,
-                                                                         this->lineWidth);
+                                                                         this->lineWidth,
+                                                                         M_PI_2 + M_PI_4,
+                                                                         &mScratchArena);
                         mesh.add(joinMesh);
+                        mFrameStats.join.add(joinMesh);
                     }
                         break;
                     case LineJoin::Round:
                     {
                         factory::ShapeMesh joinMesh = factory::roundJoin(polyline,
                                                                          nextPolyline,
-                                                                         this->lineWidth);
+                                                                         this->lineWidth,
+                                                                         &mScratchArena);
                         mesh.add(joinMesh);
+                        mFrameStats.join.add(joinMesh);
                     }
                         break;
                     case LineJoin::Bevel:
                     {
                         factory::ShapeMesh joinMesh = factory::bevelJoin(polyline,
                                                                          nextPolyline,
-                                                                         this->lineWidth);
+                                                                         this->lineWidth,
+                                                                         &mScratchArena);
                         mesh.add(joinMesh);
+                        mFrameStats.join.add(joinMesh);
                     }
                         break;
                     default:
@@ -946,15 +1939,19 @@ factory::ShapeMesh Context::internalStroke() {
                 case LineCap::Round:
                 {
                     factory::ShapeMesh capMesh = factory::roundedCap(pos, dir,
-                                                                     this->lineWidth);
+                                                                     this->lineWidth,
+                                                                     &mScratchArena);
                     mesh.add(capMesh);
+                    mFrameStats.cap.add(capMesh);
                 }
                     break;
                 case LineCap::Square:
                 {
                     factory::ShapeMesh capMesh = factory::squareCap(pos, dir,
-                                                                     this->lineWidth);
+                                                                    this->lineWidth,
+                                                                    &mScratchArena);
                     mesh.add(capMesh);
+                    mFrameStats.cap.add(capMesh);
                 }
                     break;
                 default:
@@ -969,15 +1966,19 @@ factory::ShapeMesh Context::internalStroke() {
                 case LineCap::Round:
                 {
                     factory::ShapeMesh capMesh = factory::roundedCap(pos, dir,
-                                                                     this->lineWidth);
+                                                                     this->lineWidth,
+                                                                     &mScratchArena);
                     mesh.add(capMesh);
+                    mFrameStats.cap.add(capMesh);
                 }
                     break;
                 case LineCap::Square:
                 {
                     factory::ShapeMesh capMesh = factory::squareCap(pos, dir,
-                                                                     this->lineWidth);
+                                                                    this->lineWidth,
+                                                                    &mScratchArena);
                     mesh.add(capMesh);
+                    mFrameStats.cap.add(capMesh);
                 }
                     break;
                 default:
@@ -985,12 +1986,121 @@ factory::ShapeMesh Context::internalStroke() {
             }
         }
     }
-    if(isLineDash) {
-        delete allPolylines;
-    }
     return mesh;
 }
 
+static void addStrokeJoin(ArenaVector<factory::StrokePart>& parts, LineJoin lineJoin,
+                          glm::vec2 a, glm::vec2 b, glm::vec2 c, float length) {
+    factory::StrokePart part;
+    part.length = length;
+    part.type = lineJoin == LineJoin::Round ? factory::StrokePart::Type::Round
+                                            : factory::StrokePart::Type::Join;
+    part.a = lineJoin == LineJoin::Round ? b : a;
+    part.b = b;
+    part.c = c;
+    parts.push_back(part);
+}
+
+static void addStrokeCap(ArenaVector<factory::StrokePart>& parts, LineCap lineCap,
+                         glm::vec2 position, glm::vec2 inner, float length) {
+    factory::StrokePart part;
+    part.length = length;
+    part.a = position;
+    part.b = inner;
+    if(lineCap == LineCap::Round)
+        part.type = factory::StrokePart::Type::Round;
+    else if(lineCap == LineCap::Square)
+        part.type = factory::StrokePart::Type::SquareCap;
+    else
+        return;
+    parts.push_back(part);
+}
+
+ArenaVector<factory::StrokePart> Context::internalStrokeParts(bool splitDashes) {
+    BVG_TRACE_ZONE("internalStrokeParts");
+    BVG_STATS_TIMER(mFrameStats.strokingTime);
+    ArenaVector<factory::StrokePart> parts(&mArena);
+    
+    bool isLineDash = splitDashes && this->lineDash.gapLength != 0.0f;
+    factory::Polylines dashedPolylines(&mArena);
+    if(isLineDash)
+        dashedPolylines = this->dashPolylines();
+    factory::Polylines& allPolylines = isLineDash ? dashedPolylines : this->mPolylines;
+    
+    // Zero length segments have no direction to extrude along
+    ArenaScope scope(&mScratchArena);
+    factory::Polylines polylines(&mScratchArena);
+    for(factory::Polyline& polyline : allPolylines) {
+        factory::Polyline points(&mScratchArena);
+        for(glm::vec2& point : polyline) {
+            if(points.empty() || !isApproxEqualVec2(points.back(), point))
+                points.push_back(point);
+        }
+        if(points.size() >= 2)
+            polylines.push_back(std::move(points));
+    }
+    if(polylines.empty())
+        return parts;
+    
+    bool isStartEndTooClose = true;
+    if(isLineDash)
+        isStartEndTooClose = isApproxEqualVec2(polylines.front().front(),
+                                               polylines.back().back());
+    
+    bool isConnectedWithPrevious = false;
+    float length = 0.0f;
+    for(size_t i = 0; i < polylines.size(); i++) {
+        bool isFirst = i == 0;
+        bool isLast = i == polylines.size() - 1;
+        bool addStartCap = !isConnectedWithPrevious;
+        bool addEndCap = false;
+        
+        factory::Polyline& polyline = polylines[i];
+        size_t numPoints = polyline.size();
+        float startLength = length;
+        for(size_t j = 0; j + 1 < numPoints; j++) {
+            factory::StrokePart segment;
+            segment.a = polyline[j];
+            segment.b = polyline[j + 1];
+            segment.length = length;
+            parts.push_back(segment);
+            length += glm::distance(segment.a, segment.b);
+            if(j > 0)
+                addStrokeJoin(parts, this->lineJoin, polyline[j - 1], polyline[j],
+                              polyline[j + 1], segment.length);
+        }
+        
+        if(!isLast || mIsPolylineClosed) {
+            factory::Polyline& nextPolyline = mIsPolylineClosed && isLast
+                                              ? polylines[0] : polylines[i + 1];
+            if(isApproxEqualVec2(polyline.back(), nextPolyline.front())) {
+                isConnectedWithPrevious = true;
+                addStrokeJoin(parts, this->lineJoin, polyline[numPoints - 2], polyline.back(),
+                              nextPolyline[1], length);
+            } else {
+                isConnectedWithPrevious = false;
+                addEndCap = true;
+            }
+        }
+        if(isLast)
+            addEndCap = true;
+        
+        if(mIsPolylineClosed && isStartEndTooClose) {
+            if(isFirst)
+                addStartCap = false;
+            if(isLast)
+                addEndCap = false;
+        }
+        
+        if(addStartCap)
+            addStrokeCap(parts, this->lineCap, polyline[0], polyline[1], startLength);
+        if(addEndCap)
+            addStrokeCap(parts, this->lineCap, polyline[numPoints - 1], polyline[numPoints - 2],
+                         length);
+    }
+    return parts;
+}
+
 void Context::beginClip() {
     
 }
@@ -999,6 +2109,14 @@ void Context::endClip() {
     
 }
 
+void Context::popClip() {
+    
+}
+
+int Context::clipDepth() {
+    return 0;
+}
+
 void Context::clearClip() {
     
 }
@@ -1007,6 +2125,70 @@ void Context::convexFill() {
     
 }
 
+void Context::fillInstanced(const Instance* instances, size_t count) {
+    glm::mat3 matrix = this->matrix;
+    Style style = std::move(this->fillStyle);
+    // Only the color changes between instances
+    this->fillStyle = SolidColor(colors::Black);
+    for(size_t i = 0; i < count; i++) {
+        this->matrix = matrix * instances[i].matrix;
+        this->fillStyle.color = instances[i].color;
+        this->fill();
+    }
+    this->matrix = matrix;
+    this->fillStyle = std::move(style);
+}
+
+void Context::strokeSegments(const Segment* segments, size_t count) {
+    ArenaScope scope(&mScratchArena);
+    ArenaVector<Instance> quads(count, &mScratchArena);
+    for(size_t i = 0; i < count; i++)
+        quads[i] = Instance(factory::segmentQuad(segments[i]), segments[i].color);
+    this->fillQuads(quads.data(), count);
+}
+
+void Context::fillRects(const Rect* rects, size_t count) {
+    ArenaScope scope(&mScratchArena);
+    ArenaVector<Instance> quads(count, &mScratchArena);
+    for(size_t i = 0; i < count; i++)
+        quads[i] = Instance(factory::rectQuad(rects[i]), rects[i].color);
+    this->fillQuads(quads.data(), count);
+}
+
+void Context::fillPoints(const Point* points, size_t count) {
+    ArenaScope scope(&mScratchArena);
+    ArenaVector<Instance> quads(count, &mScratchArena);
+    for(size_t i = 0; i < count; i++)
+        quads[i] = Instance(factory::pointQuad(points[i]), points[i].color);
+    this->fillQuads(quads.data(), count);
+}
+
+void Context::fillQuads(const Instance* quads, size_t count) {
+    ArenaScope scope(&mScratchArena);
+    ArenaVector<glm::mat3> transforms(&mScratchArena);
+    size_t first = 0;
+    while(first < count) {
+        size_t last = first + 1;
+        while(last < count && isEqualColor(quads[last].color, quads[first].color))
+            last++;
+        transforms.resize(last - first);
+        for(size_t i = first; i < last; i++)
+            transforms[i - first] = quads[i].matrix;
+        // Meshes are drawn right away, so every one reuses the memory
+        ArenaScope meshScope(&mScratchArena);
+        factory::ShapeMesh mesh = factory::quads(transforms.data(), transforms.size(),
+                                                 &mScratchArena);
+        Style style = SolidColor(quads[first].color);
+        mFrameStats.fill.add(mesh);
+        this->fillMesh(mesh, style);
+        first = last;
+    }
+}
+
+void Context::fillMesh(factory::ShapeMesh& mesh, Style& style) {
+    
+}
+
 void Context::fill() {
     
 }
@@ -1032,6 +2214,8 @@ float Context::measureTextHeight() {
 }
 
 void Context::arc(float x, float y, float radius, float startAngle, float endAngle) {
+    BVG_STATS_TIMER(mFrameStats.flatteningTime);
+    bool isFirst = mPolylines.empty();
     int segments = 32;
     if(radius > 30.0f)
         segments = 48;
@@ -1040,16 +2224,56 @@ void Context::arc(float x, float y, float radius, float startAngle, float endAng
     
     // Invert the angles to make the rotation clockwise
     mPolylines.push_back(factory::createArc(-startAngle, -endAngle, radius, segments,
-                                            glm::vec2(x, y)));
+                                            glm::vec2(x, y), &mPathArena));
+    mFrameStats.flattenedPoints += mPolylines.back().size();
     mCurrentPos = mPolylines.back().back();
+    
+    mAnalyticShape = AnalyticShape();
+    if(isFirst && std::abs(endAngle - startAngle) >= M_PI * 2.0f) {
+        mAnalyticShape.type = AnalyticShape::Type::Ellipse;
+        mAnalyticShape.center = glm::vec2(x, y);
+        mAnalyticShape.halfSize = glm::vec2(radius);
+    }
+}
+
+void Context::ellipse(float x, float y, float radiusX, float radiusY) {
+    bool isFirst = mPolylines.empty();
+    float radius = std::max(radiusX, radiusY);
+    int segments = 32;
+    if(radius > 30.0f)
+        segments = 48;
+    if(radius > 60.0f)
+        segments = 64;
+    
+    factory::Polyline polyline = factory::createArc(0.0f, -M_PI * 2.0f, 1.0f, segments,
+                                                    glm::vec2(0.0f), &mPathArena);
+    for(glm::vec2& point : polyline)
+        point = point * glm::vec2(radiusX, radiusY) + glm::vec2(x, y);
+    mPolylines.push_back(std::move(polyline));
+    mCurrentPos = mPolylines.back().back();
+    
+    mAnalyticShape = AnalyticShape();
+    if(isFirst) {
+        mAnalyticShape.type = AnalyticShape::Type::Ellipse;
+        mAnalyticShape.center = glm::vec2(x, y);
+        mAnalyticShape.halfSize = glm::vec2(radiusX, radiusY);
+    }
 }
 
 void Context::rect(float x, float y, float width, float height) {
+    bool isFirst = mPolylines.empty();
     this->moveTo(x, y);
     this->lineTo(x + width, y);
     this->lineTo(x + width, y + height);
     this->lineTo(x, y+height);
     this->closePath();
+    
+    if(isFirst) {
+        mAnalyticShape.type = AnalyticShape::Type::RoundedRect;
+        mAnalyticShape.center = glm::vec2(x + width / 2.0f, y + height / 2.0f);
+        mAnalyticShape.halfSize = glm::abs(glm::vec2(width, height)) / 2.0f;
+        mAnalyticShape.radii = glm::vec4(0.0f);
+    }
 }
 
 void Context::rect(float x, float y, float width, float height, float radius) {
@@ -1059,6 +2283,12 @@ void Context::rect(float x, float y, float width, float height, float radius) {
 void Context::rect(float x, float y, float width, float height,
                    float topLeftRadius, float topRightRadius,
                    float bottomRightRadius, float bottomLeftRadius) {
+    if(topLeftRadius == 0.0f && topRightRadius == 0.0f &&
+       bottomRightRadius == 0.0f && bottomLeftRadius == 0.0f) {
+        this->rect(x, y, width, height);
+        return;
+    }
+    bool isFirst = mPolylines.empty();
     float right = x + width;
     float bottom = y + height;
     this->moveTo(x, y + topLeftRadius);
@@ -1070,6 +2300,18 @@ void Context::rect(float x, float y, float width, float height,
     this->lineTo(x + bottomLeftRadius, bottom);
     this->quadraticTo(x, bottom, x, bottom - bottomLeftRadius);
     this->closePath();
+    
+    if(isFirst) {
+        glm::vec2 halfSize = glm::abs(glm::vec2(width, height)) / 2.0f;
+        float maxRadius = std::min(halfSize.x, halfSize.y);
+        mAnalyticShape.type = AnalyticShape::Type::RoundedRect;
+        mAnalyticShape.center = glm::vec2(x + width / 2.0f, y + height / 2.0f);
+        mAnalyticShape.halfSize = halfSize;
+        mAnalyticShape.radii = glm::vec4(std::min(topLeftRadius, maxRadius),
+                                         std::min(topRightRadius, maxRadius),
+                                         std::min(bottomRightRadius, maxRadius),
+                                         std::min(bottomLeftRadius, maxRadius));
+    }
 }
 
 void Context::translate(float x, float y) {
@@ -1131,9 +2373,107 @@ void Context::loadFontFromMemory(std::string& json,
                                 int height,
                                 int numChannels)
 {
+    BVG_TRACE_ZONE("loadFontFromMemory");
+    assert(imageData != nullptr);
+    
+    unsigned char* bytes = (unsigned char*)imageData;
+    std::vector<unsigned char> pixels(bytes, bytes + (size_t)width * height * numChannels);
+    Font::Data data = Font::prepare(json, std::move(pixels), width, height, numChannels);
+    
+    Font* font = this->createFont();
+    font->upload(data);
+    this->fonts[fontName] = font;
+}
+
+Font* Context::loadFontFromMemoryAsync(std::string json,
+                                       std::string fontName,
+                                       std::vector<unsigned char> imageData,
+                                       int width,
+                                       int height,
+                                       int numChannels)
+{
+    Font* font = this->createFont();
+    this->fonts[fontName] = font;
+    
+    // Only parsing and pixel conversion are done on the worker.
+    // Textures and buffers are created later on the thread which
+    // draws with this context
+    PendingFont pending;
+    pending.font = font;
+    pending.data = std::async(std::launch::async,
+                              [json = std::move(json), imageData = std::move(imageData),
+                               width, height, numChannels]() mutable {
+        return Font::prepare(json, std::move(imageData), width, height, numChannels);
+    });
+    mPendingFonts.push_back(std::move(pending));
+    return font;
+}
+
+void Context::waitForFonts() {
+    this->uploadPendingFonts(true);
+}
+
+void Context::uploadPendingFonts(bool wait) {
+    BVG_TRACE_ZONE("uploadPendingFonts");
+    for(auto it = mPendingFonts.begin(); it != mPendingFonts.end();) {
+        if(!wait && it->data.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            it++;
+            continue;
+        }
+        Font::Data data = it->data.get();
+        it->font->upload(data);
+        it = mPendingFonts.erase(it);
+    }
+}
+
+Font* Context::createFont() {
+    return new Font();
+}
+
+std::vector<unsigned char> convertRGBToRGBA(std::vector<unsigned char>& pixels,
+                                            int width,
+                                            int height)
+{
+    std::vector<unsigned char> newImage((size_t)width * height * 4);
+    for(size_t i = 0; i < (size_t)width * height; i++) {
+        size_t oldIndex = i * 3LL;
+        size_t newIndex = i * 4LL;
+        newImage[newIndex] = pixels[oldIndex]; // Red
+        newImage[newIndex + 1LL] = pixels[oldIndex + 1LL]; // Green
+        newImage[newIndex + 2LL] = pixels[oldIndex + 2LL]; // Blue
+        newImage[newIndex + 3LL] = 255; // Alpha
+    }
+    return newImage;
+}
+
+Font::Data Font::prepare(std::string& json,
+                         std::vector<unsigned char> pixels,
+                         int width,
+                         int height,
+                         int numChannels)
+{
+    BVG_TRACE_ZONE("Font::prepare");
+    Data data;
+    parseJson(json, data);
+    data.width = width;
+    data.height = height;
+    if(numChannels == 3) {
+        data.pixels = convertRGBToRGBA(pixels, width, height);
+        data.numChannels = 4;
+    } else {
+        data.pixels = std::move(pixels);
+        data.numChannels = numChannels;
+    }
+    data.json = json;
+    std::string_view pixelBytes((const char*)data.pixels.data(), data.pixels.size());
+    data.key = std::hash<std::string>()(json);
+    data.key = data.key * 31 + (size_t)width;
+    data.key = data.key * 31 + (size_t)height;
+    data.key = data.key * 31 + std::hash<std::string_view>()(pixelBytes);
+    return data;
 }
 
-void Font::parseJson(std::string& json) {
+void Font::parseJson(std::string& json, Data& data) {
     int jsonLength = (int)json.length();
     JSONCPP_STRING error;
     Json::Value root;
@@ -1146,22 +2486,23 @@ void Font::parseJson(std::string& json) {
     }
     
     Json::Value atlas = root["atlas"];
-    this->distanceRange = atlas["distanceRange"].asInt();
-    this->size = atlas["size"].asInt();
-    this->atlas.width = atlas["width"].asInt();
-    this->atlas.height = atlas["height"].asInt();
+    data.distanceRange = atlas["distanceRange"].asInt();
+    data.size = atlas["size"].asInt();
+    data.atlas.width = atlas["width"].asInt();
+    data.atlas.height = atlas["height"].asInt();
     
     Json::Value metrics = root["metrics"];
-    this->lineHeight = (int)((float)this->size * metrics["lineHeight"].asFloat());
-    float bl = (float)this->lineHeight - (float)this->size * fabsf(metrics["descender"].asFloat());
-    this->baseline = (int)bl;
+    data.lineHeight = (int)((float)data.size * metrics["lineHeight"].asFloat());
+    float bl = (float)data.lineHeight - (float)data.size * fabsf(metrics["descender"].asFloat());
+    data.baseline = (int)bl;
     
     Json::Value glyphs = root["glyphs"];
+    data.characters.reserve(glyphs.size());
     for(auto it = glyphs.begin(); it != glyphs.end(); it++) {
         Json::Value & g = *it;
         Character c;
         c.unicode = g["unicode"].asInt();
-        c.advance = (int)((float)this->size * g["advance"].asFloat());
+        c.advance = (int)((float)data.size * g["advance"].asFloat());
         
         Json::Value planeBounds = g["planeBounds"];
         c.planeBounds.left = planeBounds["left"].asFloat();
@@ -1174,22 +2515,37 @@ void Font::parseJson(std::string& json) {
         c.atlasBounds.left = atlasBounds["left"].asFloat();
         c.atlasBounds.right = atlasBounds["right"].asFloat();
         // The same with the atlas bounds. We need to invert Y
-        c.atlasBounds.top = (float)this->atlas.height - atlasBounds["top"].asFloat();
-        c.atlasBounds.bottom = (float)this->atlas.height - atlasBounds["bottom"].asFloat();
+        c.atlasBounds.top = (float)data.atlas.height - atlasBounds["top"].asFloat();
+        c.atlasBounds.bottom = (float)data.atlas.height - atlasBounds["bottom"].asFloat();
         
         // Normalize to range (0, 1)
-        c.atlasBounds.left /= (float)this->atlas.width;
-        c.atlasBounds.right /= (float)this->atlas.width;
-        c.atlasBounds.top /= (float)this->atlas.height;
-        c.atlasBounds.bottom /= (float)this->atlas.height;
-        this->loadCharacter(c);
+        c.atlasBounds.left /= (float)data.atlas.width;
+        c.atlasBounds.right /= (float)data.atlas.width;
+        c.atlasBounds.top /= (float)data.atlas.height;
+        c.atlasBounds.bottom /= (float)data.atlas.height;
+        data.characters.push_back(c);
     }
 }
 
+void Font::upload(Data& data) {
+    this->atlas = data.atlas;
+    this->size = data.size;
+    this->lineHeight = data.lineHeight;
+    this->baseline = data.baseline;
+    this->distanceRange = data.distanceRange;
+    for(Character& c : data.characters)
+        this->loadCharacter(c);
+    this->isLoaded = true;
+}
+
 void Font::loadCharacter(Character& character) {
     
 }
 
+Font::~Font()
+{
+}
+
 void Context::assertDrawingIsBegan() {
     if(!mDrawingBegan) {
         std::cerr << "blazevg: Error: beginDrawing() is not called" << std::endl;
@@ -1246,58 +2602,105 @@ bool isPointInsideShapeMesh(float x, float y, factory::ShapeMesh& mesh, glm::mat
     return false;
 }
 
+bool Context::isPathAxisAlignedRect(glm::vec2& min, glm::vec2& max) {
+    if(mPolylines.empty() || mPolylines.front().empty())
+        return false;
+    // Exactly one subpath, so every polyline continues the previous one
+    for(size_t i = 1; i < mPolylines.size(); i++) {
+        if(mPolylines[i].empty() ||
+           !isApproxEqualVec2(mPolylines[i - 1].back(), mPolylines[i].front()))
+            return false;
+    }
+    
+    ArenaScope scope(&mScratchArena);
+    factory::Polyline points = this->toOnePolyline(mPolylines, &mScratchArena);
+    // And it's closed
+    if(points.size() != 5 || !isApproxEqualVec2(points.front(), points.back()))
+        return false;
+    points.pop_back();
+    
+    for(glm::vec2& point : points)
+        point = this->matrix * glm::vec3(point, 1.0f);
+    
+    // Every edge is either horizontal or vertical, and they alternate
+    const float epsilon = 0.001f;
+    bool isFirstHorizontal = fabsf(points[1].y - points[0].y) < epsilon;
+    for(int i = 0; i < 4; i++) {
+        glm::vec2 edge = points[(i + 1) % 4] - points[i];
+        bool isHorizontal = (i % 2 == 0) == isFirstHorizontal;
+        if(isHorizontal && fabsf(edge.y) >= epsilon)
+            return false;
+        if(!isHorizontal && fabsf(edge.x) >= epsilon)
+            return false;
+    }
+    
+    min = glm::min(glm::min(points[0], points[1]), glm::min(points[2], points[3]));
+    max = glm::max(glm::max(points[0], points[1]), glm::max(points[2], points[3]));
+    return true;
+}
+
 bool Context::isPointInsideStroke(float x, float y) {
+    // Hit tests may run between frames, when nothing resets the arena
+    ArenaScope scope(&mArena);
     factory::ShapeMesh mesh = this->internalStroke();
     return isPointInsideShapeMesh(x, y, mesh, this->matrix);
 }
 
 bool Context::isPointInsideConvexFill(float x, float y) {
+    // Hit tests may run between frames, when nothing resets the arena
+    ArenaScope scope(&mArena);
     factory::ShapeMesh mesh = this->internalConvexFill();
     return isPointInsideShapeMesh(x, y, mesh, this->matrix);
 }
 
 bool Context::isPointInsideFill(float x, float y) {
+    // Hit tests may run between frames, when nothing resets the arena
+    ArenaScope scope(&mArena);
     factory::ShapeMesh mesh = this->internalFill();
     return isPointInsideShapeMesh(x, y, mesh, this->matrix);
 }
 
 namespace earcut {
 
-std::vector<factory::TriangeIndices> triangulate(std::vector<glm::vec2>& vertices) {
-    std::vector<factory::TriangeIndices> tris;
+ArenaVector<factory::TriangeIndices> triangulate(Span<glm::vec2> vertices,
+                                                 Arena* arena) {
+    BVG_TRACE_ZONE("earcut::triangulate");
+    ArenaVector<factory::TriangeIndices> tris(arena);
 
     if(vertices.size() < 3)
         return tris;
     
+    // Exactly this many are made, so the triangles never move
+    // into the memory that the scope frees
     tris.reserve(vertices.size() - 2);
     
-    std::list<int> left;
-    for(int i = 0; i < vertices.size(); i++)
-        left.push_back(i);
+    ArenaScope scope(arena);
     
-    while(left.size() != 2) {
-        auto it = left.begin();
+    // Vertices that are left form a circular doubly linked list
+    int numVertices = (int)vertices.size();
+    ArenaVector<int> prev(numVertices, 0, ArenaAllocator<int>(arena));
+    ArenaVector<int> next(numVertices, 0, ArenaAllocator<int>(arena));
+    for(int i = 0; i < numVertices; i++) {
+        prev[i] = i == 0 ? numVertices - 1 : i - 1;
+        next[i] = i == numVertices - 1 ? 0 : i + 1;
+    }
+    int first = 0;
+    int numLeft = numVertices;
+    
+    while(numLeft != 2) {
+        int it = first;
         while(true) {
-            auto next = circularNext(left, it);
-            auto prev = circularPrev(left, it);
-            
-            glm::vec2 a = vertices.at(*prev);
-            glm::vec2 b = vertices.at(*it);
-            glm::vec2 c = vertices.at(*next);
+            glm::vec2 a = vertices[prev[it]];
+            glm::vec2 b = vertices[it];
+            glm::vec2 c = vertices[next[it]];
             
             float angle = glm::orientedAngle(glm::normalize(c - b),
                                              glm::normalize(a - b));
             
             if(angle >= 0) {
-                glm::vec2 triA = vertices.at(*prev);
-                glm::vec2 triB = vertices.at(*it);
-                glm::vec2 triC = vertices.at(*next);
                 bool isEar = true;
-                for(auto j = left.begin(); j != left.end(); j++) {
-                    if(j == it || j == next || j == prev)
-                        continue;
-                    glm::vec2 point = vertices.at(*j);
-                    if(math::isPointInTriange(triA, triB, triC, point)) {
+                for(int j = next[next[it]]; j != prev[it]; j = next[j]) {
+                    if(math::isPointInTriange(a, b, c, vertices[j])) {
                         isEar = false;
                         break;
                     }
@@ -1306,22 +2709,23 @@ std::vector<factory::TriangeIndices> triangulate(std::vector<glm::vec2>& vertice
                     break;
             }
             
-            if(next == left.begin())
+            if(next[it] == first)
                 break;
             
-            it++;
+            it = next[it];
         }
         
         factory::TriangeIndices tri;
-        auto next = circularNext(left, it);
-        auto prev = circularPrev(left, it);
-        auto curr = it;
-        tri.a = *prev;
-        tri.b = *curr;
-        tri.c = *next;
+        tri.a = prev[it];
+        tri.b = it;
+        tri.c = next[it];
         tris.push_back(tri);
         
-        left.erase(it);
+        next[prev[it]] = next[it];
+        prev[next[it]] = prev[it];
+        if(it == first)
+            first = next[it];
+        numLeft--;
     }
     return tris;
 }
@@ -1329,7 +2733,7 @@ std::vector<factory::TriangeIndices> triangulate(std::vector<glm::vec2>& vertice
 } // namespace earcut
 
 std::vector<factory::TriangeIndices>
-Context::debugTriangulate(std::vector<glm::vec2>& vertices, bool draw) {
+Context::debugTriangulate(Span<glm::vec2> vertices, bool draw) {
     Style prevStyle = this->fillStyle;
     this->fillStyle = SolidColor(colors::Black);
     this->strokeStyle = SolidColor(colors::Black);